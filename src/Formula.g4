@@ -9,10 +9,16 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | NAME '(' (arg (',' arg)*)? ')'  # Call
     | CELL  # Cell
     | NUMBER  # Literal
     ;
 
+arg
+    : CELL ':' CELL  # Range
+    | expr  # Argument
+    ;
+
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
 fragment EXPONENT: [eE] INT;
@@ -26,4 +32,5 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+NAME: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
@@ -1,14 +1,21 @@
 #include "FormulaAST.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <utility>
 
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "aggregate.h"
 
 namespace ASTImpl {
 
@@ -38,236 +45,816 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
- public:
-  virtual ~Expr() = default;
-  virtual void Print(std::ostream& out) const = 0;
-  virtual void DoPrintFormula(std::ostream& out,
-                              ExprPrecedence precedence) const = 0;
-  virtual double Evaluate(
-      const std::function<double(Position)>& args) const = 0;
+namespace {
+ExprPrecedence GetPrecedence(const Node& node) {
+  switch (node.type) {
+    case Node::Type::Add:
+      return EP_ADD;
+    case Node::Type::Subtract:
+      return EP_SUB;
+    case Node::Type::Multiply:
+      return EP_MUL;
+    case Node::Type::Divide:
+      return EP_DIV;
+    case Node::Type::UnaryPlus:
+    case Node::Type::UnaryMinus:
+      return EP_UNARY;
+    case Node::Type::Number:
+    case Node::Type::Cell:
+    case Node::Type::Range:
+    case Node::Type::Argument:
+    case Node::Type::Call:
+      return EP_ATOM;
+  }
 
-  // higher is tighter
-  virtual ExprPrecedence GetPrecedence() const = 0;
+  assert(false);
+  return EP_ATOM;
+}
 
-  void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                    bool right_child = false) const {
-    auto precedence = GetPrecedence();
-    auto mask = right_child ? PR_RIGHT : PR_LEFT;
-    bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-    if (parens_needed) {
-      out << '(';
-    }
+char GetOperatorChar(Node::Type type) {
+  switch (type) {
+    case Node::Type::Add:
+    case Node::Type::UnaryPlus:
+      return '+';
+    case Node::Type::Subtract:
+    case Node::Type::UnaryMinus:
+      return '-';
+    case Node::Type::Multiply:
+      return '*';
+    default:
+      assert(type == Node::Type::Divide);
+      return '/';
+  }
+}
 
-    DoPrintFormula(out, precedence);
+constexpr std::string_view FUNCTION_NAMES[] = {"SUM", "MIN", "MAX",
+                                                "AVERAGE", "COUNT"};
 
-    if (parens_needed) {
-      out << ')';
+std::string_view GetFunctionName(Function function) {
+  return FUNCTION_NAMES[int(function)];
+}
+
+std::optional<Function> FindFunction(std::string_view name) {
+  for (size_t i = 0; i < std::size(FUNCTION_NAMES); ++i) {
+    if (FUNCTION_NAMES[i] == name) {
+      return Function(i);
     }
   }
-};
+  return std::nullopt;
+}
 
-namespace {
-class BinaryOpExpr final : public Expr {
- public:
-  enum Type : char {
-    Add = '+',
-    Subtract = '-',
-    Multiply = '*',
-    Divide = '/',
-  };
+Position GetCell(const Node& node) { return {node.cell[0], node.cell[1]}; }
 
- public:
-  explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs,
-                        std::unique_ptr<Expr> rhs)
-      : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
-
-  void Print(std::ostream& out) const override {
-    out << '(' << static_cast<char>(type_) << ' ';
-    lhs_->Print(out);
-    out << ' ';
-    rhs_->Print(out);
-    out << ')';
+CellRange GetRange(const Node& node, Position shift = {0, 0}) {
+  return {{node.range[0] + shift.row, node.range[1] + shift.col},
+          {node.range[2] + shift.row, node.range[3] + shift.col}};
+}
+
+// Calls f with the value of every argument of a call, first to last.
+template <typename F>
+void ForEachArgument(const Node* nodes, uint32_t argument, F&& f) {
+  if (argument == Node::NO_ARGUMENT) {
+    return;
   }
+  ForEachArgument(nodes, nodes[argument].children[1], f);
+  f(nodes[argument].children[0]);
+}
 
-  void DoPrintFormula(std::ostream& out,
-                      ExprPrecedence precedence) const override {
-    lhs_->PrintFormula(out, precedence);
-    out << static_cast<char>(type_);
-    rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+void PrintCell(std::ostream& out, Position cell) {
+  if (!cell.IsValid()) {
+    out << FormulaError::Category::Ref;
+  } else {
+    out << cell.ToString();
   }
+}
 
-  ExprPrecedence GetPrecedence() const override {
-    switch (type_) {
-      case Add:
-        return EP_ADD;
-      case Subtract:
-        return EP_SUB;
-      case Multiply:
-        return EP_MUL;
-      case Divide:
-        return EP_DIV;
-      default:
-        // have to do this because VC++ has a buggy warning
-        assert(false);
-        return static_cast<ExprPrecedence>(INT_MAX);
+void PrintRange(std::ostream& out, CellRange range) {
+  PrintCell(out, range.first);
+  out << ':';
+  PrintCell(out, range.last);
+}
+
+// Prefix form with every operator in parentheses, for tests.
+void PrintNode(std::ostream& out, const Node* nodes, uint32_t index) {
+  const Node& node = nodes[index];
+  switch (node.type) {
+    case Node::Type::Number:
+      out << node.number;
+      return;
+
+    case Node::Type::Cell:
+      PrintCell(out, GetCell(node));
+      return;
+
+    case Node::Type::Range:
+      PrintRange(out, GetRange(node));
+      return;
+
+    case Node::Type::Call:
+      out << '(' << GetFunctionName(Function(node.children[1]));
+      ForEachArgument(nodes, node.children[0], [&](uint32_t value) {
+        out << ' ';
+        PrintNode(out, nodes, value);
+      });
+      out << ')';
+      return;
+
+    case Node::Type::UnaryPlus:
+    case Node::Type::UnaryMinus:
+      out << '(' << GetOperatorChar(node.type) << ' ';
+      PrintNode(out, nodes, node.children[0]);
+      out << ')';
+      return;
+
+    default:
+      out << '(' << GetOperatorChar(node.type) << ' ';
+      PrintNode(out, nodes, node.children[0]);
+      out << ' ';
+      PrintNode(out, nodes, node.children[1]);
+      out << ')';
+  }
+}
+
+// Cell references are printed moved by the shift, see FormulaTemplates.
+void PrintNodeFormula(std::ostream& out, const Node* nodes, uint32_t index,
+                      ExprPrecedence parent_precedence, Position shift,
+                      bool right_child = false) {
+  const Node& node = nodes[index];
+  const ExprPrecedence precedence = GetPrecedence(node);
+  const auto mask = right_child ? PR_RIGHT : PR_LEFT;
+  const bool parens_needed =
+      PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+  if (parens_needed) {
+    out << '(';
+  }
+
+  switch (node.type) {
+    case Node::Type::Number:
+      out << node.number;
+      break;
+
+    case Node::Type::Cell: {
+      const Position cell = GetCell(node);
+      PrintCell(out, {cell.row + shift.row, cell.col + shift.col});
+      break;
+    }
+
+    case Node::Type::Range:
+      PrintRange(out, GetRange(node, shift));
+      break;
+
+    case Node::Type::Call: {
+      out << GetFunctionName(Function(node.children[1])) << '(';
+      bool first = true;
+      ForEachArgument(nodes, node.children[0], [&](uint32_t value) {
+        if (!first) {
+          out << ',';
+        }
+        first = false;
+        PrintNodeFormula(out, nodes, value, EP_ATOM, shift);
+      });
+      out << ')';
+      break;
     }
+
+    case Node::Type::UnaryPlus:
+    case Node::Type::UnaryMinus:
+      out << GetOperatorChar(node.type);
+      PrintNodeFormula(out, nodes, node.children[0], precedence, shift);
+      break;
+
+    default:
+      PrintNodeFormula(out, nodes, node.children[0], precedence, shift);
+      out << GetOperatorChar(node.type);
+      PrintNodeFormula(out, nodes, node.children[1], precedence, shift,
+                       /* right_child = */ true);
   }
 
-  double Evaluate(const std::function<double(Position)>& args) const override {
-    double value = 0;
-    double lhs = lhs_->Evaluate(args);
-    double rhs = rhs_->Evaluate(args);
+  if (parens_needed) {
+    out << ')';
+  }
+}
 
-    switch (type_) {
-      case Add:
-        value = lhs + rhs;
-        break;
+// Errors of the operators, shared by the tree and the program.
+double CheckFinite(double value) {
+  if (!std::isfinite(value)) {
+    throw FormulaError(FormulaError::Category::Div0);
+  }
+  return value;
+}
 
-      case Subtract:
-        value = lhs - rhs;
-        break;
+double Divide(double lhs, double rhs) {
+  if (rhs == 0) {
+    throw FormulaError(FormulaError::Category::Div0);
+  }
+  return CheckFinite(lhs / rhs);
+}
 
-      case Multiply:
-        value = lhs * rhs;
-        break;
+// The number of slots a call takes on the stack: the lanes of the kernels
+// and the count of values.
+constexpr size_t CALL_SLOTS = aggregate::LANES + 1;
 
-      case Divide:
+// The running result of a call in its slots. The lanes are combined in a
+// fixed order at the end, so the result does not depend on the kernel set.
+class Accumulator {
+ public:
+  Accumulator(Function function, double* slots)
+      : function_(function), slots_(slots) {}
+
+  void Reset() {
+    double initial = 0;
+    if (function_ == Function::Min) {
+      initial = HUGE_VAL;
+    } else if (function_ == Function::Max) {
+      initial = -HUGE_VAL;
+    }
+    std::fill(slots_, slots_ + aggregate::LANES, initial);
+    slots_[aggregate::LANES] = 0;
+  }
 
-        if (rhs != 0) {
-          value = lhs / rhs;
-        } else {
-          throw FormulaError(FormulaError::Category::Div0);
-        }
+  void Add(const double* values, size_t count) {
+    const aggregate::Kernels& kernels = aggregate::GetActiveKernels();
+    switch (function_) {
+      case Function::Sum:
+      case Function::Average:
+        kernels.sum(values, count, slots_);
+        break;
+      case Function::Min:
+        kernels.min(values, count, slots_);
+        break;
+      case Function::Max:
+        kernels.max(values, count, slots_);
         break;
+      case Function::Count:
+        break;
+    }
+    slots_[aggregate::LANES] += double(count);
+  }
 
-      default:
-        throw std::invalid_argument("Unknown binary operator");
+  double GetResult() const {
+    const double count = slots_[aggregate::LANES];
+    double result = slots_[0];
+    for (size_t lane = 1; lane < aggregate::LANES; ++lane) {
+      const double value = slots_[lane];
+      if (function_ == Function::Min) {
+        result = std::min(result, value);
+      } else if (function_ == Function::Max) {
+        result = std::max(result, value);
+      } else {
+        result += value;
+      }
     }
-    if (std::isfinite(value)) {
-      return value;
-    } else {
-      throw FormulaError(FormulaError::Category::Div0);
+
+    switch (function_) {
+      case Function::Sum:
+        return CheckFinite(result);
+      case Function::Min:
+      case Function::Max:
+        return count == 0 ? 0.0 : result;
+      case Function::Average:
+        return Divide(result, count);
+      case Function::Count:
+        return count;
     }
+
+    assert(false);
+    return 0;
   }
 
  private:
-  Type type_;
-  std::unique_ptr<Expr> lhs_;
-  std::unique_ptr<Expr> rhs_;
+  Function function_;
+  double* slots_;
 };
 
-class UnaryOpExpr final : public Expr {
- public:
-  enum Type : char {
-    UnaryPlus = '+',
-    UnaryMinus = '-',
+template <typename Args>
+void ReadColumn(const Args& args, Position first, int count, double* out) {
+  for (int i = 0; i < count; ++i) {
+    out[i] = args(Position{first.row + i, first.col});
+  }
+}
+
+void ReadColumn(const SheetReader& args, Position first, int count,
+                double* out) {
+  args.ReadColumn(first, count, out);
+}
+
+// Reads the range column by column in blocks, so the error of the first
+// failing cell in that order wins, and folds each block into the call.
+template <typename Args>
+void AddRange(const Args& args, CellRange range, Accumulator& accumulator) {
+  constexpr int BLOCK = 256;
+  double block[BLOCK];
+  for (int col = range.first.col; col <= range.last.col; ++col) {
+    for (int row = range.first.row; row <= range.last.row; row += BLOCK) {
+      const int count = std::min(BLOCK, range.last.row - row + 1);
+      ReadColumn(args, Position{row, col}, count, block);
+      accumulator.Add(block, size_t(count));
+    }
+  }
+}
+
+double EvaluateNode(const Node* nodes, uint32_t index,
+                    const std::function<double(Position)>& args) {
+  const Node& node = nodes[index];
+  auto evaluate = [nodes, &args](uint32_t child) {
+    return EvaluateNode(nodes, child, args);
   };
 
+  switch (node.type) {
+    case Node::Type::Number:
+      return node.number;
+
+    case Node::Type::Cell:
+      return args(GetCell(node));
+
+    case Node::Type::UnaryPlus:
+      return evaluate(node.children[0]);
+
+    case Node::Type::UnaryMinus:
+      return -evaluate(node.children[0]);
+
+    case Node::Type::Call: {
+      // Arguments are evaluated in order, so the errors of the earlier ones
+      // win.
+      double slots[CALL_SLOTS];
+      Accumulator accumulator(Function(node.children[1]), slots);
+      accumulator.Reset();
+      ForEachArgument(nodes, node.children[0], [&](uint32_t value) {
+        if (nodes[value].type == Node::Type::Range) {
+          AddRange(args, GetRange(nodes[value]), accumulator);
+        } else {
+          const double number = evaluate(value);
+          accumulator.Add(&number, 1);
+        }
+      });
+      return accumulator.GetResult();
+    }
+
+    case Node::Type::Range:
+    case Node::Type::Argument:
+      throw std::invalid_argument("Argument outside of a call");
+
+    default:
+      break;
+  }
+
+  // The left argument is evaluated first, so its errors win.
+  const double lhs = evaluate(node.children[0]);
+  const double rhs = evaluate(node.children[1]);
+  switch (node.type) {
+    case Node::Type::Add:
+      return CheckFinite(lhs + rhs);
+    case Node::Type::Subtract:
+      return CheckFinite(lhs - rhs);
+    case Node::Type::Multiply:
+      return CheckFinite(lhs * rhs);
+    case Node::Type::Divide:
+      return Divide(lhs, rhs);
+    default:
+      throw std::invalid_argument("Unknown binary operator");
+  }
+}
+
+// Collects the nodes and cells of a formula while it is parsed, in buffers
+// reused by the thread, so that only the finished formula allocates.
+class TreeBuilder {
  public:
-  explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-      : type_(type), operand_(std::move(operand)) {}
+  TreeBuilder() {
+    nodes_.clear();
+    cells_.clear();
+    ranges_.clear();
+  }
+  TreeBuilder(const TreeBuilder&) = delete;
+  TreeBuilder& operator=(const TreeBuilder&) = delete;
+
+  uint32_t AddNumber(double number) {
+    Node node{};
+    node.type = Node::Type::Number;
+    node.number = number;
+    return Add(node);
+  }
 
-  void Print(std::ostream& out) const override {
-    out << '(' << static_cast<char>(type_) << ' ';
-    operand_->Print(out);
-    out << ')';
+  uint32_t AddCell(Position cell) {
+    cells_.push_back(cell);
+    Node node{};
+    node.type = Node::Type::Cell;
+    node.cell[0] = cell.row;
+    node.cell[1] = cell.col;
+    return Add(node);
+  }
+
+  // The corners may come in any order.
+  uint32_t AddRange(Position a, Position b) {
+    const CellRange range = CellRange::FromCorners(a, b);
+    ranges_.push_back(range);
+    Node node{};
+    node.type = Node::Type::Range;
+    node.range[0] = uint16_t(range.first.row);
+    node.range[1] = uint16_t(range.first.col);
+    node.range[2] = uint16_t(range.last.row);
+    node.range[3] = uint16_t(range.last.col);
+    return Add(node);
+  }
+
+  // Arguments are added in order, each linked to the one before it.
+  uint32_t AddArgument(uint32_t value, uint32_t previous) {
+    Node node{};
+    node.type = Node::Type::Argument;
+    node.children[0] = value;
+    node.children[1] = previous;
+    return Add(node);
   }
 
-  void DoPrintFormula(std::ostream& out,
-                      ExprPrecedence precedence) const override {
-    out << static_cast<char>(type_);
-    operand_->PrintFormula(out, precedence);
+  uint32_t AddCall(Function function, uint32_t last_argument) {
+    Node node{};
+    node.type = Node::Type::Call;
+    node.children[0] = last_argument;
+    node.children[1] = uint32_t(function);
+    return Add(node);
   }
 
-  ExprPrecedence GetPrecedence() const override { return EP_UNARY; }
+  uint32_t AddUnary(Node::Type type, uint32_t operand) {
+    Node node{};
+    node.type = type;
+    node.children[0] = operand;
+    return Add(node);
+  }
+
+  uint32_t AddBinary(Node::Type type, uint32_t lhs, uint32_t rhs) {
+    Node node{};
+    node.type = type;
+    node.children[0] = lhs;
+    node.children[1] = rhs;
+    return Add(node);
+  }
 
-  double Evaluate(const std::function<double(Position)>& args) const override {
-    return type_ == UnaryPlus ? operand_->Evaluate(args)
-                              : -operand_->Evaluate(args);
+  // Every node is added after its children, so the root comes last.
+  FormulaAST Build(uint32_t root) {
+    assert(root + 1 == nodes_.size());
+    std::sort(cells_.begin(), cells_.end());
+    std::sort(ranges_.begin(), ranges_.end());
+    return FormulaAST(nodes_, cells_, ranges_);
   }
 
  private:
-  Type type_;
-  std::unique_ptr<Expr> operand_;
+  uint32_t Add(const Node& node) {
+    nodes_.push_back(node);
+    return uint32_t(nodes_.size() - 1);
+  }
+
+  static thread_local std::vector<Node> nodes_;
+  static thread_local std::vector<Position> cells_;
+  static thread_local std::vector<CellRange> ranges_;
 };
 
-class CellExpr final : public Expr {
+thread_local std::vector<Node> TreeBuilder::nodes_;
+thread_local std::vector<Position> TreeBuilder::cells_;
+thread_local std::vector<CellRange> TreeBuilder::ranges_;
+
+// Tokens of Formula.g4. The text points into the parsed string.
+struct Token {
+  enum Type {
+    Number,
+    Cell,
+    Name,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    LeftParen,
+    RightParen,
+    Colon,
+    Comma,
+    End,
+  };
+
+  Type type;
+  std::string_view text;
+};
+
+// Splits the input like the generated FormulaLexer, without copying it.
+class Lexer {
  public:
-  explicit CellExpr(const Position* cell) : cell_(cell) {}
+  explicit Lexer(std::string_view in) : in_(in) { Advance(); }
 
-  void Print(std::ostream& out) const override {
-    if (!cell_->IsValid()) {
-      out << FormulaError::Category::Ref;
-    } else {
-      out << cell_->ToString();
+  const Token& Peek() const { return token_; }
+
+  Token Next() {
+    Token token = token_;
+    Advance();
+    return token;
+  }
+
+ private:
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+  static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+  static bool IsUpper(char c) { return c >= 'A' && c <= 'Z'; }
+
+  size_t SkipDigits(size_t pos) const {
+    while (pos < in_.size() && IsDigit(in_[pos])) {
+      ++pos;
     }
+    return pos;
   }
 
-  void DoPrintFormula(std::ostream& out,
-                      ExprPrecedence /* precedence */) const override {
-    Print(out);
+  // End of the longest NUMBER starting at pos, or pos if there is none.
+  size_t MatchNumber(size_t pos) const {
+    size_t end = SkipDigits(pos);
+    if (end < in_.size() && in_[end] == '.') {
+      const size_t fraction_end = SkipDigits(end + 1);
+      if (fraction_end == end + 1) {
+        return end;  // a dot needs digits after it
+      }
+      end = fraction_end;
+    } else if (end == pos) {
+      return pos;
+    }
+
+    if (end < in_.size() && (in_[end] == 'e' || in_[end] == 'E')) {
+      size_t exponent = end + 1;
+      if (exponent < in_.size() &&
+          (in_[exponent] == '+' || in_[exponent] == '-')) {
+        ++exponent;
+      }
+      const size_t exponent_end = SkipDigits(exponent);
+      if (exponent_end != exponent) {
+        end = exponent_end;
+      }
+    }
+    return end;
   }
 
-  ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
+  void Advance() {
+    while (pos_ < in_.size() && IsSpace(in_[pos_])) {
+      ++pos_;
+    }
+
+    const size_t start = pos_;
+    if (start == in_.size()) {
+      token_ = {Token::End, {}};
+      return;
+    }
 
-  double Evaluate(const std::function<double(Position)>& args) const override {
-    return args(*cell_);
+    Token::Type type;
+    switch (in_[start]) {
+      case '+':
+        type = Token::Add;
+        ++pos_;
+        break;
+      case '-':
+        type = Token::Subtract;
+        ++pos_;
+        break;
+      case '*':
+        type = Token::Multiply;
+        ++pos_;
+        break;
+      case '/':
+        type = Token::Divide;
+        ++pos_;
+        break;
+      case '(':
+        type = Token::LeftParen;
+        ++pos_;
+        break;
+      case ')':
+        type = Token::RightParen;
+        ++pos_;
+        break;
+      case ':':
+        type = Token::Colon;
+        ++pos_;
+        break;
+      case ',':
+        type = Token::Comma;
+        ++pos_;
+        break;
+      default:
+        if (IsUpper(in_[start])) {
+          while (pos_ < in_.size() && IsUpper(in_[pos_])) {
+            ++pos_;
+          }
+          // Letters alone name a function.
+          const size_t digits = pos_;
+          pos_ = SkipDigits(digits);
+          type = pos_ == digits ? Token::Name : Token::Cell;
+        } else {
+          type = Token::Number;
+          pos_ = MatchNumber(start);
+          if (pos_ == start) {
+            Fail(start);
+          }
+        }
+    }
+    token_ = {type, in_.substr(start, pos_ - start)};
   }
 
- private:
-  const Position* cell_;
+  [[noreturn]] void Fail(size_t pos) const {
+    throw ParsingError("Error when lexing at " + std::to_string(pos) + ": '" +
+                       std::string(in_.substr(pos)) + "'");
+  }
+
+  std::string_view in_;
+  size_t pos_ = 0;
+  Token token_;
 };
 
-class NumberExpr final : public Expr {
+Position ReadCell(std::string_view text) {
+  const Position cell = Position::FromString(text);
+  if (!cell.IsValid()) {
+    throw FormulaException("Invalid position: " + std::string(text));
+  }
+  return cell;
+}
+
+// Pratt parser for Formula.g4. Binary operators are left associative and
+// unary ones bind tighter than any binary operator, as in the generated
+// parser. It allocates nothing but the finished formula.
+class Parser {
  public:
-  explicit NumberExpr(double value) : value_(value) {}
+  explicit Parser(std::string_view in) : lexer_(in) {}
+
+  FormulaAST Parse() {
+    const uint32_t root = ParseExpr(0);
+    Expect(Token::End);
+    return builder_.Build(root);
+  }
+
+ private:
+  // A binary operator continues the current expression if it binds tighter
+  // than the one the expression is the right argument of.
+  static constexpr int UNARY_POWER = 3;
+
+  static int GetBindingPower(Token::Type type) {
+    switch (type) {
+      case Token::Add:
+      case Token::Subtract:
+        return 1;
+      case Token::Multiply:
+      case Token::Divide:
+        return 2;
+      default:
+        return 0;
+    }
+  }
+
+  uint32_t ParseExpr(int min_power) {
+    return ParseInfix(ParsePrefix(), min_power);
+  }
+
+  // Continues the expression whose first operand is parsed already.
+  uint32_t ParseInfix(uint32_t lhs, int min_power) {
+    for (;;) {
+      const Token::Type type = lexer_.Peek().type;
+      const int power = GetBindingPower(type);
+      if (power <= min_power) {
+        return lhs;
+      }
+
+      lexer_.Next();
+      const uint32_t rhs = ParseExpr(power);
+      lhs = builder_.AddBinary(GetBinaryType(type), lhs, rhs);
+    }
+  }
+
+  uint32_t ParsePrefix() {
+    const Token token = lexer_.Next();
+    switch (token.type) {
+      case Token::Add:
+        return builder_.AddUnary(Node::Type::UnaryPlus,
+                                 ParseExpr(UNARY_POWER));
+
+      case Token::Subtract:
+        return builder_.AddUnary(Node::Type::UnaryMinus,
+                                 ParseExpr(UNARY_POWER));
+
+      case Token::LeftParen: {
+        const uint32_t expr = ParseExpr(0);
+        Expect(Token::RightParen);
+        return expr;
+      }
 
-  void Print(std::ostream& out) const override { out << value_; }
+      case Token::Number:
+        return builder_.AddNumber(ParseNumber(token.text));
 
-  void DoPrintFormula(std::ostream& out,
-                      ExprPrecedence /* precedence */) const override {
-    out << value_;
+      case Token::Cell:
+        return builder_.AddCell(ReadCell(token.text));
+
+      case Token::Name:
+        return ParseCall(token.text);
+
+      default:
+        throw ParsingError("Unexpected token: '" + std::string(token.text) +
+                           "'");
+    }
   }
 
-  ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
+  uint32_t ParseCall(std::string_view name) {
+    const std::optional<Function> function = FindFunction(name);
+    if (!function) {
+      throw ParsingError("Unknown function: " + std::string(name));
+    }
 
-  double Evaluate(const std::function<double(Position)>& args) const override {
-    return value_;
+    Expect(Token::LeftParen);
+    uint32_t argument = Node::NO_ARGUMENT;
+    if (!Accept(Token::RightParen)) {
+      do {
+        argument = builder_.AddArgument(ParseArgument(), argument);
+      } while (Accept(Token::Comma));
+      Expect(Token::RightParen);
+    }
+    return builder_.AddCall(*function, argument);
   }
 
- private:
-  double value_;
+  // A range, or an expression that may start with a cell.
+  uint32_t ParseArgument() {
+    if (lexer_.Peek().type != Token::Cell) {
+      return ParseExpr(0);
+    }
+
+    const Position first = ReadCell(lexer_.Next().text);
+    if (!Accept(Token::Colon)) {
+      return ParseInfix(builder_.AddCell(first), 0);
+    }
+
+    const Token last = lexer_.Next();
+    if (last.type != Token::Cell) {
+      throw ParsingError("Unexpected token: '" + std::string(last.text) +
+                         "'");
+    }
+    return builder_.AddRange(first, ReadCell(last.text));
+  }
+
+  static Node::Type GetBinaryType(Token::Type type) {
+    switch (type) {
+      case Token::Add:
+        return Node::Type::Add;
+      case Token::Subtract:
+        return Node::Type::Subtract;
+      case Token::Multiply:
+        return Node::Type::Multiply;
+      default:
+        assert(type == Token::Divide);
+        return Node::Type::Divide;
+    }
+  }
+
+  static double ParseNumber(std::string_view text) {
+    double value = 0;
+    const char* end = text.data() + text.size();
+    const auto [ptr, error] = std::from_chars(text.data(), end, value);
+    if (error != std::errc() || ptr != end) {
+      throw ParsingError("Invalid number: " + std::string(text));
+    }
+    return value;
+  }
+
+  void Expect(Token::Type type) {
+    const Token token = lexer_.Next();
+    if (token.type != type) {
+      throw ParsingError("Unexpected token: '" + std::string(token.text) +
+                         "'");
+    }
+  }
+
+  // Takes the next token if it is of the type.
+  bool Accept(Token::Type type) {
+    if (lexer_.Peek().type != type) {
+      return false;
+    }
+    lexer_.Next();
+    return true;
+  }
+
+  Lexer lexer_;
+  TreeBuilder builder_;
 };
 
 class ParseASTListener final : public FormulaBaseListener {
  public:
-  std::unique_ptr<Expr> MoveRoot() {
+  FormulaAST Build() {
     assert(args_.size() == 1);
-    auto root = std::move(args_.front());
+    const uint32_t root = args_.front();
     args_.clear();
 
-    return root;
+    return builder_.Build(root);
   }
 
-  std::forward_list<Position> MoveCells() { return std::move(cells_); }
-
  public:
   void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
     assert(args_.size() >= 1);
 
-    auto operand = std::move(args_.back());
-
-    UnaryOpExpr::Type type;
+    Node::Type type;
     if (ctx->SUB()) {
-      type = UnaryOpExpr::UnaryMinus;
+      type = Node::Type::UnaryMinus;
     } else {
       assert(ctx->ADD() != nullptr);
-      type = UnaryOpExpr::UnaryPlus;
+      type = Node::Type::UnaryPlus;
     }
 
-    auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-    args_.back() = std::move(node);
+    args_.back() = builder_.AddUnary(type, args_.back());
   }
 
   void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -279,8 +866,7 @@ class ParseASTListener final : public FormulaBaseListener {
       throw ParsingError("Invalid number: " + valueStr);
     }
 
-    auto node = std::make_unique<NumberExpr>(value);
-    args_.push_back(std::move(node));
+    args_.push_back(builder_.AddNumber(value));
   }
 
   void exitCell(FormulaParser::CellContext* ctx) override {
@@ -290,34 +876,53 @@ class ParseASTListener final : public FormulaBaseListener {
       throw FormulaException("Invalid position: " + value_str);
     }
 
-    cells_.push_front(value);
-    auto node = std::make_unique<CellExpr>(&cells_.front());
-    args_.push_back(std::move(node));
+    args_.push_back(builder_.AddCell(value));
   }
 
   void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
     assert(args_.size() >= 2);
 
-    auto rhs = std::move(args_.back());
+    const uint32_t rhs = args_.back();
     args_.pop_back();
 
-    auto lhs = std::move(args_.back());
+    const uint32_t lhs = args_.back();
 
-    BinaryOpExpr::Type type;
+    Node::Type type;
     if (ctx->ADD()) {
-      type = BinaryOpExpr::Add;
+      type = Node::Type::Add;
     } else if (ctx->SUB()) {
-      type = BinaryOpExpr::Subtract;
+      type = Node::Type::Subtract;
     } else if (ctx->MUL()) {
-      type = BinaryOpExpr::Multiply;
+      type = Node::Type::Multiply;
     } else {
       assert(ctx->DIV() != nullptr);
-      type = BinaryOpExpr::Divide;
+      type = Node::Type::Divide;
     }
 
-    auto node =
-        std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-    args_.back() = std::move(node);
+    args_.back() = builder_.AddBinary(type, lhs, rhs);
+  }
+
+  void exitRange(FormulaParser::RangeContext* ctx) override {
+    args_.push_back(builder_.AddRange(ReadCell(ctx->CELL(0)->getText()),
+                                      ReadCell(ctx->CELL(1)->getText())));
+  }
+
+  void exitCall(FormulaParser::CallContext* ctx) override {
+    const std::string name = ctx->NAME()->getText();
+    const std::optional<Function> function = FindFunction(name);
+    if (!function) {
+      throw ParsingError("Unknown function: " + name);
+    }
+
+    const size_t count = ctx->arg().size();
+    assert(args_.size() >= count);
+
+    uint32_t argument = Node::NO_ARGUMENT;
+    for (size_t i = args_.size() - count; i < args_.size(); ++i) {
+      argument = builder_.AddArgument(args_[i], argument);
+    }
+    args_.resize(args_.size() - count);
+    args_.push_back(builder_.AddCall(*function, argument));
   }
 
   void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -325,8 +930,8 @@ class ParseASTListener final : public FormulaBaseListener {
   }
 
  private:
-  std::vector<std::unique_ptr<Expr>> args_;
-  std::forward_list<Position> cells_;
+  std::vector<uint32_t> args_;
+  TreeBuilder builder_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -343,10 +948,10 @@ class BailErrorListener : public antlr4::BaseErrorListener {
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str) {
   using namespace antlr4;
 
-  ANTLRInputStream input(in);
+  ANTLRInputStream input(in_str);
 
   FormulaLexer lexer(&input);
   ASTImpl::BailErrorListener error_listener;
@@ -364,34 +969,510 @@ FormulaAST ParseFormulaAST(std::istream& in) {
   ASTImpl::ParseASTListener listener;
   tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-  return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+  return listener.Build();
+}
+
+FormulaAST ParseFormulaAST(std::string_view in) {
+  return ASTImpl::Parser(in).Parse();
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-  std::istringstream in(in_str);
-  return ParseFormulaAST(in);
+FormulaAST ParseFormulaAST(std::istream& in) {
+  const std::string in_str{std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>()};
+  return ParseFormulaAST(in_str);
+}
+
+void AppendRelativeKey(std::string_view in, Position anchor,
+                       std::string& key) {
+  using ASTImpl::Token;
+
+  ASTImpl::Lexer lexer(in);
+  for (Token token = lexer.Next(); token.type != Token::End;
+       token = lexer.Next()) {
+    if (token.type == Token::Cell) {
+      const Position cell = ASTImpl::ReadCell(token.text);
+      key += 'R';
+      key += std::to_string(cell.row - anchor.row);
+      key += 'C';
+      key += std::to_string(cell.col - anchor.col);
+    } else {
+      key += token.text;
+    }
+    key += ' ';  // keeps 1 2 apart from 12
+  }
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
-  for (auto cell : cells_) {
+  for (auto cell : GetCells()) {
     out << cell.ToString() << ' ';
   }
 }
 
-void FormulaAST::Print(std::ostream& out) const { root_expr_->Print(out); }
+void FormulaAST::Print(std::ostream& out) const {
+  ASTImpl::PrintNode(out, GetNodes(), GetRoot());
+}
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-  root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position shift) const {
+  ASTImpl::PrintNodeFormula(out, GetNodes(), GetRoot(), ASTImpl::EP_ATOM,
+                            shift);
 }
 
-double FormulaAST::Execute(const std::function<double(Position)>& args) const {
-  return root_expr_->Evaluate(args);
+double FormulaAST::Execute(const std::function<double(Position)>& args,
+                           Position shift) const {
+  return program_.Execute(args, shift);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                       std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
-  cells_.sort();  // to avoid sorting in GetReferencedCells
+double FormulaAST::Execute(const SheetReader& args, Position shift) const {
+  return program_.Execute(args, shift);
 }
 
-FormulaAST::~FormulaAST() = default;
+double FormulaAST::ExecuteTree(
+    const std::function<double(Position)>& args) const {
+  return ASTImpl::EvaluateNode(GetNodes(), GetRoot(), args);
+}
+
+FormulaAST::FormulaAST(const std::vector<ASTImpl::Node>& nodes,
+                       const std::vector<Position>& cells,
+                       const std::vector<CellRange>& ranges) {
+  using ASTImpl::Node;
+  using ASTImpl::Program;
+  static_assert(sizeof(Node) == 2 * sizeof(uint64_t) &&
+                    sizeof(Position) == sizeof(uint64_t) &&
+                    sizeof(CellRange) == 2 * sizeof(uint64_t) &&
+                    sizeof(Program::Instruction) == sizeof(uint64_t),
+                "the parts of the storage stay 8-byte aligned");
+  assert(!nodes.empty());
+
+  // The code is built in a reused buffer and copied out with the rest, so
+  // a formula takes exactly one allocation.
+  thread_local std::vector<Program::Instruction> code;
+  thread_local std::vector<size_t> operands;
+  code.clear();
+  operands.clear();
+  Program::Builder builder(code, operands);
+  Program::Compile(nodes.data(), uint32_t(nodes.size() - 1), builder);
+
+  node_count_ = uint32_t(nodes.size());
+  cell_count_ = uint32_t(cells.size());
+  range_count_ = uint32_t(ranges.size());
+  words_ = uint32_t(2 * nodes.size() + cells.size() + 2 * ranges.size() +
+                    code.size());
+  storage_ = allocator_.allocate(words_);
+
+  auto* node_storage = reinterpret_cast<Node*>(storage_);
+  auto* cell_storage = reinterpret_cast<Position*>(node_storage + node_count_);
+  auto* range_storage =
+      reinterpret_cast<CellRange*>(cell_storage + cell_count_);
+  auto* code_storage =
+      reinterpret_cast<Program::Instruction*>(range_storage + range_count_);
+  std::uninitialized_copy(nodes.begin(), nodes.end(), node_storage);
+  std::uninitialized_copy(cells.begin(), cells.end(), cell_storage);
+  std::uninitialized_copy(ranges.begin(), ranges.end(), range_storage);
+  std::uninitialized_copy(code.begin(), code.end(), code_storage);
+  program_ = Program(code_storage, code.size(), builder.GetMaxDepth());
+}
+
+FormulaAST::FormulaAST(FormulaAST&& other) noexcept
+    : allocator_(other.allocator_),
+      storage_(std::exchange(other.storage_, nullptr)),
+      words_(std::exchange(other.words_, 0)),
+      node_count_(std::exchange(other.node_count_, 0)),
+      cell_count_(std::exchange(other.cell_count_, 0)),
+      range_count_(std::exchange(other.range_count_, 0)),
+      program_(std::exchange(other.program_, {})) {}
+
+FormulaAST& FormulaAST::operator=(FormulaAST&& other) noexcept {
+  if (this != &other) {
+    if (storage_) {
+      allocator_.deallocate(storage_, words_);
+    }
+    allocator_ = other.allocator_;
+    storage_ = std::exchange(other.storage_, nullptr);
+    words_ = std::exchange(other.words_, 0);
+    node_count_ = std::exchange(other.node_count_, 0);
+    cell_count_ = std::exchange(other.cell_count_, 0);
+    range_count_ = std::exchange(other.range_count_, 0);
+    program_ = std::exchange(other.program_, {});
+  }
+  return *this;
+}
+
+FormulaAST::~FormulaAST() {
+  if (storage_) {
+    allocator_.deallocate(storage_, words_);
+  }
+}
+
+FormulaAST::Cells FormulaAST::GetCells() const {
+  const auto* begin =
+      reinterpret_cast<const Position*>(GetNodes() + node_count_);
+  return Cells(begin, begin + cell_count_);
+}
+
+FormulaAST::Ranges FormulaAST::GetRanges() const {
+  const auto* begin =
+      reinterpret_cast<const CellRange*>(GetCells().end());
+  return Ranges(begin, begin + range_count_);
+}
+
+const ASTImpl::Node* FormulaAST::GetNodes() const {
+  return reinterpret_cast<const ASTImpl::Node*>(storage_);
+}
+
+namespace ASTImpl {
+
+namespace {
+double ReadNumber(const Program::Instruction* word) {
+  double number;
+  std::memcpy(&number, word, sizeof(number));
+  return number;
+}
+
+void WriteNumber(Program::Instruction* word, double number) {
+  std::memcpy(word, &number, sizeof(number));
+}
+
+// The result of a binary operator on constants, unless evaluating it
+// raises an error; those are left to run time.
+std::optional<double> Fold(Program::Opcode opcode, double lhs, double rhs) {
+  double value = 0;
+  switch (opcode) {
+    case Program::Opcode::Add:
+      value = lhs + rhs;
+      break;
+    case Program::Opcode::Subtract:
+      value = lhs - rhs;
+      break;
+    case Program::Opcode::Multiply:
+      value = lhs * rhs;
+      break;
+    case Program::Opcode::Divide:
+      if (rhs == 0) {
+        return std::nullopt;
+      }
+      value = lhs / rhs;
+      break;
+    default:
+      assert(false);
+  }
+  return std::isfinite(value) ? std::optional<double>(value) : std::nullopt;
+}
+
+// Whether x op rhs is x itself. Values on the stack are always finite, so
+// these hold exactly; x + 0 does not, as -0 + 0 is +0.
+bool IsRightIdentity(Program::Opcode opcode, double rhs) {
+  switch (opcode) {
+    case Program::Opcode::Subtract:
+      return rhs == 0;
+    case Program::Opcode::Multiply:
+    case Program::Opcode::Divide:
+      return rhs == 1;
+    default:
+      return false;
+  }
+}
+}  // namespace
+
+void Program::Builder::EmitNumber(double number) {
+  PushOperand();
+  last_ = code_.size();
+  code_.push_back({Opcode::Number, 0, 0, 0});
+  code_.emplace_back();
+  WriteNumber(&code_.back(), number);
+}
+
+void Program::Builder::EmitCell(Position cell) {
+  PushOperand();
+  last_ = code_.size();
+  code_.push_back({Opcode::Cell, 0, uint16_t(cell.col), uint32_t(cell.row)});
+}
+
+void Program::Builder::BeginCall(Function function) {
+  for (size_t slot = 0; slot < CALL_SLOTS; ++slot) {
+    PushOperand();
+  }
+  last_ = code_.size();
+  code_.push_back({Opcode::BeginCall, uint8_t(function), 0, 0});
+}
+
+void Program::Builder::EmitArgument(Function function) {
+  assert(operands_.size() > CALL_SLOTS);
+  operands_.pop_back();
+  last_ = code_.size();
+  code_.push_back({Opcode::AddArgument, uint8_t(function), 0, 0});
+}
+
+void Program::Builder::EmitRangeArgument(Function function, CellRange range) {
+  last_ = code_.size();
+  code_.push_back({Opcode::AddRange, uint8_t(function),
+                   uint16_t(range.first.col), uint32_t(range.first.row)});
+  code_.push_back({Opcode::AddRange, uint8_t(function),
+                   uint16_t(range.last.col), uint32_t(range.last.row)});
+}
+
+void Program::Builder::EndCall(Function function) {
+  // The result takes the place of the first slot.
+  assert(operands_.size() >= CALL_SLOTS);
+  operands_.resize(operands_.size() - (CALL_SLOTS - 1));
+  last_ = code_.size();
+  code_.push_back({Opcode::EndCall, uint8_t(function), 0, 0});
+}
+
+void Program::Builder::EmitOperator(Opcode opcode) {
+  assert(!operands_.empty());
+  const size_t rhs = operands_.back();
+
+  if (opcode == Opcode::Negate) {
+    if (IsNumber(rhs, code_.size())) {
+      WriteNumber(&code_[rhs + 1], -ReadNumber(&code_[rhs + 1]));
+    } else if (last_ + 1 == code_.size() &&
+               code_[last_].opcode == Opcode::Negate) {
+      code_.pop_back();  // --x is x
+      last_ = NONE;
+    } else {
+      last_ = code_.size();
+      code_.push_back({opcode, 0, 0, 0});
+    }
+    return;
+  }
+
+  assert(operands_.size() >= 2);
+  operands_.pop_back();  // the result takes the place of the left argument
+  const size_t lhs = operands_.back();
+
+  const int offset = int(opcode) - int(Opcode::Add);
+  if (IsNumber(rhs, code_.size())) {
+    const double right = ReadNumber(&code_[rhs + 1]);
+    if (IsNumber(lhs, rhs)) {
+      if (const std::optional<double> value =
+              Fold(opcode, ReadNumber(&code_[lhs + 1]), right)) {
+        code_.resize(lhs + 2);
+        WriteNumber(&code_[lhs + 1], *value);
+        last_ = lhs;
+        return;
+      }
+    } else if (IsRightIdentity(opcode, right)) {
+      code_.resize(rhs);
+      last_ = NONE;
+      return;
+    }
+
+    code_[rhs].opcode = Opcode(int(Opcode::AddNumber) + offset);
+    last_ = rhs;
+    return;
+  }
+
+  if (opcode == Opcode::Multiply && IsNumber(lhs, rhs) &&
+      ReadNumber(&code_[lhs + 1]) == 1) {
+    code_.erase(code_.begin() + lhs, code_.begin() + rhs);  // 1 * x is x
+    last_ = NONE;
+    return;
+  }
+
+  if (rhs + 1 == code_.size() && code_[rhs].opcode == Opcode::Cell) {
+    code_[rhs].opcode = Opcode(int(Opcode::AddCell) + offset);
+    last_ = rhs;
+    return;
+  }
+
+  last_ = code_.size();
+  code_.push_back({opcode, 0, 0, 0});
+}
+
+bool Program::Builder::IsNumber(size_t begin, size_t end) const {
+  return end - begin == 2 && code_[begin].opcode == Opcode::Number;
+}
+
+void Program::Builder::PushOperand() {
+  operands_.push_back(code_.size());
+  max_depth_ = std::max(max_depth_, operands_.size());
+}
+
+void Program::Compile(const Node* nodes, uint32_t root, Builder& builder) {
+  static_assert(sizeof(Instruction) == sizeof(double),
+                "constants take one instruction word");
+
+  const Node& node = nodes[root];
+  switch (node.type) {
+    case Node::Type::Number:
+      builder.EmitNumber(node.number);
+      return;
+
+    case Node::Type::Cell:
+      builder.EmitCell(GetCell(node));
+      return;
+
+    case Node::Type::UnaryPlus:
+      Compile(nodes, node.children[0], builder);
+      return;
+
+    case Node::Type::UnaryMinus:
+      Compile(nodes, node.children[0], builder);
+      builder.EmitOperator(Opcode::Negate);
+      return;
+
+    case Node::Type::Add:
+    case Node::Type::Subtract:
+    case Node::Type::Multiply:
+    case Node::Type::Divide:
+      Compile(nodes, node.children[0], builder);
+      Compile(nodes, node.children[1], builder);
+      builder.EmitOperator(
+          Opcode(int(Opcode::Add) + int(node.type) - int(Node::Type::Add)));
+      return;
+
+    case Node::Type::Call: {
+      const auto function = Function(node.children[1]);
+      builder.BeginCall(function);
+      ForEachArgument(nodes, node.children[0], [&](uint32_t value) {
+        if (nodes[value].type == Node::Type::Range) {
+          builder.EmitRangeArgument(function, GetRange(nodes[value]));
+        } else {
+          Compile(nodes, value, builder);
+          builder.EmitArgument(function);
+        }
+      });
+      builder.EndCall(function);
+      return;
+    }
+
+    case Node::Type::Range:
+    case Node::Type::Argument:
+      assert(false);  // compiled with their call
+      return;
+  }
+}
+
+template <typename Args>
+double Program::ExecuteWith(const Args& args, Position shift) const {
+  if (max_depth_ <= LOCAL_STACK) {
+    double stack[LOCAL_STACK];
+    return Run(stack, args, shift);
+  }
+
+  std::vector<double> stack(max_depth_);
+  return Run(stack.data(), args, shift);
+}
+
+template <typename Args>
+double Program::Run(double* stack, const Args& args, Position shift) const {
+  auto get_cell = [shift](const Instruction& instruction) {
+    return Position{int(instruction.row) + shift.row,
+                    int(instruction.col) + shift.col};
+  };
+  auto read_cell = [&args, &get_cell](const Instruction& instruction) {
+    return args(get_cell(instruction));
+  };
+
+  double* top = stack;  // one past the topmost value
+  const Instruction* end = code_ + size_;
+  for (const Instruction* instruction = code_; instruction != end;
+       ++instruction) {
+    switch (instruction->opcode) {
+      case Opcode::Number:
+        *top++ = ReadNumber(++instruction);
+        break;
+
+      case Opcode::Cell:
+        *top++ = read_cell(*instruction);
+        break;
+
+      case Opcode::Add:
+        --top;
+        top[-1] = CheckFinite(top[-1] + *top);
+        break;
+
+      case Opcode::Subtract:
+        --top;
+        top[-1] = CheckFinite(top[-1] - *top);
+        break;
+
+      case Opcode::Multiply:
+        --top;
+        top[-1] = CheckFinite(top[-1] * *top);
+        break;
+
+      case Opcode::Divide:
+        --top;
+        top[-1] = Divide(top[-1], *top);
+        break;
+
+      case Opcode::Negate:
+        top[-1] = -top[-1];
+        break;
+
+      case Opcode::AddNumber:
+        top[-1] = CheckFinite(top[-1] + ReadNumber(++instruction));
+        break;
+
+      case Opcode::SubtractNumber:
+        top[-1] = CheckFinite(top[-1] - ReadNumber(++instruction));
+        break;
+
+      case Opcode::MultiplyNumber:
+        top[-1] = CheckFinite(top[-1] * ReadNumber(++instruction));
+        break;
+
+      case Opcode::DivideNumber:
+        top[-1] = Divide(top[-1], ReadNumber(++instruction));
+        break;
+
+      case Opcode::AddCell:
+        top[-1] = CheckFinite(top[-1] + read_cell(*instruction));
+        break;
+
+      case Opcode::SubtractCell:
+        top[-1] = CheckFinite(top[-1] - read_cell(*instruction));
+        break;
+
+      case Opcode::MultiplyCell:
+        top[-1] = CheckFinite(top[-1] * read_cell(*instruction));
+        break;
+
+      case Opcode::DivideCell:
+        top[-1] = Divide(top[-1], read_cell(*instruction));
+        break;
+
+      case Opcode::BeginCall:
+        Accumulator(Function(instruction->function), top).Reset();
+        top += CALL_SLOTS;
+        break;
+
+      case Opcode::AddArgument:
+        --top;
+        Accumulator(Function(instruction->function), top - CALL_SLOTS)
+            .Add(top, 1);
+        break;
+
+      case Opcode::AddRange: {
+        Accumulator accumulator(Function(instruction->function),
+                                top - CALL_SLOTS);
+        const Position first = get_cell(*instruction);
+        AddRange(args, {first, get_cell(*++instruction)}, accumulator);
+        break;
+      }
+
+      case Opcode::EndCall: {
+        top -= CALL_SLOTS;
+        const double result =
+            Accumulator(Function(instruction->function), top).GetResult();
+        *top++ = result;
+        break;
+      }
+    }
+  }
+
+  assert(top == stack + 1);
+  return stack[0];
+}
+
+double Program::Execute(const std::function<double(Position)>& args,
+                        Position shift) const {
+  return ExecuteWith(args, shift);
+}
+
+double Program::Execute(const SheetReader& args, Position shift) const {
+  return ExecuteWith(args, shift);
+}
+
+}  // namespace ASTImpl
@@ -1,41 +1,304 @@
 #pragma once
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "memory.h"
+
+class Cell;
+class Sheet;
+
+// Reads cell operands straight from a sheet for formulas evaluated by it.
+// Unlike a std::function over SheetInterface it is called directly and
+// goes to the cell without virtual calls or a variant per read. Defined
+// with the sheet, so this library needs none of its types.
+class SheetReader {
+ public:
+  // Thrown by a concurrent reader for a formula cell without a cached
+  // result, which it may not compute.
+  struct MissingValue {};
+
+  // Results a walk evaluating precedents first keeps for itself, as the
+  // value cache may drop them before the cells reading them come up; see
+  // Cell::EvaluateWithPrecedents.
+  using Results =
+      std::unordered_map<const Cell*, std::variant<double, FormulaError>>;
+
+  // A concurrent reader only takes cached results and changes nothing, so
+  // several threads can evaluate formulas at once; see Sheet::Recalculate.
+  // Otherwise stale formulas read are evaluated on the way.
+  explicit SheetReader(const Sheet& sheet, bool concurrent = false)
+      : sheet_(sheet), concurrent_(concurrent) {}
+  // Takes formula results missing from the value cache from the walk.
+  SheetReader(const Sheet& sheet, const Results& results)
+      : sheet_(sheet), concurrent_(false), results_(&results) {}
+
+  // The number in the cell, 0 for unset cells. Throws the FormulaError the
+  // cell holds, #VALUE! for text that is not a number, #REF! for invalid
+  // positions.
+  double operator()(Position position) const;
+  // Reads count cells down the column from the first one into out, the
+  // same way.
+  void ReadColumn(Position first, int count, double* out) const;
+
+ private:
+  double Read(const Cell* cell) const;
+
+  const Sheet& sheet_;
+  bool concurrent_;
+  const Results* results_ = nullptr;
+};
 
 namespace ASTImpl {
-class Expr;
-}
+// Built-in functions, called by name as in SUM(A1:A10, 2). They aggregate
+// their arguments, reading every cell of a range argument; empty cells
+// count as 0 like everywhere else. MIN and MAX of nothing are 0, AVERAGE
+// of nothing is #DIV/0!, and COUNT counts the values it read.
+enum class Function : uint8_t {
+  Sum,
+  Min,
+  Max,
+  Average,
+  Count,
+};
+
+// A node of the tree of a formula. The nodes of one formula are stored in
+// postfix order in one array, so children come before their parent, the
+// root is last, and operators refer to their arguments by index.
+//
+// The arguments of a call form a list from the last one back: each
+// Argument node holds the value and the argument before it.
+struct Node {
+  static constexpr uint32_t NO_ARGUMENT = UINT32_MAX;
+
+  // The binary operators are in the order of Program::Opcode.
+  enum class Type : uint8_t {
+    Number,
+    Cell,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    UnaryPlus,
+    UnaryMinus,
+    Range,     // only as an argument
+    Argument,  // the value, then the argument before or NO_ARGUMENT
+    Call,      // the last argument or NO_ARGUMENT, then the Function
+  };
+
+  Type type;
+  union {
+    double number;
+    uint32_t children[2];  // unary operators use the first
+    int cell[2];           // row and column, kept as parsed
+    uint16_t range[4];     // rows and columns of the corners, as parsed
+  };
+};
+
+// Postfix form of an expression tree. Operands push their value onto a
+// stack, operators pop their arguments and push the result, so evaluation
+// is one loop over a flat array instead of a virtual call per node.
+//
+// The code is a sequence of 8-byte words. Instructions with a number operand
+// are followed by a word holding the constant; those with a cell operand
+// carry its position. A range instruction carries its first cell and is
+// followed by a word with its last one.
+//
+// A call keeps its running result on the stack while its arguments are
+// evaluated: BeginCall, then the code of each argument followed by
+// AddArgument, or a single AddRange for a range, then EndCall. Ranges are
+// folded a column block at a time by the kernels of aggregate.h.
+class Program {
+ public:
+  // Operators whose right argument is a number or a cell take it from the
+  // instruction itself, which saves a dispatch for most leaves.
+  enum class Opcode : uint8_t {
+    Number,
+    Cell,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Negate,
+    AddNumber,
+    SubtractNumber,
+    MultiplyNumber,
+    DivideNumber,
+    AddCell,
+    SubtractCell,
+    MultiplyCell,
+    DivideCell,
+    BeginCall,
+    AddArgument,
+    AddRange,
+    EndCall,
+  };
+
+  struct Instruction {
+    Opcode opcode;
+    uint8_t function;  // Function of call instructions
+    uint16_t col;      // cell operand
+    uint32_t row;      // cell operand
+  };
+
+  // Appends to the code being compiled. It keeps where the code of each
+  // value on the stack starts, so operators on constants are folded and
+  // leaf operands are fused into their operator.
+  class Builder {
+   public:
+    Builder(std::vector<Instruction>& code, std::vector<size_t>& operands)
+        : code_(code), operands_(operands) {}
+
+    void EmitNumber(double number);
+    void EmitCell(Position cell);
+    void BeginCall(Function function);
+    // Folds the value on top of the stack into the call.
+    void EmitArgument(Function function);
+    void EmitRangeArgument(Function function, CellRange range);
+    void EndCall(Function function);
+    // Operators take their arguments from the top of the stack.
+    void EmitOperator(Opcode opcode);
+
+    size_t GetMaxDepth() const { return max_depth_; }
+
+   private:
+    static constexpr size_t NONE = SIZE_MAX;
+
+    // Whether code_[begin, end) is a single Number instruction.
+    bool IsNumber(size_t begin, size_t end) const;
+    void PushOperand();
+
+    std::vector<Instruction>& code_;
+    std::vector<size_t>& operands_;
+    // Start of the last instruction, or NONE if it is not known.
+    size_t last_ = NONE;
+    size_t max_depth_ = 0;
+  };
+
+  Program() = default;
+  // The code stays owned by the caller, see FormulaAST.
+  Program(const Instruction* code, size_t size, size_t max_depth)
+      : code_(code), size_(size), max_depth_(max_depth) {}
+
+  // Appends the code of the subtree rooted at the node.
+  static void Compile(const Node* nodes, uint32_t root, Builder& builder);
+
+  // Cell operands are read moved by the shift, see FormulaTemplates.
+  double Execute(const std::function<double(Position)>& args,
+                 Position shift = {0, 0}) const;
+  double Execute(const SheetReader& args, Position shift = {0, 0}) const;
+
+  // Size of the code in words.
+  size_t GetSize() const { return size_; }
+
+ private:
+  // Deeper programs evaluate on a heap stack.
+  static constexpr size_t LOCAL_STACK = 32;
+
+  template <typename Args>
+  double ExecuteWith(const Args& args, Position shift) const;
+  template <typename Args>
+  double Run(double* stack, const Args& args, Position shift) const;
+
+  const Instruction* code_ = nullptr;
+  size_t size_ = 0;
+  size_t max_depth_ = 0;
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
+// The tree is kept for printing and compiled to a Program for evaluation.
+// The nodes, the referenced cells and ranges and the code share one
+// allocation, charged to the MemoryScope the formula was parsed in; freeing
+// it goes to the same counter wherever that happens.
 class FormulaAST {
  public:
-  explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                      std::forward_list<Position> cells);
+  // A view of references stored with the tree.
+  template <typename T>
+  class Span {
+   public:
+    Span(const T* begin, const T* end) : begin_(begin), end_(end) {}
+
+    const T* begin() const { return begin_; }
+    const T* end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+
+   private:
+    const T* begin_;
+    const T* end_;
+  };
 
-  FormulaAST(FormulaAST&&) = default;
-  FormulaAST& operator=(FormulaAST&&) = default;
+  // In ascending order, with repeats. Cells read as part of a range are
+  // not among the cells.
+  using Cells = Span<Position>;
+  using Ranges = Span<CellRange>;
+
+  // Copies the nodes, in postfix order with the root last, and the sorted
+  // cells and ranges, and compiles the program.
+  FormulaAST(const std::vector<ASTImpl::Node>& nodes,
+             const std::vector<Position>& cells,
+             const std::vector<CellRange>& ranges = {});
+
+  FormulaAST(FormulaAST&& other) noexcept;
+  FormulaAST& operator=(FormulaAST&& other) noexcept;
   ~FormulaAST();
 
-  double Execute(const std::function<double(Position)>& args) const;
+  // Runs the compiled program. The shift moves every cell reference, so one
+  // tree can serve formulas that differ only by where they are.
+  double Execute(const std::function<double(Position)>& args,
+                 Position shift = {0, 0}) const;
+  double Execute(const SheetReader& args, Position shift = {0, 0}) const;
+  // Walks the tree instead; the reference for tests and benchmarks.
+  double ExecuteTree(const std::function<double(Position)>& args) const;
   void PrintCells(std::ostream& out) const;
   void Print(std::ostream& out) const;
-  void PrintFormula(std::ostream& out) const;
+  void PrintFormula(std::ostream& out, Position shift = {0, 0}) const;
 
-  std::forward_list<Position>& GetCells() { return cells_; }
-  const std::forward_list<Position>& GetCells() const { return cells_; }
+  Cells GetCells() const;
+  Ranges GetRanges() const;
+  const ASTImpl::Program& GetProgram() const { return program_; }
+  // The tree and its one allocation.
+  size_t GetBytes() const {
+    return sizeof(FormulaAST) + size_t(words_) * sizeof(uint64_t);
+  }
 
  private:
-  std::unique_ptr<ASTImpl::Expr> root_expr_;
-  std::forward_list<Position> cells_;
+  const ASTImpl::Node* GetNodes() const;
+  uint32_t GetRoot() const { return node_count_ - 1; }
+
+  TrackingAllocator<uint64_t> allocator_;
+  // The nodes, the cells, the ranges, then the code, each 8-byte aligned.
+  uint64_t* storage_ = nullptr;
+  uint32_t words_ = 0;
+  uint32_t node_count_ = 0;
+  uint32_t cell_count_ = 0;
+  uint32_t range_count_ = 0;
+  ASTImpl::Program program_;
 };
 
+// Hand-written parser for Formula.g4.
+FormulaAST ParseFormulaAST(std::string_view in);
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// Appends the tokens of the expression to the key, with cell references
+// written relative to the anchor. Expressions that differ only by where
+// they are, like B2*C2 anchored at D2 and B3*C3 anchored at D3, get the
+// same key. Throws like ParseFormulaAST on lexing errors and invalid
+// positions, but does not check the syntax.
+void AppendRelativeKey(std::string_view in, Position anchor,
+                       std::string& key);
+
+// The parser ANTLR generates from the same grammar, kept as the reference
+// for the hand-written one.
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str);
@@ -0,0 +1,183 @@
+#include "aggregate.h"
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AGGREGATE_X86 1
+#include <immintrin.h>
+#elif defined(_M_X64)
+#define AGGREGATE_SSE2_ONLY 1
+#include <emmintrin.h>
+#endif
+
+namespace aggregate {
+namespace {
+enum class Op {
+  Add,
+  Min,
+  Max,
+};
+
+// The vector instructions pick their second operand when the values are
+// equal, and so does this.
+template <Op op>
+double Fold(double value, double lane) {
+  if constexpr (op == Op::Add) {
+    return lane + value;
+  } else if constexpr (op == Op::Min) {
+    return value < lane ? value : lane;
+  } else {
+    return value > lane ? value : lane;
+  }
+}
+
+// Folds the values from begin on, past the last whole group of lanes for
+// the vector kernels.
+template <Op op>
+void FoldScalar(const double* values, size_t begin, size_t count,
+                double* lanes) {
+  for (size_t i = begin; i < count; ++i) {
+    lanes[i % LANES] = Fold<op>(values[i], lanes[i % LANES]);
+  }
+}
+
+template <Op op>
+void ScalarKernel(const double* values, size_t count, double* lanes) {
+  FoldScalar<op>(values, 0, count, lanes);
+}
+
+const Kernels SCALAR = {ScalarKernel<Op::Add>, ScalarKernel<Op::Min>,
+                        ScalarKernel<Op::Max>};
+
+#if defined(AGGREGATE_X86) || defined(AGGREGATE_SSE2_ONLY)
+template <Op op>
+__m128d FoldSse2(__m128d values, __m128d lanes) {
+  if constexpr (op == Op::Add) {
+    return _mm_add_pd(lanes, values);
+  } else if constexpr (op == Op::Min) {
+    return _mm_min_pd(values, lanes);
+  } else {
+    return _mm_max_pd(values, lanes);
+  }
+}
+
+// Four registers of two lanes.
+template <Op op>
+void Sse2Kernel(const double* values, size_t count, double* lanes) {
+  __m128d acc[4];
+  for (int k = 0; k < 4; ++k) {
+    acc[k] = _mm_loadu_pd(lanes + 2 * k);
+  }
+  size_t i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    for (int k = 0; k < 4; ++k) {
+      acc[k] = FoldSse2<op>(_mm_loadu_pd(values + i + 2 * k), acc[k]);
+    }
+  }
+  for (int k = 0; k < 4; ++k) {
+    _mm_storeu_pd(lanes + 2 * k, acc[k]);
+  }
+  FoldScalar<op>(values, i, count, lanes);
+}
+
+const Kernels SSE2 = {Sse2Kernel<Op::Add>, Sse2Kernel<Op::Min>,
+                      Sse2Kernel<Op::Max>};
+#endif
+
+#if defined(AGGREGATE_X86)
+// Two registers of four lanes. Compiled for AVX2 whatever the target of the
+// build, and only called once the CPU is known to have it.
+template <Op op>
+__attribute__((target("avx2"))) void Avx2Kernel(const double* values,
+                                                size_t count, double* lanes) {
+  __m256d low = _mm256_loadu_pd(lanes);
+  __m256d high = _mm256_loadu_pd(lanes + 4);
+  size_t i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    const __m256d next_low = _mm256_loadu_pd(values + i);
+    const __m256d next_high = _mm256_loadu_pd(values + i + 4);
+    if constexpr (op == Op::Add) {
+      low = _mm256_add_pd(low, next_low);
+      high = _mm256_add_pd(high, next_high);
+    } else if constexpr (op == Op::Min) {
+      low = _mm256_min_pd(next_low, low);
+      high = _mm256_min_pd(next_high, high);
+    } else {
+      low = _mm256_max_pd(next_low, low);
+      high = _mm256_max_pd(next_high, high);
+    }
+  }
+  _mm256_storeu_pd(lanes, low);
+  _mm256_storeu_pd(lanes + 4, high);
+  FoldScalar<op>(values, i, count, lanes);
+}
+
+const Kernels AVX2 = {Avx2Kernel<Op::Add>, Avx2Kernel<Op::Min>,
+                      Avx2Kernel<Op::Max>};
+#endif
+
+KernelSet DetectBestKernelSet() {
+#if defined(AGGREGATE_X86)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? KernelSet::Avx2 : KernelSet::Sse2;
+#elif defined(AGGREGATE_SSE2_ONLY)
+  return KernelSet::Sse2;
+#else
+  return KernelSet::Scalar;
+#endif
+}
+
+std::atomic<KernelSet>& GetActive() {
+  static std::atomic<KernelSet> active(GetBestKernelSet());
+  return active;
+}
+}  // namespace
+
+KernelSet GetBestKernelSet() {
+  static const KernelSet best = DetectBestKernelSet();
+  return best;
+}
+
+const Kernels& GetKernels(KernelSet set) {
+  if (set > GetBestKernelSet()) {
+    throw std::invalid_argument("Kernel set not supported: " +
+                                std::string(ToString(set)));
+  }
+
+  switch (set) {
+#if defined(AGGREGATE_X86)
+    case KernelSet::Avx2:
+      return AVX2;
+#endif
+#if defined(AGGREGATE_X86) || defined(AGGREGATE_SSE2_ONLY)
+    case KernelSet::Sse2:
+      return SSE2;
+#endif
+    default:
+      return SCALAR;
+  }
+}
+
+const char* ToString(KernelSet set) {
+  switch (set) {
+    case KernelSet::Scalar:
+      return "scalar";
+    case KernelSet::Sse2:
+      return "SSE2";
+    case KernelSet::Avx2:
+      return "AVX2";
+  }
+  return "";
+}
+
+KernelSet GetActiveKernelSet() { return GetActive().load(); }
+
+void SetActiveKernelSet(KernelSet set) {
+  GetKernels(set);  // throws for unsupported sets
+  GetActive().store(set);
+}
+
+const Kernels& GetActiveKernels() { return GetKernels(GetActiveKernelSet()); }
+}  // namespace aggregate
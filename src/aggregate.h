@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+
+// Kernels reducing blocks of numbers for the aggregate functions of
+// formulas. A reduction keeps LANES partial results and a kernel folds
+// values[i] into lane i % LANES, so the vector kernels and the scalar one
+// do the same operations in the same order and give bitwise equal results.
+// The lanes are combined by the caller.
+namespace aggregate {
+constexpr size_t LANES = 8;
+
+enum class KernelSet {
+  Scalar,
+  Sse2,
+  Avx2,
+};
+
+struct Kernels {
+  void (*sum)(const double* values, size_t count, double* lanes);
+  void (*min)(const double* values, size_t count, double* lanes);
+  void (*max)(const double* values, size_t count, double* lanes);
+};
+
+// The widest set both this build and the CPU support. Sets up to it are
+// usable.
+KernelSet GetBestKernelSet();
+const Kernels& GetKernels(KernelSet set);
+const char* ToString(KernelSet set);
+
+// The set formulas use, the best one unless changed. Throws
+// std::invalid_argument for sets the machine does not support.
+KernelSet GetActiveKernelSet();
+void SetActiveKernelSet(KernelSet set);
+const Kernels& GetActiveKernels();
+}  // namespace aggregate
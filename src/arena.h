@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "memory.h"
+
+struct ArenaStats {
+  size_t chunk_allocations = 0;  // calls into the global allocator
+  size_t allocations = 0;        // objects handed out
+  size_t recycled = 0;           // allocations served from the free list
+  size_t live = 0;
+  size_t reserved_bytes = 0;
+
+  ArenaStats& operator+=(const ArenaStats& other) {
+    chunk_allocations += other.chunk_allocations;
+    allocations += other.allocations;
+    recycled += other.recycled;
+    live += other.live;
+    reserved_bytes += other.reserved_bytes;
+    return *this;
+  }
+};
+
+// Pool of same-sized objects carved out of geometrically growing chunks.
+// Freed slots go to an intrusive free list and are reused before any new
+// chunk is requested, so steady-state New/Delete never reach malloc.
+// Objects never move, pointers stay valid until Delete. Chunks are charged to
+// the counter, if one is given.
+template <typename T>
+class SlabAllocator {
+ public:
+  explicit SlabAllocator(MemoryCounter* counter = nullptr)
+      : chunks_(TrackingAllocator<Chunk>(counter)) {}
+  SlabAllocator(const SlabAllocator&) = delete;
+  SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+  // Every object must be returned with Delete before the allocator dies.
+  ~SlabAllocator() {
+    if (MemoryCounter* counter = chunks_.get_allocator().GetCounter()) {
+      counter->Subtract(stats_.reserved_bytes);
+    }
+  }
+
+  template <typename... Args>
+  T* New(Args&&... args) {
+    Slot* slot = free_list_;
+    const bool recycled = slot != nullptr;
+    if (recycled) {
+      free_list_ = slot->next;
+    } else {
+      slot = Grow();
+    }
+
+    try {
+      T* object = new (slot->storage) T(std::forward<Args>(args)...);
+      ++stats_.allocations;
+      ++stats_.live;
+      stats_.recycled += recycled;
+      return object;
+    } catch (...) {
+      slot->next = free_list_;
+      free_list_ = slot;
+      throw;
+    }
+  }
+
+  void Delete(T* object) {
+    if (!object) {
+      return;
+    }
+
+    object->~T();
+    Slot* slot = reinterpret_cast<Slot*>(object);
+    slot->next = free_list_;
+    free_list_ = slot;
+    --stats_.live;
+  }
+
+  const ArenaStats& GetStats() const { return stats_; }
+
+ private:
+  static constexpr size_t FIRST_CHUNK_SIZE = 16;
+  static constexpr size_t MAX_CHUNK_SIZE = 4096;
+
+  union Slot {
+    Slot* next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  using Chunk = std::unique_ptr<Slot[]>;
+
+  Slot* Grow() {
+    if (next_ == end_) {
+      chunks_.push_back(std::make_unique<Slot[]>(chunk_size_));
+      next_ = chunks_.back().get();
+      end_ = next_ + chunk_size_;
+
+      ++stats_.chunk_allocations;
+      stats_.reserved_bytes += chunk_size_ * sizeof(Slot);
+      if (MemoryCounter* counter = chunks_.get_allocator().GetCounter()) {
+        counter->Add(chunk_size_ * sizeof(Slot));
+      }
+      chunk_size_ = std::min(chunk_size_ * 2, MAX_CHUNK_SIZE);
+    }
+
+    return next_++;
+  }
+
+  std::vector<Chunk, TrackingAllocator<Chunk>> chunks_;
+  size_t chunk_size_ = FIRST_CHUNK_SIZE;
+  Slot* next_ = nullptr;
+  Slot* end_ = nullptr;
+  Slot* free_list_ = nullptr;
+  ArenaStats stats_;
+};
@@ -0,0 +1,110 @@
+#include <string>
+#include <vector>
+
+#include "aggregate.h"
+#include "benchmark.h"
+#include "formula.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = Position::MAX_ROWS;
+constexpr int COLS = 64;  // 1M cells
+constexpr int KERNEL_PASSES = 50;
+constexpr int SHEET_PASSES = 5;
+
+std::vector<aggregate::KernelSet> GetKernelSets() {
+  std::vector<aggregate::KernelSet> sets;
+  for (auto set : {aggregate::KernelSet::Scalar, aggregate::KernelSet::Sse2,
+                   aggregate::KernelSet::Avx2}) {
+    if (set <= aggregate::GetBestKernelSet()) {
+      sets.push_back(set);
+    }
+  }
+  return sets;
+}
+
+// The kernels alone over 1M numbers in memory.
+void RunKernels() {
+  std::vector<double> values(size_t(ROWS) * COLS);
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i] = double(i % 1000) - 500;
+  }
+
+  std::cout << std::left << std::setw(10) << "kernels" << std::right
+            << std::setw(12) << "sum ns/val" << std::setw(12) << "min ns/val"
+            << std::setw(12) << "max ns/val" << '\n';
+  for (aggregate::KernelSet set : GetKernelSets()) {
+    const aggregate::Kernels& kernels = aggregate::GetKernels(set);
+    std::cout << std::left << std::setw(10) << aggregate::ToString(set)
+              << std::right << std::fixed << std::setprecision(3);
+    for (auto kernel : {kernels.sum, kernels.min, kernels.max}) {
+      double lanes[aggregate::LANES] = {};
+      Stopwatch stopwatch;
+      for (int pass = 0; pass < KERNEL_PASSES; ++pass) {
+        kernel(values.data(), values.size(), lanes);
+      }
+      const double seconds = stopwatch.GetSeconds();
+      DoNotOptimize(lanes[0]);
+      std::cout << std::setw(12)
+                << seconds * 1e9 / (double(KERNEL_PASSES) * values.size());
+    }
+    std::cout << '\n';
+  }
+}
+
+// Evaluates the formula after a change in its range, so nothing is cached.
+template <typename Sheet>
+double Measure(::Sheet& sheet, const Sheet& reader,
+               const FormulaInterface& formula) {
+  Stopwatch stopwatch;
+  double checksum = 0;
+  for (int pass = 0; pass < SHEET_PASSES; ++pass) {
+    sheet.SetCell(Position{ROWS - 1, COLS - 1}, std::to_string(pass));
+    checksum += std::get<double>(formula.Evaluate(reader));
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+  return seconds * 1e9 / (double(SHEET_PASSES) * ROWS * COLS);
+}
+}  // namespace
+
+void BenchmarkAggregates() {
+  PrintHeader("Aggregate functions over 1M cells");
+  RunKernels();
+
+  Sheet sheet;
+  for (int row = 0; row < ROWS; ++row) {
+    for (int col = 0; col < COLS; ++col) {
+      sheet.SetCell(Position{row, col}, std::to_string((row + col) % 1000));
+    }
+  }
+  const std::string range =
+      "(A1:" + Position{ROWS - 1, COLS - 1}.ToString() + ")";
+
+  std::cout << '\n'
+            << std::left << std::setw(10) << "formula" << std::right
+            << std::setw(16) << "per cell ns" << std::setw(12)
+            << "scalar ns";
+  for (aggregate::KernelSet set : GetKernelSets()) {
+    if (set != aggregate::KernelSet::Scalar) {
+      std::cout << std::setw(12) << std::string(aggregate::ToString(set)) +
+                                        " ns";
+    }
+  }
+  std::cout << '\n';
+
+  const aggregate::KernelSet active = aggregate::GetActiveKernelSet();
+  for (const std::string name : {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"}) {
+    const auto formula = ParseFormula(name + range);
+    std::cout << std::left << std::setw(10) << name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(16)
+              << Measure(sheet, static_cast<const SheetInterface&>(sheet),
+                         *formula);
+    for (aggregate::KernelSet set : GetKernelSets()) {
+      aggregate::SetActiveKernelSet(set);
+      std::cout << std::setw(12) << Measure(sheet, sheet, *formula);
+    }
+    aggregate::SetActiveKernelSet(active);
+    std::cout << '\n';
+  }
+}
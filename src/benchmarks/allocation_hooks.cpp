@@ -0,0 +1,70 @@
+#include "allocation_hooks.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+// Keeps returned pointers aligned for any fundamental type.
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+// Atomic because benchmarks may allocate from several threads.
+std::atomic<size_t> allocations = 0;
+std::atomic<size_t> deallocations = 0;
+std::atomic<size_t> live_bytes = 0;
+
+void* Allocate(size_t size) {
+  void* block = std::malloc(size + HEADER_SIZE);
+  if (!block) {
+    throw std::bad_alloc();
+  }
+
+  *static_cast<size_t*>(block) = size;
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  live_bytes.fetch_add(size, std::memory_order_relaxed);
+  return static_cast<char*>(block) + HEADER_SIZE;
+}
+
+void Deallocate(void* pointer) {
+  if (!pointer) {
+    return;
+  }
+
+  void* block = static_cast<char*>(pointer) - HEADER_SIZE;
+  deallocations.fetch_add(1, std::memory_order_relaxed);
+  live_bytes.fetch_sub(*static_cast<size_t*>(block), std::memory_order_relaxed);
+  std::free(block);
+}
+}  // namespace
+
+AllocationCounters GetAllocationCounters() {
+  AllocationCounters counters;
+  counters.allocations = allocations.load(std::memory_order_relaxed);
+  counters.deallocations = deallocations.load(std::memory_order_relaxed);
+  counters.live_bytes = live_bytes.load(std::memory_order_relaxed);
+  return counters;
+}
+
+void* operator new(size_t size) { return Allocate(size); }
+void* operator new[](size_t size) { return Allocate(size); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return Allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return Allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void operator delete(void* pointer) noexcept { Deallocate(pointer); }
+void operator delete[](void* pointer) noexcept { Deallocate(pointer); }
+void operator delete(void* pointer, size_t) noexcept { Deallocate(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { Deallocate(pointer); }
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+// Counters fed by the replacement global operator new/delete linked into the
+// benchmark binary. Lets benchmarks report exact heap usage instead of
+// estimating it from container sizes.
+struct AllocationCounters {
+  size_t allocations = 0;
+  size_t deallocations = 0;
+  size_t live_bytes = 0;
+};
+
+AllocationCounters GetAllocationCounters();
@@ -0,0 +1,57 @@
+#include <string>
+
+#include "allocation_hooks.h"
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = 512;
+constexpr int COLS = 256;
+
+template <typename Action>
+void RunPhase(const std::string& name, Sheet& sheet, Action action) {
+  const AllocationCounters heap_before = GetAllocationCounters();
+  const ArenaStats arena_before = sheet.GetArenaStats();
+  Stopwatch stopwatch;
+
+  for (int row = 0; row < ROWS; ++row) {
+    for (int col = 0; col < COLS; ++col) {
+      action(Position{row, col});
+    }
+  }
+
+  const double seconds = stopwatch.GetSeconds();
+  const AllocationCounters heap_after = GetAllocationCounters();
+  const ArenaStats arena_after = sheet.GetArenaStats();
+  const double operations = double(ROWS) * COLS;
+
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+            << std::setprecision(3) << std::setw(14)
+            << (heap_after.allocations - heap_before.allocations) / operations
+            << std::setw(14)
+            << arena_after.chunk_allocations - arena_before.chunk_allocations
+            << std::setw(14) << arena_after.recycled - arena_before.recycled
+            << std::setw(12) << seconds * 1e9 / operations << '\n';
+}
+}  // namespace
+
+void BenchmarkArena() {
+  PrintHeader("Cell arena: heap allocations per operation");
+  std::cout << std::left << std::setw(12) << "phase" << std::right
+            << std::setw(14) << "malloc/op" << std::setw(14) << "new chunks"
+            << std::setw(14) << "recycled" << std::setw(12) << "ns/op"
+            << '\n';
+
+  Sheet sheet;
+  RunPhase("fill", sheet, [&sheet](Position position) {
+    sheet.SetCell(position, std::to_string(position.col));
+  });
+  RunPhase("overwrite", sheet, [&sheet](Position position) {
+    sheet.SetCell(position, std::to_string(position.row));
+  });
+  RunPhase("clear", sheet,
+           [&sheet](Position position) { sheet.ClearCell(position); });
+  RunPhase("refill", sheet, [&sheet](Position position) {
+    sheet.SetCell(position, std::to_string(position.col));
+  });
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <streambuf>
+#include <string>
+
+class Stopwatch {
+ public:
+  Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+  double GetSeconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Prevents the optimizer from dropping a computed value.
+template <typename T>
+void DoNotOptimize(T value) {
+  [[maybe_unused]] static volatile T sink;
+  sink = value;
+}
+
+// Discards everything so print timings cover only the sheet.
+class NullBuffer : public std::streambuf {
+ protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(const char* /* s */, std::streamsize n) override {
+    return n;
+  }
+};
+
+inline void PrintHeader(const std::string& title) {
+  std::cout << '\n' << "== " << title << " ==" << '\n';
+}
+
+void BenchmarkStorage();
+void BenchmarkArena();
+void BenchmarkCells();
+void BenchmarkDependencies();
+void BenchmarkPrinting();
+void BenchmarkSnapshots();
+void BenchmarkMemoryStats();
+void BenchmarkValueCache();
+void BenchmarkFormulaEvaluation();
+void BenchmarkFormulaParsing();
+void BenchmarkNumericText();
+void BenchmarkFormulaTemplates();
+void BenchmarkFormulaCache();
+void BenchmarkCellLookup();
+void BenchmarkRanges();
+void BenchmarkAggregates();
+void BenchmarkCycleDetection();
+void BenchmarkLongChains();
+void BenchmarkRecalculation();
+void BenchmarkParallelRecalculation();
+void BenchmarkRepeatedEdits();
@@ -0,0 +1,79 @@
+#include <iterator>
+#include <string>
+#include <variant>
+
+#include "allocation_hooks.h"
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = 256;
+constexpr int COLS = 256;
+
+template <typename Content>
+void RunKind(const std::string& name, Content content) {
+  Sheet sheet;
+
+  const size_t before = GetAllocationCounters().live_bytes;
+  for (int row = 0; row < ROWS; ++row) {
+    for (int col = 0; col < COLS; ++col) {
+      sheet.SetCell(Position{row, col}, content(Position{row, col}));
+    }
+  }
+  const size_t heap_bytes = GetAllocationCounters().live_bytes - before;
+  const double cells = double(ROWS) * COLS;
+
+  // Warm the formula caches so the timing covers the cached read path.
+  double checksum = 0;
+  auto read_all = [&sheet, &checksum] {
+    for (int row = 0; row < ROWS; ++row) {
+      for (int col = 0; col < COLS; ++col) {
+        const CellInterface::Value value =
+            sheet.GetCellInterface(Position{row, col})->GetValue();
+        checksum += std::holds_alternative<double>(value)
+                        ? std::get<double>(value)
+                        : double(value.index());
+      }
+    }
+  };
+  read_all();
+
+  constexpr int ROUNDS = 20;
+  Stopwatch stopwatch;
+  for (int round = 0; round < ROUNDS; ++round) {
+    read_all();
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  std::cout << std::left << std::setw(10) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(16) << heap_bytes / cells
+            << std::setw(16) << seconds * 1e9 / (cells * ROUNDS) << '\n';
+}
+}  // namespace
+
+void BenchmarkCells() {
+  PrintHeader("Cell records");
+  std::cout << "sizeof(Cell) = " << sizeof(Cell) << '\n';
+  std::cout << std::left << std::setw(10) << "content" << std::right
+            << std::setw(16) << "heap B/cell" << std::setw(16)
+            << "GetValue ns/op" << '\n';
+
+  RunKind("text", [](Position position) {
+    return "label " + std::to_string(position.col % 8);
+  });
+  RunKind("labels", [](Position position) {
+    // Categorical columns: a handful of labels repeated on every row.
+    static const std::string labels[] = {
+        "Accounts receivable", "Accounts payable", "Not applicable",
+        "Cost of goods sold",  "USD",              "total",
+        "Operating expenses",  "N/A"};
+    return labels[(position.row + position.col) % std::size(labels)];
+  });
+  RunKind("formula", [](Position position) {
+    return position.col == 0
+               ? std::string("=1")
+               : "=" + Position{position.row, position.col - 1}.ToString() +
+                     "+1";
+  });
+}
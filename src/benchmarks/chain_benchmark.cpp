@@ -0,0 +1,51 @@
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+// Chains snake down the columns, as the sheet is only 16384 rows tall.
+Position GetPosition(int index) {
+  return {index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+}
+
+void Run(int length) {
+  Sheet sheet;
+  Stopwatch fill;
+  sheet.SetCell(GetPosition(0), "1");
+  for (int index = 1; index < length; ++index) {
+    sheet.SetCell(GetPosition(index),
+                  "=" + GetPosition(index - 1).ToString() + "+1");
+  }
+  const double fill_seconds = fill.GetSeconds();
+
+  const CellInterface* last = sheet.GetCellInterface(GetPosition(length - 1));
+  Stopwatch read;
+  double checksum = std::get<double>(last->GetValue());
+  const double read_seconds = read.GetSeconds();
+
+  // Changing the head invalidates the whole chain, the read evaluates it.
+  Stopwatch edit;
+  sheet.SetCell(GetPosition(0), "2");
+  checksum += std::get<double>(last->GetValue());
+  const double edit_seconds = edit.GetSeconds();
+  DoNotOptimize(checksum);
+
+  std::cout << std::right << std::setw(10) << length << std::fixed
+            << std::setprecision(1) << std::setw(14)
+            << fill_seconds * 1e9 / length << std::setw(14)
+            << read_seconds * 1e9 / length << std::setw(16)
+            << edit_seconds * 1e9 / length << '\n';
+}
+}  // namespace
+
+void BenchmarkLongChains() {
+  PrintHeader("Long chains, every cell reads the one before");
+  std::cout << std::right << std::setw(10) << "cells" << std::setw(14)
+            << "fill ns/cell" << std::setw(14) << "read ns/cell"
+            << std::setw(16) << "edit ns/cell" << '\n';
+
+  for (int length : {100000, 1000000, 10000000}) {
+    Run(length);
+  }
+}
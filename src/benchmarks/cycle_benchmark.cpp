@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = Position::MAX_ROWS;
+constexpr int WIDE_ROWS = 1024;
+constexpr int WIDE_COLS = 64;
+constexpr int EDITS = 200;
+
+std::string Above(Position position, int col) {
+  return Position{position.row - 1, col}.ToString();
+}
+
+void Print(const std::string& name, double seconds, int count,
+           const Sheet& sheet, size_t reordered_before) {
+  std::cout << std::left << std::setw(14) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(14) << seconds * 1e9 / count
+            << std::setw(14)
+            << double(sheet.GetGraph().GetStats().reordered -
+                      reordered_before) /
+                   count
+            << '\n';
+}
+
+// One column where every cell reads the one above.
+void RunDeepChain() {
+  Sheet sheet;
+  Stopwatch fill;
+  for (int row = 1; row < ROWS; ++row) {
+    sheet.SetCell(Position{row, 0}, "=" + Above({row, 0}, 0) + "+1");
+  }
+  Print("chain fill", fill.GetSeconds(), ROWS - 1, sheet, 0);
+
+  // Editing the far end finds everything ordered already.
+  size_t reordered = sheet.GetGraph().GetStats().reordered;
+  Stopwatch edits;
+  for (int edit = 0; edit < EDITS; ++edit) {
+    sheet.SetCell(Position{ROWS - 1, 0},
+                  "=" + Above({ROWS - 1, 0}, 0) + "+" + std::to_string(edit));
+  }
+  Print("chain tail", edits.GetSeconds(), EDITS, sheet, reordered);
+
+  // Making the head read a newer cell moves the whole chain behind it.
+  reordered = sheet.GetGraph().GetStats().reordered;
+  Stopwatch relink;
+  for (int edit = 0; edit < EDITS; ++edit) {
+    sheet.SetCell(Position{edit, 1}, "=C1");
+    sheet.SetCell(Position{0, 0}, "=" + Position{edit, 1}.ToString());
+  }
+  Print("chain head", relink.GetSeconds(), EDITS, sheet, reordered);
+}
+
+// Rows where every cell reads the three cells above it.
+void RunWideDag() {
+  Sheet sheet;
+  Stopwatch fill;
+  for (int row = 1; row < WIDE_ROWS; ++row) {
+    for (int col = 0; col < WIDE_COLS; ++col) {
+      sheet.SetCell(Position{row, col},
+                    "=" + Above({row, col}, std::max(col - 1, 0)) + "+" +
+                        Above({row, col}, col) + "+" +
+                        Above({row, col}, std::min(col + 1, WIDE_COLS - 1)));
+    }
+  }
+  Print("DAG fill", fill.GetSeconds(), (WIDE_ROWS - 1) * WIDE_COLS, sheet, 0);
+
+  const size_t reordered = sheet.GetGraph().GetStats().reordered;
+  Stopwatch edits;
+  for (int edit = 0; edit < EDITS; ++edit) {
+    const Position position{WIDE_ROWS / 2 + edit, edit % WIDE_COLS};
+    sheet.SetCell(position, "=" + Above(position, position.col) + "*2");
+  }
+  Print("DAG middle", edits.GetSeconds(), EDITS, sheet, reordered);
+}
+}  // namespace
+
+void BenchmarkCycleDetection() {
+  PrintHeader("Cycle detection on edits");
+  std::cout << std::left << std::setw(14) << "edit" << std::right
+            << std::setw(14) << "ns/edit" << std::setw(14) << "moved/edit"
+            << '\n';
+
+  RunDeepChain();
+  RunWideDag();
+}
@@ -0,0 +1,113 @@
+#include <sstream>
+#include <string>
+
+#include "allocation_hooks.h"
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int FORMULAS = 160000;
+constexpr int COLS = 16;
+
+Position GetPosition(int index) { return {1 + index / COLS, index % COLS}; }
+
+// Loads one formula per cell and reports the heap it took.
+template <typename Content>
+void Load(Sheet& sheet, Content content, const std::string& name,
+          const std::string& invalidation) {
+  const AllocationCounters before = GetAllocationCounters();
+  Stopwatch stopwatch;
+  for (int i = 0; i < FORMULAS; ++i) {
+    sheet.SetCell(GetPosition(i), content(GetPosition(i)));
+  }
+  const double seconds = stopwatch.GetSeconds();
+  const AllocationCounters after = GetAllocationCounters();
+
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(16)
+            << (after.live_bytes - before.live_bytes) / double(FORMULAS)
+            << std::setw(16)
+            << (after.allocations - before.allocations) / double(FORMULAS)
+            << std::setw(16) << seconds * 1e9 / FORMULAS << std::setw(20)
+            << invalidation << '\n';
+}
+
+// Every formula reads the shared rate cell A1, like a tax or FX rate.
+void RunSharedRate() {
+  double invalidate_seconds = 0;
+  constexpr int ROUNDS = 10;
+  {
+    Sheet sheet;
+    sheet.SetCell(Position{0, 0}, "=1");
+    for (int i = 0; i < FORMULAS; ++i) {
+      sheet.SetCell(GetPosition(i), "=A1*2");
+    }
+
+    for (int round = 0; round < ROUNDS; ++round) {
+      double checksum = 0;
+      for (int i = 0; i < FORMULAS; ++i) {
+        checksum += std::get<double>(
+            sheet.GetCellInterface(GetPosition(i))->GetValue());
+      }
+      DoNotOptimize(checksum);
+
+      // Reads drop the dependents; timed here without the read itself.
+      Stopwatch stopwatch;
+      sheet.SetCell(Position{0, 0}, "=" + std::to_string(round + 2));
+      sheet.FlushInvalidations();
+      invalidate_seconds += stopwatch.GetSeconds();
+    }
+  }
+
+  std::ostringstream invalidation;
+  invalidation << std::fixed << std::setprecision(1)
+               << invalidate_seconds * 1e9 / (double(FORMULAS) * ROUNDS);
+
+  Sheet sheet;
+  sheet.SetCell(Position{0, 0}, "=1");
+  Load(
+      sheet, [](Position) { return std::string("=A1*2"); }, "shared rate",
+      invalidation.str());
+}
+
+// Short rows where each cell reads its left neighbour: one edge per cell.
+void RunChains() {
+  Sheet sheet;
+  Load(
+      sheet,
+      [](Position position) {
+        return position.col == 0
+                   ? std::string("=1")
+                   : "=" + Position{position.row, position.col - 1}.ToString() +
+                         "+1";
+      },
+      "chains", "-");
+}
+
+// Each formula reads its own unset cell far across the sheet.
+void RunFarReferences() {
+  Sheet sheet;
+  Load(
+      sheet,
+      [](Position position) {
+        const int index = position.row * COLS + position.col;
+        return "=" +
+               Position{(index * 97) % Position::MAX_ROWS,
+                        COLS + (index * 31) % (Position::MAX_COLS - COLS)}
+                   .ToString();
+      },
+      "far refs", "-");
+}
+}  // namespace
+
+void BenchmarkDependencies() {
+  PrintHeader("Dependency graph");
+  std::cout << std::left << std::setw(12) << "shape" << std::right
+            << std::setw(16) << "heap B/formula" << std::setw(16)
+            << "malloc/formula" << std::setw(16) << "load ns/cell"
+            << std::setw(20) << "invalidate ns/dep" << '\n';
+
+  RunSharedRate();
+  RunChains();
+  RunFarReferences();
+}
@@ -0,0 +1,74 @@
+#include <functional>
+#include <string>
+
+#include "FormulaAST.h"
+#include "benchmark.h"
+
+namespace {
+constexpr int EVALUATIONS = 200000;
+
+std::string GetOperand(int index) {
+  return index % 2 == 0 ? Position{index % 50, index % 7}.ToString()
+                        : std::to_string(index % 9 + 1);
+}
+
+char GetOperator(int index) { return "+-*/"[index % 4]; }
+
+// ((((a op b) op c) op d) ...): every operator waits on the one before.
+std::string MakeDeep(int operands) {
+  std::string expression = GetOperand(0);
+  for (int i = 1; i < operands; ++i) {
+    expression = "(" + expression + ")" + GetOperator(i) + GetOperand(i);
+  }
+  return expression;
+}
+
+// Balanced tree over the operands.
+std::string MakeWide(int first, int last) {
+  if (last - first == 1) {
+    return GetOperand(first);
+  }
+  const int middle = (first + last) / 2;
+  return "(" + MakeWide(first, middle) + ")" + GetOperator(middle) + "(" +
+         MakeWide(middle, last) + ")";
+}
+
+template <typename Execute>
+double Measure(Execute execute) {
+  Stopwatch stopwatch;
+  double checksum = 0;
+  for (int i = 0; i < EVALUATIONS; ++i) {
+    checksum += execute();
+  }
+  DoNotOptimize(checksum);
+  return stopwatch.GetSeconds() * 1e9 / EVALUATIONS;
+}
+
+void RunShape(const std::string& name, const std::string& expression) {
+  const FormulaAST ast = ParseFormulaAST(expression);
+  const std::function<double(Position)> args = [](Position position) {
+    return double(position.row + position.col + 1);
+  };
+
+  const double tree_ns = Measure([&] { return ast.ExecuteTree(args); });
+  const double program_ns = Measure([&] { return ast.Execute(args); });
+
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(10) << tree_ns
+            << std::setw(14) << program_ns << std::setw(10)
+            << tree_ns / program_ns << "x\n";
+}
+}  // namespace
+
+void BenchmarkFormulaEvaluation() {
+  PrintHeader("Formula evaluation, ns/evaluation");
+  std::cout << std::left << std::setw(12) << "shape" << std::right
+            << std::setw(10) << "tree" << std::setw(14) << "bytecode"
+            << std::setw(11) << "speedup" << '\n';
+
+  RunShape("small", "A1*2+B1");
+  RunShape("constants", "(12+13)*(14+(13-24/(1+1))*55-46)*A1");
+  RunShape("deep 64", MakeDeep(64));
+  RunShape("wide 64", MakeWide(0, 64));
+  RunShape("wide 512", MakeWide(0, 512));
+}
@@ -0,0 +1,68 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "formula.h"
+#include "sheet.h"
+
+namespace {
+constexpr int SHEETS = 8;
+constexpr int ROWS = 10000;
+constexpr int DISTINCT = 200;
+
+// An imported sheet: every row holds one of a few hundred formulas, with
+// the same text in many rows, as pasted or exported blocks look.
+void ImportSheet(int seed) {
+  Sheet sheet;
+  for (int row = 0; row < ROWS; ++row) {
+    const std::string k = std::to_string((row * 7919 + seed) % DISTINCT + 1);
+    sheet.SetCell(Position{row, 1}, "=X" + k + "*2+Y" + k + "/(Z" + k + "+1)");
+  }
+}
+
+void RunImport(const std::string& name, size_t capacity, int threads) {
+  FormulaCache& cache = FormulaCache::GetGlobal();
+  cache.SetCapacity(capacity);
+  cache.Clear();
+  const FormulaCacheStats before = cache.GetStats();
+
+  Stopwatch stopwatch;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([t, threads] {
+      for (int sheet = t; sheet < SHEETS; sheet += threads) {
+        ImportSheet(sheet);
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  const double seconds = stopwatch.GetSeconds();
+
+  const FormulaCacheStats stats = cache.GetStats();
+  const size_t hits = stats.hits - before.hits;
+  const size_t lookups = hits + stats.misses - before.misses;
+  std::cout << std::left << std::setw(20) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12)
+            << seconds * 1e9 / (double(SHEETS) * ROWS) << std::setw(12)
+            << (lookups ? 100.0 * hits / lookups : 0.0) << std::setw(12)
+            << stats.entries << '\n';
+}
+}  // namespace
+
+void BenchmarkFormulaCache() {
+  PrintHeader("Formula cache, import of 8 x 10k formulas, 200 distinct");
+  std::cout << std::left << std::setw(20) << "cache" << std::right
+            << std::setw(12) << "ns/formula" << std::setw(12) << "hit %"
+            << std::setw(12) << "entries" << '\n';
+
+  const size_t capacity = FormulaCache::GetGlobal().GetStats().capacity;
+  RunImport("disabled", 0, 1);
+  RunImport("default", FormulaCache::DEFAULT_CAPACITY, 1);
+  RunImport("64 entries", 64, 1);
+  RunImport("default, 4 threads", FormulaCache::DEFAULT_CAPACITY, 4);
+  FormulaCache::GetGlobal().SetCapacity(capacity);
+  FormulaCache::GetGlobal().Clear();
+}
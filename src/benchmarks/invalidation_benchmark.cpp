@@ -0,0 +1,58 @@
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int DEPENDENTS = 100000;
+constexpr int EDITS = 1000;
+constexpr int COLS = 16;
+
+Position GetPosition(int index) { return {1 + index / COLS, index % COLS}; }
+
+double ReadAll(Sheet& sheet) {
+  double checksum = 0;
+  for (int i = 0; i < DEPENDENTS; ++i) {
+    checksum += std::get<double>(
+        sheet.GetCellInterface(GetPosition(i))->GetValue());
+  }
+  return checksum;
+}
+}  // namespace
+
+void BenchmarkRepeatedEdits() {
+  PrintHeader("Repeated edits of a cell read by 100K formulas");
+
+  Sheet sheet;
+  sheet.SetCell(Position{0, 0}, "1");
+  for (int i = 0; i < DEPENDENTS; ++i) {
+    sheet.SetCell(GetPosition(i), "=A1*2");
+  }
+  double checksum = ReadAll(sheet);
+
+  Stopwatch edit_stopwatch;
+  for (int edit = 0; edit < EDITS; ++edit) {
+    sheet.SetCell(Position{0, 0}, std::to_string(edit));
+  }
+  const double edit_seconds = edit_stopwatch.GetSeconds();
+
+  Stopwatch read_stopwatch;
+  checksum += std::get<double>(
+      sheet.GetCellInterface(GetPosition(DEPENDENTS - 1))->GetValue());
+  const double first_read_seconds = read_stopwatch.GetSeconds();
+
+  Stopwatch read_all_stopwatch;
+  checksum += ReadAll(sheet);
+  const double read_all_seconds = read_all_stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  std::cout << std::fixed << std::setprecision(1) << std::left
+            << std::setw(28) << "edit, no reads between" << std::right
+            << std::setw(12) << edit_seconds * 1e9 / EDITS << " ns/edit\n"
+            << std::left << std::setw(28) << "first read after the edits"
+            << std::right << std::setw(12) << first_read_seconds * 1e3
+            << " ms\n"
+            << std::left << std::setw(28) << "reading every dependent"
+            << std::right << std::setw(12)
+            << read_all_seconds * 1e9 / DEPENDENTS << " ns/formula\n";
+}
@@ -0,0 +1,66 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "formula.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = 1000;
+constexpr int OPERANDS = 8;
+constexpr int PASSES = 50;
+
+// Sums of cells holding numbers, numeric text and cached formula results.
+std::vector<std::unique_ptr<FormulaInterface>> MakeFormulas() {
+  std::vector<std::unique_ptr<FormulaInterface>> formulas;
+  for (int row = 0; row < ROWS; ++row) {
+    std::string expression;
+    for (int i = 0; i < OPERANDS; ++i) {
+      const Position cell{(row * 31 + i * 17) % ROWS, i % 3};
+      expression += (i > 0 ? "+" : "") + cell.ToString();
+    }
+    formulas.push_back(ParseFormula(expression));
+  }
+  return formulas;
+}
+
+template <typename Sheet>
+void Run(const std::string& name, const Sheet& sheet,
+         const std::vector<std::unique_ptr<FormulaInterface>>& formulas) {
+  Stopwatch stopwatch;
+  double checksum = 0;
+  for (int pass = 0; pass < PASSES; ++pass) {
+    for (const auto& formula : formulas) {
+      checksum += std::get<double>(formula->Evaluate(sheet));
+    }
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  const double evaluations = double(PASSES) * formulas.size();
+  std::cout << std::left << std::setw(16) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(14)
+            << seconds * 1e9 / evaluations << std::setw(10)
+            << seconds * 1e9 / (evaluations * OPERANDS) << '\n';
+}
+}  // namespace
+
+void BenchmarkCellLookup() {
+  PrintHeader("Cell lookup from formulas, 8 reads per formula");
+  std::cout << std::left << std::setw(16) << "path" << std::right
+            << std::setw(14) << "ns/formula" << std::setw(10) << "ns/read"
+            << '\n';
+
+  Sheet sheet;
+  for (int row = 0; row < ROWS; ++row) {
+    const std::string r = std::to_string(row + 1);
+    sheet.SetCell(Position{row, 0}, r);
+    sheet.SetCell(Position{row, 1}, " " + r + ".5");
+    sheet.SetCell(Position{row, 2}, "=A" + r + "*2");
+  }
+  const auto formulas = MakeFormulas();
+
+  Run("SheetInterface", static_cast<const SheetInterface&>(sheet), formulas);
+  Run("SheetReader", sheet, formulas);
+}
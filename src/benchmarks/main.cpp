@@ -0,0 +1,29 @@
+#include "benchmark.h"
+#include "log/easylogging++.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+int main() {
+  BenchmarkStorage();
+  BenchmarkArena();
+  BenchmarkCells();
+  BenchmarkDependencies();
+  BenchmarkPrinting();
+  BenchmarkSnapshots();
+  BenchmarkMemoryStats();
+  BenchmarkValueCache();
+  BenchmarkFormulaEvaluation();
+  BenchmarkFormulaParsing();
+  BenchmarkNumericText();
+  BenchmarkFormulaTemplates();
+  BenchmarkFormulaCache();
+  BenchmarkCellLookup();
+  BenchmarkRanges();
+  BenchmarkAggregates();
+  BenchmarkCycleDetection();
+  BenchmarkLongChains();
+  BenchmarkRecalculation();
+  BenchmarkParallelRecalculation();
+  BenchmarkRepeatedEdits();
+  return 0;
+}
@@ -0,0 +1,69 @@
+#include <string>
+
+#include "allocation_hooks.h"
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = 256;
+constexpr int COLS = 256;
+
+// Fills a sheet and compares its own accounting with the global heap.
+template <typename Content>
+void RunKind(const std::string& name, Content content) {
+  const size_t before = GetAllocationCounters().live_bytes;
+  Sheet sheet;
+  for (int row = 0; row < ROWS; ++row) {
+    for (int col = 0; col < COLS; ++col) {
+      sheet.SetCell(Position{row, col}, content(Position{row, col}));
+    }
+  }
+  const size_t heap_bytes = GetAllocationCounters().live_bytes - before;
+
+  constexpr int QUERIES = 100000;
+  Stopwatch stopwatch;
+  for (int i = 0; i < QUERIES; ++i) {
+    DoNotOptimize(sheet.GetMemoryStats().GetTotal());
+  }
+  const double query_ns = stopwatch.GetSeconds() * 1e9 / QUERIES;
+
+  const MemoryStats stats = sheet.GetMemoryStats();
+  const double cells = double(ROWS) * COLS;
+  std::cout << std::left << std::setw(10) << name << std::right << std::fixed
+            << std::setprecision(1);
+  for (size_t bytes :
+       {stats.grid, stats.cells, stats.text, stats.formulas,
+        stats.formula_trees, stats.dependencies, stats.values}) {
+    std::cout << std::setw(8) << bytes / cells;
+  }
+  std::cout << std::setw(10) << 100.0 * stats.GetTotal() / heap_bytes << '%'
+            << std::setw(10) << query_ns << '\n';
+}
+}  // namespace
+
+void BenchmarkMemoryStats() {
+  PrintHeader("Memory stats of a 256x256 sheet, B/cell");
+  std::cout << std::left << std::setw(10) << "kind" << std::right
+            << std::setw(8) << "grid" << std::setw(8) << "cells"
+            << std::setw(8) << "text" << std::setw(8) << "formula"
+            << std::setw(8) << "trees" << std::setw(8) << "deps"
+            << std::setw(8) << "values"
+            << std::setw(11) << "of heap" << std::setw(10) << "query ns"
+            << '\n';
+
+  RunKind("labels", [](Position position) {
+    return "Item number " + std::to_string(position.row * COLS + position.col);
+  });
+  RunKind("numbers",
+          [](Position position) { return std::to_string(position.col); });
+  RunKind("formulas", [](Position position) {
+    return position.col == 0
+               ? std::string("=1")
+               : "=" + Position{position.row, position.col - 1}.ToString() +
+                     "*2+" + Position{0, 0}.ToString();
+  });
+  // A tree per cell, kept by the global cache.
+  RunKind("distinct", [](Position position) {
+    return "=ZZ1*" + std::to_string(position.row * COLS + position.col);
+  });
+}
@@ -0,0 +1,93 @@
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "numeric_text.h"
+#include "sheet.h"
+
+namespace {
+constexpr int TEXTS = 1000;
+constexpr int PASSES = 100;
+constexpr int ROWS = 10000;
+
+std::vector<std::string> MakeTexts() {
+  std::vector<std::string> texts;
+  for (int i = 0; i < TEXTS; ++i) {
+    switch (i % 4) {
+      case 0:
+        texts.push_back(std::to_string(i));
+        break;
+      case 1:
+        texts.push_back(" -" + std::to_string(i) + ".25 ");
+        break;
+      case 2:
+        texts.push_back("item " + std::to_string(i));
+        break;
+      default:
+        texts.push_back(std::to_string(i) + "e3");
+    }
+  }
+  return texts;
+}
+
+// How formulas read text before: a regex built for every read.
+double ParseWithRegex(const std::string& text) {
+  std::regex regex_double(R"(^\s*([-+]?\d+(?:\.\d+)?)\s*$)");
+  std::smatch match;
+  return std::regex_match(text, match, regex_double) ? std::stod(match[1])
+                                                     : -1;
+}
+
+template <typename Parse>
+void RunParser(const std::string& name, const std::vector<std::string>& texts,
+               int passes, Parse parse) {
+  Stopwatch stopwatch;
+  double checksum = 0;
+  for (int pass = 0; pass < passes; ++pass) {
+    for (const std::string& text : texts) {
+      checksum += parse(text);
+    }
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12)
+            << seconds * 1e9 / (double(passes) * texts.size()) << '\n';
+}
+
+// Formulas reading a column of numbers stored as text.
+void RunSheet() {
+  Sheet sheet;
+  for (int row = 0; row < ROWS; ++row) {
+    sheet.SetCell(Position{row, 0}, " " + std::to_string(row) + ".5");
+    sheet.SetCell(Position{row, 1},
+                  "=A" + std::to_string(row + 1) + "*2+A" +
+                      std::to_string((row + 1) % ROWS + 1));
+  }
+
+  Stopwatch stopwatch;
+  double checksum = 0;
+  for (int row = 0; row < ROWS; ++row) {
+    checksum +=
+        std::get<double>(sheet.GetCellInterface(Position{row, 1})->GetValue());
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  std::cout << std::left << std::setw(24) << "sheet, per text read"
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(12) << seconds * 1e9 / (2.0 * ROWS) << '\n';
+}
+}  // namespace
+
+void BenchmarkNumericText() {
+  PrintHeader("Numeric text, ns/text");
+  const std::vector<std::string> texts = MakeTexts();
+  RunParser("regex per read", texts, 1, ParseWithRegex);
+  RunParser("ParseNumericText", texts, PASSES, [](const std::string& text) {
+    return ParseNumericText(text).value_or(-1);
+  });
+  RunSheet();
+}
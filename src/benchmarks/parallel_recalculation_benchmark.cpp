@@ -0,0 +1,77 @@
+#include <string>
+#include <thread>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int PASSES = 3;
+
+struct Shape {
+  const char* name;
+  int rows;
+  int cols;
+};
+
+// Rows where every cell adds the cell above and the one to its right; the
+// first row holds the inputs. Each row is one level of the pass.
+void Fill(Sheet& sheet, const Shape& shape) {
+  for (int col = 0; col < shape.cols; ++col) {
+    sheet.SetCell(Position{0, col}, std::to_string(col));
+  }
+  for (int row = 1; row < shape.rows; ++row) {
+    for (int col = 0; col < shape.cols; ++col) {
+      const Position above{row - 1, col};
+      const Position right{row - 1, (col + 1) % shape.cols};
+      sheet.SetCell(Position{row, col},
+                    "=" + above.ToString() + "/2+" + right.ToString() + "/3");
+    }
+  }
+}
+
+void Run(const Shape& shape) {
+  Sheet sheet;
+  Fill(sheet, shape);
+  sheet.Recalculate();
+
+  const double formulas = double(shape.rows - 1) * shape.cols * PASSES;
+  double serial_seconds = 0;
+  int input = 0;
+  for (size_t threads : {1, 2, 4, 8, 16}) {
+    sheet.SetRecalculationThreads(threads);
+    RecalculationStats stats;
+    double seconds = 0;
+    for (int pass = 0; pass < PASSES; ++pass) {
+      ++input;
+      for (int col = 0; col < shape.cols; ++col) {
+        sheet.SetCell(Position{0, col}, std::to_string(col + input));
+      }
+      stats = sheet.Recalculate();
+      seconds += stats.seconds;
+    }
+    if (threads == 1) {
+      serial_seconds = seconds;
+    }
+    std::cout << std::left << std::setw(8) << shape.name << std::right
+              << std::setw(8) << threads << std::fixed << std::setprecision(1)
+              << std::setw(12) << seconds * 1e3 / PASSES << std::setw(12)
+              << seconds * 1e9 / formulas << std::setw(10)
+              << std::setprecision(2) << serial_seconds / seconds
+              << std::setw(10) << stats.depth << '\n';
+  }
+}
+}  // namespace
+
+void BenchmarkParallelRecalculation() {
+  PrintHeader("Recalculation on several threads, every input edited");
+  std::cout << "(" << std::thread::hardware_concurrency()
+            << " hardware threads)\n";
+  std::cout << std::left << std::setw(8) << "shape" << std::right
+            << std::setw(8) << "threads" << std::setw(12) << "ms/pass"
+            << std::setw(12) << "ns/cell" << std::setw(10) << "speedup"
+            << std::setw(10) << "levels" << '\n';
+
+  // 131K formulas in 8 levels, and 262K in 1024 levels of 256.
+  Run({"wide", 9, 16384});
+  Run({"deep", 1025, 256});
+}
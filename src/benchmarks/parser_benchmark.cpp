@@ -0,0 +1,79 @@
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "FormulaAST.h"
+#include "allocation_hooks.h"
+#include "benchmark.h"
+
+namespace {
+constexpr int FORMULAS = 20000;
+
+// Formulas of one shape that differ in their cells and constants.
+std::vector<std::string> MakeFormulas(int operands) {
+  std::vector<std::string> formulas;
+  formulas.reserve(FORMULAS);
+  for (int i = 0; i < FORMULAS; ++i) {
+    std::string formula;
+    for (int operand = 0; operand < operands; ++operand) {
+      if (operand > 0) {
+        formula += "+-*/"[(i + operand) % 4];
+      }
+      const int value = i * 7 + operand;
+      formula += operand % 2 == 0
+                     ? Position{value % 1000, value % 30}.ToString()
+                     : std::to_string(value % 100) + ".5";
+    }
+    formulas.push_back(std::move(formula));
+  }
+  return formulas;
+}
+
+template <typename Parse>
+void RunParser(const std::string& name,
+               const std::vector<std::string>& formulas, Parse parse) {
+  size_t bytes = 0;
+  for (const std::string& formula : formulas) {
+    bytes += formula.size();
+  }
+
+  const size_t allocations_before = GetAllocationCounters().allocations;
+  Stopwatch stopwatch;
+  size_t cells = 0;
+  for (const std::string& formula : formulas) {
+    const FormulaAST ast = parse(formula);
+    cells += std::distance(ast.GetCells().begin(), ast.GetCells().end());
+  }
+  const double seconds = stopwatch.GetSeconds();
+  const size_t allocations =
+      GetAllocationCounters().allocations - allocations_before;
+  DoNotOptimize(cells);
+
+  std::cout << std::left << std::setw(20) << name << std::right << std::fixed
+            << std::setprecision(0) << std::setw(14) << FORMULAS / seconds
+            << std::setprecision(1) << std::setw(10)
+            << bytes / seconds / 1e6 << std::setw(16)
+            << double(allocations) / FORMULAS << '\n';
+}
+
+void RunShape(const std::string& name, int operands) {
+  const std::vector<std::string> formulas = MakeFormulas(operands);
+  RunParser(name + ", ANTLR", formulas, [](const std::string& formula) {
+    return ParseFormulaASTWithAntlr(formula);
+  });
+  RunParser(name + ", Pratt", formulas, [](const std::string& formula) {
+    return ParseFormulaAST(formula);
+  });
+}
+}  // namespace
+
+void BenchmarkFormulaParsing() {
+  PrintHeader("Formula parsing");
+  std::cout << std::left << std::setw(20) << "parser" << std::right
+            << std::setw(14) << "formulas/s" << std::setw(10) << "MB/s"
+            << std::setw(16) << "allocs/formula" << '\n';
+
+  RunShape("3 operands", 3);
+  RunShape("16 operands", 16);
+  RunShape("64 operands", 64);
+}
@@ -0,0 +1,45 @@
+#include <ostream>
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int SIDE = 1000;
+}  // namespace
+
+void BenchmarkPrinting() {
+  PrintHeader("Printing a 1000x1000 sheet");
+
+  Sheet sheet;
+  for (int row = 0; row < SIDE; ++row) {
+    for (int col = 0; col < SIDE; ++col) {
+      sheet.SetCell(Position{row, col}, std::to_string(row + col));
+    }
+  }
+  const double cells = double(SIDE) * SIDE;
+
+  constexpr int SIZE_CALLS = 100;
+  Stopwatch size_stopwatch;
+  for (int call = 0; call < SIZE_CALLS; ++call) {
+    DoNotOptimize(sheet.GetPrintableSize().rows);
+  }
+  const double size_seconds = size_stopwatch.GetSeconds() / SIZE_CALLS;
+
+  NullBuffer buffer;
+  std::ostream output(&buffer);
+  Stopwatch texts_stopwatch;
+  sheet.PrintTexts(output);
+  const double texts_seconds = texts_stopwatch.GetSeconds();
+
+  Stopwatch values_stopwatch;
+  sheet.PrintValues(output);
+  const double values_seconds = values_stopwatch.GetSeconds();
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "GetPrintableSize: " << size_seconds * 1e9 << " ns/call\n"
+            << "PrintTexts:       " << texts_seconds * 1e9 / cells
+            << " ns/cell\n"
+            << "PrintValues:      " << values_seconds * 1e9 / cells
+            << " ns/cell\n";
+}
@@ -0,0 +1,88 @@
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = Position::MAX_ROWS;
+constexpr int PASSES = 20;
+
+void Run(const std::string& name, const std::string& formula) {
+  Sheet sheet;
+  for (int row = 0; row < ROWS; ++row) {
+    sheet.SetCell(Position{row, 0}, std::to_string(row % 100));
+  }
+
+  Stopwatch set_stopwatch;
+  sheet.SetCell(Position{0, 1}, formula);
+  const double set_seconds = set_stopwatch.GetSeconds();
+
+  // Changing a cell of the column drops the cached sum every pass.
+  Stopwatch stopwatch;
+  double checksum = 0;
+  for (int pass = 0; pass < PASSES; ++pass) {
+    sheet.SetCell(Position{ROWS - 1, 0}, std::to_string(pass));
+    checksum +=
+        std::get<double>(sheet.GetCellInterface(Position{0, 1})->GetValue());
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  const MemoryStats memory = sheet.GetMemoryStats();
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(10) << set_seconds * 1e3
+            << std::setw(12) << seconds * 1e9 / (double(PASSES) * ROWS)
+            << std::setw(14) << memory.dependencies << std::setw(12)
+            << memory.formulas << '\n';
+}
+
+// Each cell of a column sums the one-cell range above it, so the graph holds
+// as many ranges as cells and every change looks up range readers.
+void RunChain(int length) {
+  Sheet sheet;
+  Stopwatch fill_stopwatch;
+  sheet.SetCell(Position{0, 0}, "1");
+  for (int row = 1; row < length; ++row) {
+    const std::string above = "A" + std::to_string(row);
+    sheet.SetCell(Position{row, 0}, "=SUM(" + above + ':' + above + ")+1");
+  }
+  const double fill_seconds = fill_stopwatch.GetSeconds();
+
+  // Reading from the top, each cell finds the one above it cached.
+  Stopwatch stopwatch;
+  sheet.SetCell(Position{0, 0}, "2");
+  double value = 0;
+  for (int row = 1; row < length; ++row) {
+    value = std::get<double>(
+        sheet.GetCellInterface(Position{row, 0})->GetValue());
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(value);
+
+  std::cout << std::setw(8) << length << std::fixed << std::setprecision(1)
+            << std::setw(10) << fill_seconds * 1e3 << std::setw(16)
+            << seconds * 1e3 << '\n';
+}
+}  // namespace
+
+void BenchmarkRanges() {
+  PrintHeader("Range references, sum of one full column");
+  std::cout << std::left << std::setw(12) << "formula" << std::right
+            << std::setw(10) << "set ms" << std::setw(12) << "ns/cell"
+            << std::setw(14) << "graph B" << std::setw(12) << "formula B"
+            << '\n';
+
+  std::string chain = "=A1";
+  for (int row = 2; row <= ROWS; ++row) {
+    chain += "+A" + std::to_string(row);
+  }
+  Run("A1+...+An", chain);
+  Run("SUM(A1:An)", "=SUM(A1:A" + std::to_string(ROWS) + ")");
+
+  PrintHeader("Range references, chain of SUM(An:An)+1");
+  std::cout << std::setw(8) << "cells" << std::setw(10) << "fill ms"
+            << std::setw(16) << "edit+read ms" << '\n';
+  for (int length : {4096, 8192, 16384}) {
+    RunChain(length);
+  }
+}
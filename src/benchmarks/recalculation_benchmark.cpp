@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = 1024;
+constexpr int COLS = 64;
+constexpr int PASSES = 5;
+
+std::string Above(int row, int col) {
+  return Position{row - 1, col}.ToString();
+}
+
+// Rows where every cell reads the three cells above it; the first row
+// holds the inputs.
+void Fill(Sheet& sheet) {
+  for (int col = 0; col < COLS; ++col) {
+    sheet.SetCell(Position{0, col}, std::to_string(col));
+  }
+  for (int row = 1; row < ROWS; ++row) {
+    for (int col = 0; col < COLS; ++col) {
+      sheet.SetCell(Position{row, col},
+                    "=(" + Above(row, std::max(col - 1, 0)) + "+" +
+                        Above(row, col) + "+" +
+                        Above(row, std::min(col + 1, COLS - 1)) + ")/3");
+    }
+  }
+}
+
+// Changes every input, one edit each.
+void Edit(Sheet& sheet, int pass) {
+  for (int col = 0; col < COLS; ++col) {
+    sheet.SetCell(Position{0, col}, std::to_string(col + pass));
+  }
+}
+
+// Reads every formula, the last row first.
+double ReadAll(Sheet& sheet) {
+  double checksum = 0;
+  for (int row = ROWS - 1; row > 0; --row) {
+    for (int col = 0; col < COLS; ++col) {
+      checksum += std::get<double>(
+          sheet.GetCellInterface(Position{row, col})->GetValue());
+    }
+  }
+  return checksum;
+}
+}  // namespace
+
+void BenchmarkRecalculation() {
+  PrintHeader("Recalculation after a batch of edits, 64x1024 grid");
+  constexpr double FORMULAS = double(ROWS - 1) * COLS * PASSES;
+
+  Sheet lazy;
+  Fill(lazy);
+  ReadAll(lazy);
+  double checksum = 0;
+  Stopwatch lazy_stopwatch;
+  for (int pass = 1; pass <= PASSES; ++pass) {
+    Edit(lazy, pass);
+    checksum += ReadAll(lazy);
+  }
+  const double lazy_seconds = lazy_stopwatch.GetSeconds();
+
+  Sheet eager;
+  Fill(eager);
+  eager.Recalculate();
+  RecalculationStats stats;
+  double recalculate_seconds = 0;
+  Stopwatch eager_stopwatch;
+  for (int pass = 1; pass <= PASSES; ++pass) {
+    Edit(eager, pass);
+    stats = eager.Recalculate();
+    recalculate_seconds += stats.seconds;
+    checksum -= ReadAll(eager);
+  }
+  const double eager_seconds = eager_stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  std::cout << std::left << std::setw(20) << "mode" << std::right
+            << std::setw(16) << "ns/formula" << std::setw(14)
+            << "pass ns/cell" << '\n';
+  std::cout << std::left << std::setw(20) << "pulled by reads" << std::right
+            << std::fixed << std::setprecision(1) << std::setw(16)
+            << lazy_seconds * 1e9 / FORMULAS << std::setw(14) << "-" << '\n';
+  std::cout << std::left << std::setw(20) << "Recalculate + reads"
+            << std::right << std::setw(16) << eager_seconds * 1e9 / FORMULAS
+            << std::setw(14) << recalculate_seconds * 1e9 / FORMULAS << '\n';
+  std::cout << "last pass: " << stats.evaluated << " evaluated, depth "
+            << stats.depth << ", " << checksum << " difference\n";
+}
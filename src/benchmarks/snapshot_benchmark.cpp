@@ -0,0 +1,86 @@
+#include <atomic>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = 1024;
+constexpr int COLS = 64;
+constexpr int EDITS = 100000;
+
+void Fill(Sheet& sheet) {
+  for (int row = 0; row < ROWS; ++row) {
+    for (int col = 0; col < COLS - 1; ++col) {
+      sheet.SetCell(Position{row, col}, std::to_string(row + col));
+    }
+    sheet.SetCell(Position{row, COLS - 1},
+                  "=" + Position{row, 0}.ToString() + "+" +
+                      Position{row, COLS - 2}.ToString());
+  }
+}
+
+Position GetEditPosition(int edit) {
+  return {(edit * 7919) % ROWS, (edit * 31) % (COLS - 1)};
+}
+
+// Runs the edits and returns ns per SetCell.
+double Edit(Sheet& sheet, int base) {
+  Stopwatch stopwatch;
+  for (int edit = 0; edit < EDITS; ++edit) {
+    sheet.SetCell(GetEditPosition(edit), std::to_string(base + edit));
+  }
+  return stopwatch.GetSeconds() * 1e9 / EDITS;
+}
+
+std::string PrintValues(const SheetInterface& sheet) {
+  std::ostringstream output;
+  sheet.PrintValues(output);
+  return output.str();
+}
+}  // namespace
+
+void BenchmarkSnapshots() {
+  PrintHeader("Snapshots of a 1024x64 sheet");
+
+  Sheet sheet;
+  Fill(sheet);
+
+  constexpr int SNAPSHOTS = 1000;
+  Stopwatch snapshot_stopwatch;
+  for (int i = 0; i < SNAPSHOTS; ++i) {
+    DoNotOptimize(sheet.Snapshot().get());
+  }
+  const double snapshot_ns =
+      snapshot_stopwatch.GetSeconds() * 1e9 / SNAPSHOTS;
+
+  const double plain_edit_ns = Edit(sheet, 0);
+
+  // A reader exports the snapshot over and over while the writer edits.
+  const auto snapshot = sheet.Snapshot();
+  const std::string expected = PrintValues(*snapshot);
+  std::atomic<bool> done = false;
+  int exports = 0;
+  bool consistent = true;
+  std::thread reader([&] {
+    while (!done) {
+      consistent = consistent && PrintValues(*snapshot) == expected;
+      ++exports;
+    }
+  });
+
+  const double shared_edit_ns = Edit(sheet, EDITS);
+  done = true;
+  reader.join();
+  consistent = consistent && PrintValues(*snapshot) == expected;
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "Snapshot():                    " << snapshot_ns << " ns\n"
+            << "SetCell, no snapshot:          " << plain_edit_ns << " ns\n"
+            << "SetCell, snapshot being read:  " << shared_edit_ns << " ns\n"
+            << "exports during edits:          " << exports
+            << (consistent ? ", all consistent" : ", INCONSISTENT") << '\n';
+}
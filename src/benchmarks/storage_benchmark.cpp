@@ -0,0 +1,152 @@
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "allocation_hooks.h"
+#include "benchmark.h"
+#include "sheet.h"
+#include "storage.h"
+
+namespace {
+// The row-of-rows layout Sheet used before CellStorage, kept here as the
+// baseline for the comparison.
+class LegacyGrid {
+ public:
+  void Set(Position position, Cell* cell) {
+    if (position.row >= int(std::size(rows_))) {
+      rows_.resize(position.row + 1);
+    }
+
+    if (position.col >= int(std::size(rows_[position.row]))) {
+      rows_[position.row].resize(position.col + 1);
+    }
+
+    rows_[position.row][position.col] = cell;
+  }
+
+  const Cell* Get(Position position) const {
+    return position.row < int(std::size(rows_)) &&
+                   position.col < int(std::size(rows_[position.row]))
+               ? rows_[position.row][position.col]
+               : nullptr;
+  }
+
+ private:
+  std::vector<std::vector<Cell*>> rows_;
+};
+
+std::vector<Position> MakeSparse() {
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> row(0, Position::MAX_ROWS - 1);
+  std::uniform_int_distribution<int> col(0, Position::MAX_COLS - 1);
+
+  std::vector<Position> positions;
+  for (int i = 0; i < 2000; ++i) {
+    positions.push_back({row(random), col(random)});
+  }
+  return positions;
+}
+
+std::vector<Position> MakeBanded() {
+  std::vector<Position> positions;
+  for (int row = 0; row < 4096; ++row) {
+    for (int col = row; col < row + 16; ++col) {
+      positions.push_back({row, col});
+    }
+  }
+  return positions;
+}
+
+std::vector<Position> MakeDense() {
+  std::vector<Position> positions;
+  for (int row = 0; row < 512; ++row) {
+    for (int col = 0; col < 512; ++col) {
+      positions.push_back({row, col});
+    }
+  }
+  return positions;
+}
+
+Size GetBounds(const std::vector<Position>& positions) {
+  Size size;
+  for (Position position : positions) {
+    size.rows = std::max(size.rows, position.row + 1);
+    size.cols = std::max(size.cols, position.col + 1);
+  }
+  return size;
+}
+
+// Heap bytes taken by the grid alone. Neither layout owns its cells, so
+// both index the same set of cells and are charged only for structure.
+template <typename Grid>
+size_t MeasureGrid(const std::vector<std::unique_ptr<Cell>>& cells,
+                   const std::vector<Position>& positions, Grid& grid) {
+  const size_t before = GetAllocationCounters().live_bytes;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    grid.Set(positions[i], cells[i].get());
+  }
+  return GetAllocationCounters().live_bytes - before;
+}
+
+template <typename Scan>
+double MeasureScan(Size size, Scan scan) {
+  Stopwatch stopwatch;
+  scan(size);
+  return stopwatch.GetSeconds();
+}
+
+void RunShape(const std::string& name, const std::vector<Position>& positions) {
+  Sheet sheet;
+  const Size bounds = GetBounds(positions);
+
+  std::vector<std::unique_ptr<Cell>> cells;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    cells.push_back(std::make_unique<Cell>(sheet, positions[i]));
+  }
+
+  LegacyGrid legacy;
+  CellStorage storage;
+  const size_t legacy_bytes = MeasureGrid(cells, positions, legacy);
+  const size_t storage_bytes = MeasureGrid(cells, positions, storage);
+
+  const double legacy_scan = MeasureScan(bounds, [&legacy](Size size) {
+    size_t found = 0;
+    for (int row = 0; row < size.rows; ++row) {
+      for (int col = 0; col < size.cols; ++col) {
+        found += legacy.Get({row, col}) != nullptr;
+      }
+    }
+    DoNotOptimize(found);
+  });
+
+  const double storage_scan = MeasureScan(bounds, [&storage](Size size) {
+    size_t found = 0;
+    for (int row = 0; row < size.rows; ++row) {
+      storage.ForEachInRow(row, size.cols, [&found](int, const Cell* cell) {
+        found += cell != nullptr;
+      });
+    }
+    DoNotOptimize(found);
+  });
+
+  std::cout << std::left << std::setw(8) << name << std::right
+            << std::setw(10) << positions.size() << std::setw(14)
+            << legacy_bytes << std::setw(14) << storage_bytes
+            << std::setw(10) << storage.GetTileCount() << std::fixed
+            << std::setprecision(4) << std::setw(12) << legacy_scan
+            << std::setw(12) << storage_scan << '\n';
+}
+}  // namespace
+
+void BenchmarkStorage() {
+  PrintHeader("Grid storage: vector of rows vs tiles");
+  std::cout << std::left << std::setw(8) << "shape" << std::right
+            << std::setw(10) << "cells" << std::setw(14) << "legacy B"
+            << std::setw(14) << "tiled B" << std::setw(10) << "tiles"
+            << std::setw(12) << "legacy s" << std::setw(12) << "tiled s"
+            << '\n';
+
+  RunShape("sparse", MakeSparse());
+  RunShape("banded", MakeBanded());
+  RunShape("dense", MakeDense());
+}
@@ -0,0 +1,43 @@
+#include <functional>
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int ROWS = Position::MAX_ROWS;
+
+void RunColumn(const std::string& name,
+               const std::function<std::string(int)>& formula) {
+  Sheet sheet;
+  Stopwatch stopwatch;
+  for (int row = 0; row < ROWS; ++row) {
+    sheet.SetCell(Position{row, 3}, formula(row + 1));
+  }
+  const double seconds = stopwatch.GetSeconds();
+
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12) << seconds * 1e9 / ROWS
+            << std::setw(16)
+            << double(sheet.GetMemoryStats().formulas) / ROWS
+            << std::setw(12) << sheet.GetFormulaTemplateStats().templates
+            << '\n';
+}
+}  // namespace
+
+void BenchmarkFormulaTemplates() {
+  PrintHeader("Formula templates, one full column of formulas");
+  std::cout << std::left << std::setw(12) << "column" << std::right
+            << std::setw(12) << "ns/cell" << std::setw(16)
+            << "formulas B/cell" << std::setw(12) << "templates" << '\n';
+
+  RunColumn("filled down", [](int row) {
+    const std::string r = std::to_string(row);
+    return "=B" + r + "*C" + r;
+  });
+  // Same text in every row, so every row refers to other relative cells.
+  RunColumn("same text", [](int /* row */) { return "=B1*C1"; });
+  RunColumn("distinct", [](int row) {
+    return "=B1*" + std::to_string(row);
+  });
+}
@@ -0,0 +1,60 @@
+#include <string>
+
+#include "benchmark.h"
+#include "sheet.h"
+
+namespace {
+constexpr int FORMULAS = 100000;
+constexpr int COLS = 100;
+constexpr int READS = 1000000;
+
+Position GetPosition(int index) { return {1 + index / COLS, index % COLS}; }
+
+// Nine reads in ten go to the first tenth of the formulas, like a visible
+// window over a large model.
+int GetReadIndex(int read) {
+  const unsigned hash = unsigned(read) * 2654435761u;
+  return hash % 10 != 0 ? int(hash / 10 % (FORMULAS / 10))
+                        : int(hash / 10 % FORMULAS);
+}
+
+void RunBudget(const std::string& name, size_t budget) {
+  Sheet sheet;
+  sheet.SetValueCacheBudget(budget);
+  sheet.SetCell(Position{0, 0}, "=1");
+  for (int i = 0; i < FORMULAS; ++i) {
+    sheet.SetCell(GetPosition(i), "=A1*2+" + std::to_string(i));
+  }
+
+  Stopwatch stopwatch;
+  double checksum = 0;
+  for (int read = 0; read < READS; ++read) {
+    checksum += std::get<double>(
+        sheet.GetCellInterface(GetPosition(GetReadIndex(read)))->GetValue());
+  }
+  const double seconds = stopwatch.GetSeconds();
+  DoNotOptimize(checksum);
+
+  const ValueCacheStats stats = sheet.GetValueCacheStats();
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12)
+            << 100.0 * stats.hits / (stats.hits + stats.misses) << '%'
+            << std::setw(12) << stats.evictions << std::setw(12)
+            << seconds * 1e9 / READS << std::setw(14)
+            << sheet.GetMemoryStats().values / 1024.0 << '\n';
+}
+}  // namespace
+
+void BenchmarkValueCache() {
+  PrintHeader("Value cache, 100k formulas, 90% of reads on 10%");
+  std::cout << std::left << std::setw(12) << "budget" << std::right
+            << std::setw(13) << "hit rate" << std::setw(12) << "evictions"
+            << std::setw(12) << "ns/read" << std::setw(14) << "values KiB"
+            << '\n';
+
+  const size_t all = FORMULAS * ValueCache::GetEntryBytes();
+  RunBudget("unlimited", ValueCache::UNLIMITED);
+  RunBudget("50%", all / 2);
+  RunBudget("15%", all * 15 / 100);
+  RunBudget("5%", all / 20);
+}
@@ -3,171 +3,319 @@
 #include <cassert>
 #include <iostream>
 #include <optional>
-#include <set>
-#include <stack>
 #include <string>
 
 #include "sheet.h"
 #include "log/easylogging++.h"
 
-Cell::Cell(Sheet& sheet)
-    : impl_(std::make_unique<EmptyImpl>()), sheet_(sheet) {}
+static_assert(sizeof(void*) != 8 || sizeof(Cell) <= 32,
+              "Cell record should stay within 32 bytes");
 
-Cell::~Cell() = default;
+Cell::Cell(Sheet& sheet, Position position)
+    : sheet_(&sheet),
+      key_(ToCellKey(position)),
+      generation_(sheet.GetGeneration()) {}
 
-void Cell::Set(std::string content, Position position, Sheet* sheet) {
-  LOG(DEBUG) << "Set cell " << position.ToString() << " to " << content;
+Cell::~Cell() { ReleasePayload(); }
 
-  std::unique_ptr<Impl> impl;
+void Cell::Set(std::string content) {
+  LOG(DEBUG) << "Set cell " << GetPosition().ToString() << " to " << content;
 
-  if (content.empty()) {
-    LOG(DEBUG) << "Empty cell";
-    impl = std::make_unique<EmptyImpl>();
-  }
+  Arena& arena = sheet_->GetArena();
+  // The parsed formula is charged to the sheet, and freed under the same
+  // scope if the content is rejected.
+  MemoryScope scope(&sheet_->GetMemory().formulas);
 
   if (content.size() >= 2 && content[0] == FORMULA_SIGN) {
     LOG(DEBUG) << "Formula cell";
-    impl = std::make_unique<FormulaImpl>(std::move(content), sheet_);
-
-    for (Position cell : impl->GetReferencedCells()) {
-      if (cell.IsValid() && !sheet->GetCellInterface(cell)) {
-        sheet->SetCell(cell, "");
-      }
+    auto formula = arena.templates_.Parse(
+        std::string_view(content).substr(1), GetPosition());
+    const FormulaReferences references = formula->GetReferences();
+
+    // The graph refuses references that would close a loop.
+    if (!sheet_->GetGraph().SetPrecedents(key_, references.cells,
+                                          references.ranges)) {
+      throw CircularDependencyException("Circular dependency");
     }
+
+    ReleasePayload();
+    payload_.formula = arena.formulas_.New(std::move(formula));
+    kind_ = Kind::Formula;
+    MarkStale();
   } else {
-    impl = std::make_unique<TextImpl>(std::move(content));
+    ReleasePayload();
+    if (!content.empty()) {
+      payload_.text = arena.strings_.Intern(content);
+      kind_ = Kind::Text;
+    }
+    sheet_->GetGraph().SetPrecedents(key_, {});
   }
 
-  if (FindLoop(*impl, position)) {
-    throw CircularDependencyException("Circular dependency");
-  }
+  sheet_->InvalidateDependents(key_);
+}
 
-  impl_ = std::move(impl);
+void Cell::Clear() { Set(""); }
 
-  for (Cell* cell : calc_cells_) {
-    cell->use_cells_.erase(this);
+Cell::Value Cell::GetValue() const {
+  switch (kind_) {
+    case Kind::Empty:
+      return "";
+
+    case Kind::Text:
+      return std::string(GetTextValue());
+
+    case Kind::Formula:
+      return std::visit([](const auto& helper) { return Value(helper); },
+                        GetFormulaValue());
   }
 
-  use_cells_.clear();
+  assert(false);
+  return "";
+}
 
-  for (const auto& referenced_cell : impl_->GetReferencedCells()) {
-    Cell* cell = sheet_.GetCell(referenced_cell);
+std::variant<double, FormulaError> Cell::GetNumericValue() const {
+  switch (kind_) {
+    case Kind::Empty:
+      break;
 
-    if (!cell) {
-      sheet_.SetCell(referenced_cell, "");
-      cell = sheet_.GetCell(referenced_cell);
-    }
+    case Kind::Text:
+      if (const std::optional<double> number = payload_.text->GetNumber()) {
+        return *number;
+      }
+      break;
 
-    use_cells_.insert(cell);
-    cell->calc_cells_.insert(this);
+    case Kind::Formula:
+      return GetFormulaValue();
   }
 
-  ClearCache();
+  return FormulaError(FormulaError::Category::Value);
 }
 
-bool Cell::IsLoop(Cell* cell, std::unordered_set<Cell*>& cells,
-                  const Position position) {
-  for (auto cell : cell->GetReferencedCells()) {
-    if (position == cell) {
-      return true;
-    }
+double Cell::GetNumber() const {
+  switch (kind_) {
+    case Kind::Empty:
+      break;
 
-    Cell* referenced_cell = sheet_.GetCell(cell);
-    if (cells.find(referenced_cell) == cells.end()) {
-      cells.insert(referenced_cell);
-      if (IsLoop(referenced_cell, cells, position)) return true;
+    case Kind::Text:
+      if (const std::optional<double> number = payload_.text->GetNumber()) {
+        return *number;
+      }
+      break;
+
+    case Kind::Formula: {
+      const FormulaInterface::Value value = GetFormulaValue();
+      if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+      }
+      throw std::get<FormulaError>(value);
     }
   }
 
-  return false;
+  throw FormulaError(FormulaError::Category::Value);
 }
 
-bool Cell::FindLoop(const Impl& impl, Position position) {
-  LOG(DEBUG) << "Find loop for " << position.ToString();
-  const Position position_const = position;
-  std::unordered_set<Cell*> cells;
+double Cell::GetCachedNumber() const {
+  if (kind_ != Kind::Formula) {
+    return GetNumber();
+  }
 
-  for (const auto& cell : impl.GetReferencedCells()) {
-    LOG(DEBUG) << "Cell " << cell.ToString();
-    if (cell == position) {
-      return true;
-    }
+  const FormulaInterface::Value* value =
+      sheet_->GetValueCache().Peek(payload_.formula->cache);
+  if (!value) {
+    throw SheetReader::MissingValue();
+  }
+  if (const double* number = std::get_if<double>(value)) {
+    return *number;
+  }
+  throw std::get<FormulaError>(*value);
+}
 
-    Cell* referenced_cell = sheet_.GetCell(cell);
-    cells.insert(referenced_cell);
-    if (IsLoop(referenced_cell, cells, position_const)) {
-      LOG(DEBUG) << "Loop found";
-      return true;
-    }
+FormulaInterface::Value Cell::GetFormulaValue() const {
+  sheet_->FlushInvalidations();
+  FormulaSlot& slot = *payload_.formula;
+  ValueCache& cache = sheet_->GetValueCache();
+  if (const FormulaInterface::Value* cached = cache.Find(slot.cache)) {
+    return *cached;
   }
 
-  return false;
+  return EvaluateWithPrecedents();
 }
 
-void Cell::Clear() { Set("", pos_, &sheet_); }
+FormulaInterface::Value Cell::EvaluateWithPrecedents() const {
+  // Reading a stale precedent from inside Evaluate would recurse once per
+  // link of a chain, so the walk keeps its own stack instead. A cell is
+  // evaluated when it comes up the second time, after its precedents.
+  //
+  // Under a budget the cache may not keep a result until the cells reading
+  // it come up, so the walk keeps them too; otherwise every read would
+  // start a walk of its own down the rest of the chain.
+  ValueCache& cache = sheet_->GetValueCache();
+  const bool bounded = cache.IsBounded();
+  SheetReader::Results results;
+  auto is_done = [bounded, &results](const Cell& cell) {
+    return ValueCache::IsEntry(cell.payload_.formula->cache) ||
+           (bounded && results.count(&cell));
+  };
+
+  struct Entry {
+    const Cell* cell;
+    bool expanded;
+  };
+  std::vector<Entry> pending;
+  auto push_stale = [this, &pending, &is_done](CellKey key) {
+    const Cell* cell = sheet_->GetCell(FromCellKey(key));
+    if (cell && cell->kind_ == Kind::Formula && !is_done(*cell)) {
+      pending.push_back({cell, false});
+    }
+  };
+  const DependencyGraph& graph = sheet_->GetGraph();
+  auto push_precedents = [&graph, &push_stale](const Cell& cell) {
+    for (CellKey precedent : graph.GetPrecedents(cell.key_)) {
+      push_stale(precedent);
+    }
+    for (const CellRange& range : graph.GetRangePrecedents(cell.key_)) {
+      graph.ForEachReaderIn(range, push_stale);
+    }
+  };
+
+  const SheetReader reader(*sheet_, results);
+  push_precedents(*this);
+  while (!pending.empty()) {
+    const Entry top = pending.back();
+    if (is_done(*top.cell)) {
+      pending.pop_back();
+    } else if (!top.expanded) {
+      pending.back().expanded = true;
+      push_precedents(*top.cell);
+    } else {
+      pending.pop_back();
+      cache.CountMiss();
+      const FormulaInterface::Value value = top.cell->EvaluateFormula(reader);
+      if (bounded) {
+        results.emplace(top.cell, value);
+      }
+    }
+  }
+  return EvaluateFormula(reader);
+}
+
+FormulaInterface::Value Cell::EvaluateFormula() const {
+  return EvaluateFormula(SheetReader(*sheet_));
+}
 
-Cell::Value Cell::GetValue() const { return impl_->GetValue(); }
+FormulaInterface::Value Cell::EvaluateFormula(
+    const SheetReader& reader) const {
+  FormulaSlot& slot = *payload_.formula;
+  // The position, as printing the expression would cost more than most
+  // evaluations even with debug logs compiled out.
+  LOG(DEBUG) << "Evaluate formula at " << GetPosition().ToString();
+  const FormulaInterface::Value value = slot.formula->Evaluate(reader);
+  sheet_->GetValueCache().Insert(value, &slot.cache);
+  return value;
+}
 
-std::string Cell::GetText() const { return impl_->GetText(); }
+FormulaInterface::Value Cell::EvaluateConcurrently() const {
+  return payload_.formula->formula->Evaluate(
+      SheetReader(*sheet_, /* concurrent = */ true));
+}
 
-std::vector<Position> Cell::GetReferencedCells() const {
-  return impl_->GetReferencedCells();
+void Cell::Publish(const FormulaInterface::Value& value) const {
+  sheet_->GetValueCache().Insert(value, &payload_.formula->cache);
 }
 
-bool Cell::IsReferenced() const { return !calc_cells_.empty(); }
+std::string Cell::GetText() const {
+  switch (kind_) {
+    case Kind::Empty:
+      return "";
 
-void Cell::ClearCache() {
-  if (!impl_->IsEmptyCache()) {
-    impl_->ClearCache();
+    case Kind::Text:
+      return std::string(payload_.text->text.begin(),
+                         payload_.text->text.end());
 
-    for (Cell* cell : calc_cells_) {
-      cell->ClearCache();
-    }
+    case Kind::Formula:
+      return FORMULA_SIGN + payload_.formula->formula->GetExpression();
   }
-}
-
-std::vector<Position> Cell::Impl::GetReferencedCells() const { return {}; }
 
-bool Cell::Impl::IsEmptyCache() { return false; }
+  assert(false);
+  return "";
+}
 
-void Cell::Impl::ClearCache() {}
+std::vector<Position> Cell::GetReferencedCells() const {
+  return kind_ == Kind::Formula
+             ? payload_.formula->formula->GetReferencedCells()
+             : std::vector<Position>{};
+}
 
-Cell::Value Cell::EmptyImpl::GetValue() const { return ""; }
+const FormulaInterface* Cell::GetFormula() const {
+  return kind_ == Kind::Formula ? payload_.formula->formula.get() : nullptr;
+}
 
-std::string Cell::EmptyImpl::GetText() const { return ""; }
+std::string_view Cell::GetTextValue() const {
+  if (kind_ != Kind::Text) {
+    return {};
+  }
 
-Cell::TextImpl::TextImpl(std::string content) : text_(std::move(content)) {}
+  std::string_view text = payload_.text->text;
+  if (text.front() == ESCAPE_SIGN) {
+    text.remove_prefix(1);
+  }
+  return text;
+}
 
-Cell::Value Cell::TextImpl::GetValue() const {
-  if (text_.empty()) {
-    throw FormulaException("Empty cell");
+bool Cell::DropResult() {
+  if (kind_ != Kind::Formula || payload_.formula->cache == ValueCache::EMPTY) {
+    return false;
   }
 
-  return text_.at(0) == ESCAPE_SIGN ? text_.substr(1) : text_;
+  sheet_->GetValueCache().Erase(&payload_.formula->cache);
+  MarkStale();
+  return true;
 }
 
-std::string Cell::TextImpl::GetText() const { return text_; }
+void Cell::ReleasePayload() {
+  Arena& arena = sheet_->GetArena();
+  MemoryScope scope(&sheet_->GetMemory().formulas);
+
+  switch (kind_) {
+    case Kind::Empty:
+      break;
 
-Cell::FormulaImpl::FormulaImpl(std::string content, SheetInterface& sheet)
-    : formula_(ParseFormula(content.substr(1))), sheet_(sheet) {}
+    case Kind::Text:
+      arena.strings_.Release(payload_.text);
+      break;
 
-Cell::Value Cell::FormulaImpl::GetValue() const {
-  LOG(DEBUG) << "Get value for formula " << formula_->GetExpression();
-  if (!db_) {
-    LOG(DEBUG) << "Evaluate formula";
-    db_ = formula_->Evaluate(sheet_);
+    case Kind::Formula:
+      sheet_->GetValueCache().Erase(&payload_.formula->cache);
+      arena.formulas_.Delete(payload_.formula);
+      break;
   }
-  return std::visit([](auto& helper) { return Value(helper); }, *db_);
+
+  payload_ = {};
+  kind_ = Kind::Empty;
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-  return FORMULA_SIGN + formula_->GetExpression();
+void Cell::MarkStale() {
+  if (!listed_) {
+    listed_ = true;
+    sheet_->MarkStale(key_);
+  }
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-  return formula_->GetReferencedCells();
+Cell::Arena::Arena(MemoryCounters& memory)
+    : cells_(&memory.cells),
+      strings_(&memory.text),
+      templates_(&memory.formulas, &memory.formula_trees),
+      formulas_(&memory.values) {}
+
+Cell* Cell::Arena::NewCell(Sheet& sheet, Position position) {
+  return cells_.New(sheet, position);
 }
 
-bool Cell::FormulaImpl::IsEmptyCache() { return !db_.has_value(); }
+void Cell::Arena::DeleteCell(Cell* cell) { cells_.Delete(cell); }
 
-void Cell::FormulaImpl::ClearCache() { db_.reset(); }
+ArenaStats Cell::Arena::GetStats() const {
+  ArenaStats stats = cells_.GetStats();
+  stats += strings_.GetArenaStats();
+  stats += formulas_.GetStats();
+  return stats;
+}
@@ -1,88 +1,149 @@
 #pragma once
 
-#include <functional>
-#include <optional>
-#include <set>
-#include <stack>
-#include <unordered_set>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "arena.h"
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
+#include "memory.h"
+#include "string_pool.h"
+#include "value_cache.h"
 
 class Sheet;
 
+// A cell is a small tagged record: the kind selects which member of the
+// payload is live, and dispatch is a switch on the kind. Text and formulas
+// live in the sheet arena, equal texts shared through its string pool;
+// dependency edges live in the sheet graph.
 class Cell : public CellInterface {
  public:
-  Cell(Sheet& sheet);
+  class Arena;
+
+  enum class Kind : uint8_t {
+    Empty,
+    Text,
+    Formula,
+  };
+
+  Cell(Sheet& sheet, Position position);
   ~Cell();
 
-  void Set(std::string content, Position pos, Sheet* sheet);
+  void Set(std::string content);
   void Clear();
 
   Value GetValue() const override;
   std::string GetText() const override;
 
   std::vector<Position> GetReferencedCells() const override;
-
-  bool IsReferenced() const;
-  void ClearCache();
+  std::variant<double, FormulaError> GetNumericValue() const override;
+  // The same for formulas of this sheet, which read it through SheetReader:
+  // the number, or the FormulaError thrown instead of wrapped in a variant.
+  double GetNumber() const;
+  // Same, but takes only a cached formula result and changes nothing;
+  // throws SheetReader::MissingValue if there is none.
+  double GetCachedNumber() const;
+
+  // Value of a text cell without the escape sign, read in place from the
+  // string pool. Empty for other kinds.
+  std::string_view GetTextValue() const;
+
+  // The parsed formula of a formula cell, otherwise nullptr.
+  const FormulaInterface* GetFormula() const;
+
+  // Whether the cell holds a formula not evaluated since it or a cell it
+  // reads changed.
+  bool IsStale() const {
+    return kind_ == Kind::Formula &&
+           payload_.formula->cache == ValueCache::EMPTY;
+  }
+  // Whether the cell is on the stale list of the sheet, see MarkStale.
+  bool IsListed() const { return listed_; }
+  // Takes the cell off the list; returns whether it was on it.
+  bool Unlist() { return std::exchange(listed_, false); }
+  // Evaluates the formula of a formula cell and caches the result. Stale
+  // precedents are evaluated on the way, so callers should go in
+  // dependency order; see Sheet::Recalculate.
+  FormulaInterface::Value EvaluateFormula() const;
+  // Evaluates the formula of a formula cell through a concurrent
+  // SheetReader, so cells none of which reads another can be evaluated on
+  // several threads at once. Caches nothing and logs nothing; Publish
+  // stores the result afterwards, on one thread.
+  FormulaInterface::Value EvaluateConcurrently() const;
+  void Publish(const FormulaInterface::Value& value) const;
+
+  Kind GetKind() const { return kind_; }
+  Position GetPosition() const { return FromCellKey(key_); }
+  // Snapshot generation of the sheet when the cell was created. Cells from
+  // another generation may be shared with a snapshot.
+  uint16_t GetGeneration() const { return generation_; }
+  // Marks the cell as possibly shared; used when the generation wraps.
+  void ResetGeneration() { generation_ = 0; }
+  // Drops the cached result of a formula cell and lists it as stale.
+  // Returns whether the cell had a result since it last changed, evicted
+  // or not; dependents of a cell without one hold none either.
+  bool DropResult();
 
  private:
-  class Impl;
-
-  bool IsLoop(Cell* cell, std::unordered_set<Cell*>& cells,
-              const Position position);
-  bool FindLoop(const Impl& impl, Position position);
-
-  class Impl {
-   public:
-    virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const;
-
-    virtual bool IsEmptyCache();
-    virtual void ClearCache();
+  struct FormulaSlot {
+    explicit FormulaSlot(std::unique_ptr<FormulaInterface> formula)
+        : formula(std::move(formula)) {}
 
-    virtual ~Impl() = default;
+    std::unique_ptr<FormulaInterface> formula;
+    // The result lives in the value cache of the sheet.
+    ValueCache::Handle cache = ValueCache::EMPTY;
   };
 
-  class EmptyImpl : public Impl {
-   public:
-    Value GetValue() const override;
-    std::string GetText() const override;
+  union Payload {
+    const StringPool::Entry* text;
+    FormulaSlot* formula;
   };
 
-  class TextImpl : public Impl {
-   public:
-    explicit TextImpl(std::string content);
-    Value GetValue() const override;
-    std::string GetText() const override;
-
-   private:
-    std::string text_;
-  };
-
-  class FormulaImpl : public Impl {
-   public:
-    explicit FormulaImpl(std::string content, SheetInterface& sheet);
-
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
+  // Cached or freshly evaluated result of a formula cell.
+  FormulaInterface::Value GetFormulaValue() const;
+  // Evaluates the stale formulas the cell reads, precedents first, then
+  // the cell itself.
+  FormulaInterface::Value EvaluateWithPrecedents() const;
+  FormulaInterface::Value EvaluateFormula(const SheetReader& reader) const;
+
+  void ReleasePayload();
+  // Puts the cell on the stale list of the sheet unless it is there.
+  void MarkStale();
+
+  Sheet* sheet_;
+  Payload payload_{};
+  CellKey key_;
+  uint16_t generation_;
+  Kind kind_ = Kind::Empty;
+  bool listed_ = false;
+};
+
+// Per-sheet pools for cells and their contents. ClearCell and content
+// changes hand slots back to the free lists, so refilling a sheet reuses
+// memory instead of allocating. Formulas share parsed trees through the
+// templates. Each pool is charged to its category of the sheet counters.
+class Cell::Arena {
+ public:
+  explicit Arena(MemoryCounters& memory);
 
-    bool IsEmptyCache() override;
-    void ClearCache() override;
+  Cell* NewCell(Sheet& sheet, Position position);
+  void DeleteCell(Cell* cell);
 
-   private:
-    mutable std::optional<FormulaInterface::Value> db_;
-    std::unique_ptr<FormulaInterface> formula_;
-    SheetInterface& sheet_;
-  };
+  ArenaStats GetStats() const;
+  StringPoolStats GetStringStats() const { return strings_.GetStats(); }
+  FormulaTemplateStats GetTemplateStats() const {
+    return templates_.GetStats();
+  }
 
-  std::unique_ptr<Impl> impl_;
-  Sheet& sheet_;
+ private:
+  friend class Cell;
 
-  std::unordered_set<Cell*> calc_cells_;
-  std::unordered_set<Cell*> use_cells_;
-  Position pos_;
-};
\ No newline at end of file
+  SlabAllocator<Cell> cells_;
+  StringPool strings_;
+  FormulaTemplates templates_;
+  SlabAllocator<FormulaSlot> formulas_;
+};
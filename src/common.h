@@ -32,6 +32,24 @@ struct Size {
   bool operator==(Size rhs) const;
 };
 
+// A rectangle of cells, written A1:B10, from its top left to its bottom
+// right corner.
+struct CellRange {
+  Position first;
+  Position last;
+
+  bool operator==(CellRange rhs) const;
+  bool operator<(CellRange rhs) const;
+
+  bool Contains(Position position) const;
+  // Number of cells in the range.
+  size_t GetSize() const;
+  std::string ToString() const;
+
+  // The range between two corners given in any order.
+  static CellRange FromCorners(Position a, Position b);
+};
+
 class FormulaError {
  public:
   enum class Category {
@@ -87,6 +105,11 @@ class CellInterface {
   virtual Value GetValue() const = 0;
   virtual std::string GetText() const = 0;
   virtual std::vector<Position> GetReferencedCells() const = 0;
+
+  // The value as a formula operand. Text counts only if it spells a number
+  // (see ParseNumericText); other text is a #VALUE! error. The default
+  // converts GetValue(); cells that keep the number at hand override it.
+  virtual std::variant<double, FormulaError> GetNumericValue() const;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -0,0 +1,681 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "log/easylogging++.h"
+
+DependencyGraph::DependencyGraph(MemoryCounter* counter)
+    : counter_(counter),
+      index_(counter),
+      nodes_(TrackingAllocator<Node>(counter)),
+      free_nodes_(TrackingAllocator<uint32_t>(counter)),
+      compacted_(TrackingAllocator<CellKey>(counter)),
+      range_index_(counter),
+      range_lists_(TrackingAllocator<Vector<CellRange>>(counter)),
+      free_range_lists_(TrackingAllocator<uint32_t>(counter)),
+      range_tiles_(TrackingAllocator<
+                   std::pair<const uint32_t, Vector<RangeEntry>>>(counter)),
+      ranks_(counter),
+      pending_(TrackingAllocator<CellKey>(counter)),
+      forward_(TrackingAllocator<CellKey>(counter)),
+      backward_(TrackingAllocator<CellKey>(counter)),
+      free_ranks_(TrackingAllocator<uint32_t>(counter)) {}
+
+DependencyGraph::~DependencyGraph() {
+  // Spilled lists are freed under the counter they were charged to.
+  MemoryScope scope(counter_);
+  nodes_.clear();
+}
+
+bool DependencyGraph::SetPrecedents(CellKey cell,
+                                    const std::vector<Position>& precedents,
+                                    const std::vector<CellRange>& ranges) {
+  LOG(DEBUG) << "Set " << precedents.size() << " precedents and "
+             << ranges.size() << " ranges for "
+             << FromCellKey(cell).ToString();
+
+  MemoryScope scope(counter_);
+  if (precedents.empty() && ranges.empty()) {
+    ranks_.Erase(cell);
+  } else if (!Order(cell, precedents, ranges)) {
+    LOG(DEBUG) << "Loop found";
+    return false;
+  }
+  size_t changed = precedents.size() + ranges.size();
+
+  const Ranges old_ranges = GetRangePrecedents(cell);
+  changed += old_ranges.size();
+  if (!old_ranges.empty() || !ranges.empty()) {
+    RemoveRanges(cell);
+    AddRanges(cell, ranges);
+  }
+
+  if (const uint32_t* id = index_.Find(cell)) {
+    // Releasing a precedent node never reallocates nodes_, so the list can
+    // be walked in place.
+    EdgeList& old_precedents = nodes_[*id].precedents;
+    for (CellKey precedent : old_precedents.Get()) {
+      nodes_[*index_.Find(precedent)].dependents.Erase(cell);
+      ReleaseNodeIfUnused(precedent);
+    }
+
+    changed += old_precedents.Size();
+    edges_ -= old_precedents.Size();
+    old_precedents.Clear();
+  }
+
+  for (Position position : precedents) {
+    const CellKey precedent = ToCellKey(position);
+    GetOrCreateNode(precedent).dependents.Insert(cell);
+    GetOrCreateNode(cell).precedents.Insert(precedent);
+  }
+
+  // Duplicate references collapse into one edge.
+  const Node* node = FindNode(cell);
+  edges_ += node ? node->precedents.Size() : 0;
+  ReleaseNodeIfUnused(cell);
+  CountMutations(changed);
+  return true;
+}
+
+DependencyGraph::Edges DependencyGraph::GetPrecedents(CellKey cell) const {
+  const Node* node = FindNode(cell);
+  return node ? node->precedents.Get() : Edges(nullptr, nullptr);
+}
+
+DependencyGraph::Edges DependencyGraph::GetDependents(CellKey cell) const {
+  const Node* node = FindNode(cell);
+  return node ? node->dependents.Get() : Edges(nullptr, nullptr);
+}
+
+DependencyGraph::Ranges DependencyGraph::GetRangePrecedents(
+    CellKey cell) const {
+  const uint32_t* id = range_index_.Find(cell);
+  if (!id) {
+    return {nullptr, nullptr};
+  }
+
+  const Vector<CellRange>& ranges = range_lists_[*id];
+  return {ranges.data(), ranges.data() + ranges.size()};
+}
+
+bool DependencyGraph::HasDependents(CellKey cell) const {
+  if (!GetDependents(cell).empty()) {
+    return true;
+  }
+  if (range_tiles_.empty()) {
+    return false;
+  }
+
+  const Position position = FromCellKey(cell);
+  for (int shift = FIRST_TILE_SHIFT; shift <= LAST_TILE_SHIFT;
+       shift += TILE_SHIFT_STEP) {
+    const auto* tile = FindTile(shift, position);
+    if (tile && std::any_of(tile->begin(), tile->end(),
+                            [position](const RangeEntry& entry) {
+                              return entry.range.Contains(position);
+                            })) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::optional<uint32_t> DependencyGraph::GetRank(CellKey cell) const {
+  const uint32_t* rank = ranks_.Find(cell);
+  return rank ? std::optional<uint32_t>(*rank) : std::nullopt;
+}
+
+void DependencyGraph::Compact() {
+  MemoryScope scope(counter_);
+  size_t total = 0;
+  for (const Node& node : nodes_) {
+    for (const EdgeList* list : {&node.precedents, &node.dependents}) {
+      if (list->IsSpilled()) {
+        total += list->Size();
+      }
+    }
+  }
+
+  LOG(DEBUG) << "Compacting " << total << " spilled edges";
+
+  // Lists still point into the old array while they are copied out of it.
+  Vector<CellKey> compacted(total, compacted_.get_allocator());
+  size_t offset = 0;
+  for (Node& node : nodes_) {
+    for (EdgeList* list : {&node.precedents, &node.dependents}) {
+      if (list->IsSpilled()) {
+        list->MoveTo(compacted.data() + offset);
+        offset += list->Size();
+      }
+    }
+  }
+
+  compacted_.swap(compacted);
+  mutations_ = 0;
+  ++compactions_;
+}
+
+DependencyStats DependencyGraph::GetStats() const {
+  DependencyStats stats;
+  stats.nodes = index_.Size();
+  stats.edges = edges_;
+  stats.compacted_edges = compacted_.size();
+  stats.compactions = compactions_;
+  stats.ranges = range_count_;
+  stats.ordered = ranks_.Size();
+  stats.reordered = reordered_;
+
+  for (const Node& node : nodes_) {
+    for (const EdgeList* list : {&node.precedents, &node.dependents}) {
+      stats.spilled_lists += list->IsSpilled() && !list->IsCompacted();
+    }
+  }
+
+  return stats;
+}
+
+bool DependencyGraph::Order(CellKey cell,
+                            const std::vector<Position>& precedents,
+                            const std::vector<CellRange>& ranges) {
+  const Position position = FromCellKey(cell);
+  if (std::find(precedents.begin(), precedents.end(), position) !=
+          precedents.end() ||
+      std::any_of(ranges.begin(), ranges.end(),
+                  [position](const CellRange& range) {
+                    return range.Contains(position);
+                  })) {
+    return false;
+  }
+
+  // A new cell goes below everything if others read it already, else on
+  // top, so filling a sheet either way round never moves anything.
+  const uint32_t* found = ranks_.Find(cell);
+  const bool added = !found;
+  uint32_t rank;
+  if (found) {
+    rank = *found;
+  } else {
+    if (lowest_rank_ == 0 || highest_rank_ == VISITED - 1) {
+      Renumber();
+    }
+    rank = HasDependents(cell) ? --lowest_rank_ : ++highest_rank_;
+    *ranks_.Insert(cell).first = rank;
+  }
+
+  // Only precedents ranked after the cell break the order.
+  backward_.clear();
+  uint32_t bound = rank;
+  auto add = [this, rank, &bound](CellKey precedent) {
+    const uint32_t* precedent_rank = ranks_.Find(precedent);
+    if (precedent_rank && *precedent_rank > rank) {
+      backward_.push_back(precedent);
+      bound = std::max(bound, *precedent_rank);
+    }
+  };
+  for (Position precedent : precedents) {
+    add(ToCellKey(precedent));
+  }
+  for (const CellRange& range : ranges) {
+    ForEachReaderIn(range, add);
+  }
+  if (backward_.empty()) {
+    return true;
+  }
+
+  if (!SearchForward(cell, bound)) {
+    ClearMarks();
+    if (added) {
+      ranks_.Erase(cell);
+    }
+    return false;
+  }
+  SearchBackward(rank);
+  Reorder();
+  return true;
+}
+
+bool DependencyGraph::SearchForward(CellKey cell, uint32_t bound) {
+  forward_.clear();
+  pending_.clear();
+  auto visit = [this, bound](CellKey dependent) {
+    uint32_t* rank = ranks_.Find(dependent);
+    if (rank && *rank <= bound) {  // also false once marked
+      *rank |= VISITED;
+      forward_.push_back(dependent);
+      pending_.push_back(dependent);
+    }
+  };
+  visit(cell);
+  while (!pending_.empty()) {
+    const CellKey current = pending_.back();
+    pending_.pop_back();
+    for (CellKey dependent : GetDependents(current)) {
+      visit(dependent);
+    }
+    ForEachRangeDependent(current, visit);
+  }
+
+  // The cells in backward_ are all ranked at most bound, so a path to any
+  // of them has been walked.
+  return std::none_of(backward_.begin(), backward_.end(),
+                      [this](CellKey precedent) {
+                        return *ranks_.Find(precedent) & VISITED;
+                      });
+}
+
+void DependencyGraph::SearchBackward(uint32_t bound) {
+  std::sort(backward_.begin(), backward_.end());
+  backward_.erase(std::unique(backward_.begin(), backward_.end()),
+                  backward_.end());
+  pending_.assign(backward_.begin(), backward_.end());
+  for (CellKey precedent : backward_) {
+    *ranks_.Find(precedent) |= VISITED;
+  }
+
+  auto visit = [this, bound](CellKey precedent) {
+    uint32_t* rank = ranks_.Find(precedent);
+    if (rank && !(*rank & VISITED) && *rank > bound) {
+      *rank |= VISITED;
+      backward_.push_back(precedent);
+      pending_.push_back(precedent);
+    }
+  };
+  while (!pending_.empty()) {
+    const CellKey current = pending_.back();
+    pending_.pop_back();
+    for (CellKey precedent : GetPrecedents(current)) {
+      visit(precedent);
+    }
+    for (const CellRange& range : GetRangePrecedents(current)) {
+      ForEachReaderIn(range, visit);
+    }
+  }
+}
+
+void DependencyGraph::Reorder() {
+  free_ranks_.clear();
+  for (const Vector<CellKey>* cells : {&backward_, &forward_}) {
+    for (CellKey cell : *cells) {
+      free_ranks_.push_back(*ranks_.Find(cell) & ~VISITED);
+    }
+  }
+  std::sort(free_ranks_.begin(), free_ranks_.end());
+
+  // Both lists keep their own order; the backward one moves in front.
+  auto by_rank = [this](CellKey a, CellKey b) {
+    return *ranks_.Find(a) < *ranks_.Find(b);
+  };
+  std::sort(backward_.begin(), backward_.end(), by_rank);
+  std::sort(forward_.begin(), forward_.end(), by_rank);
+  const uint32_t* rank = free_ranks_.data();
+  for (const Vector<CellKey>* cells : {&backward_, &forward_}) {
+    for (CellKey cell : *cells) {
+      *ranks_.Find(cell) = *rank++;
+    }
+  }
+  reordered_ += free_ranks_.size();
+}
+
+void DependencyGraph::ClearMarks() {
+  for (const Vector<CellKey>* cells : {&backward_, &forward_}) {
+    for (CellKey cell : *cells) {
+      *ranks_.Find(cell) &= ~VISITED;
+    }
+  }
+}
+
+void DependencyGraph::Renumber() {
+  LOG(DEBUG) << "Renumbering " << ranks_.Size() << " ranks";
+
+  std::vector<std::pair<uint32_t, CellKey>> order;
+  order.reserve(ranks_.Size());
+  ranks_.ForEach([&order](CellKey cell, uint32_t rank) {
+    order.emplace_back(rank, cell);
+  });
+  std::sort(order.begin(), order.end());
+
+  lowest_rank_ = FIRST_RANK - uint32_t(order.size() / 2);
+  highest_rank_ = lowest_rank_;
+  for (const auto& [rank, cell] : order) {
+    *ranks_.Find(cell) = highest_rank_++;
+  }
+  --highest_rank_;
+}
+
+void DependencyGraph::AddRanges(CellKey reader,
+                                const std::vector<CellRange>& ranges) {
+  if (ranges.empty()) {
+    return;
+  }
+
+  uint32_t id;
+  if (free_range_lists_.empty()) {
+    id = uint32_t(range_lists_.size());
+    range_lists_.emplace_back(TrackingAllocator<CellRange>(counter_));
+  } else {
+    id = free_range_lists_.back();
+    free_range_lists_.pop_back();
+  }
+  *range_index_.Insert(reader).first = id;
+  range_lists_[id].assign(ranges.begin(), ranges.end());
+  range_count_ += ranges.size();
+
+  for (const CellRange& range : ranges) {
+    const int shift = GetTileShift(range);
+    for (int row = range.first.row >> shift; row <= range.last.row >> shift;
+         ++row) {
+      for (int col = range.first.col >> shift;
+           col <= range.last.col >> shift; ++col) {
+        range_tiles_
+            .try_emplace(GetTileKey(shift, row, col),
+                         TrackingAllocator<RangeEntry>(counter_))
+            .first->second.push_back({range, reader});
+      }
+    }
+  }
+}
+
+void DependencyGraph::RemoveRanges(CellKey reader) {
+  const uint32_t* id = range_index_.Find(reader);
+  if (!id) {
+    return;
+  }
+
+  Vector<CellRange>& ranges = range_lists_[*id];
+  for (const CellRange& range : ranges) {
+    const int shift = GetTileShift(range);
+    for (int row = range.first.row >> shift; row <= range.last.row >> shift;
+         ++row) {
+      for (int col = range.first.col >> shift;
+           col <= range.last.col >> shift; ++col) {
+        // Tiles are unordered; the last entry fills the hole.
+        const auto tile = range_tiles_.find(GetTileKey(shift, row, col));
+        Vector<RangeEntry>& entries = tile->second;
+        const auto entry = std::find_if(
+            entries.begin(), entries.end(),
+            [reader, range](const RangeEntry& entry) {
+              return entry.reader == reader && entry.range == range;
+            });
+        *entry = entries.back();
+        entries.pop_back();
+        if (entries.empty()) {
+          range_tiles_.erase(tile);
+        }
+      }
+    }
+  }
+
+  range_count_ -= ranges.size();
+  Vector<CellRange>(ranges.get_allocator()).swap(ranges);
+  free_range_lists_.push_back(*id);
+  range_index_.Erase(reader);
+}
+
+int DependencyGraph::GetTileShift(CellRange range) {
+  const int extent = std::max(range.last.row - range.first.row,
+                              range.last.col - range.first.col) +
+                     1;
+  int shift = FIRST_TILE_SHIFT;
+  while (shift < LAST_TILE_SHIFT && extent > 1 << shift) {
+    shift += TILE_SHIFT_STEP;
+  }
+  return shift;
+}
+
+const std::vector<DependencyGraph::RangeEntry,
+                  TrackingAllocator<DependencyGraph::RangeEntry>>*
+DependencyGraph::FindTile(int shift, Position position) const {
+  const auto tile = range_tiles_.find(
+      GetTileKey(shift, position.row >> shift, position.col >> shift));
+  return tile != range_tiles_.end() ? &tile->second : nullptr;
+}
+
+const DependencyGraph::Node* DependencyGraph::FindNode(CellKey cell) const {
+  const uint32_t* id = index_.Find(cell);
+  return id ? &nodes_[*id] : nullptr;
+}
+
+DependencyGraph::Node& DependencyGraph::GetOrCreateNode(CellKey cell) {
+  auto [id, inserted] = index_.Insert(cell);
+  if (!inserted) {
+    return nodes_[*id];
+  }
+
+  if (free_nodes_.empty()) {
+    *id = uint32_t(nodes_.size());
+    nodes_.emplace_back();
+  } else {
+    *id = free_nodes_.back();
+    free_nodes_.pop_back();
+  }
+
+  return nodes_[*id];
+}
+
+void DependencyGraph::ReleaseNodeIfUnused(CellKey cell) {
+  const uint32_t* id = index_.Find(cell);
+  if (!id) {
+    return;
+  }
+
+  Node& node = nodes_[*id];
+  if (node.precedents.Size() == 0 && node.dependents.Size() == 0) {
+    node.precedents.Clear();
+    node.dependents.Clear();
+    free_nodes_.push_back(*id);
+    index_.Erase(cell);
+  }
+}
+
+void DependencyGraph::CountMutations(size_t count) {
+  // Compacting once the changes since the last pass reach the size of the
+  // graph keeps its cost amortized O(1) per changed edge.
+  mutations_ += count;
+  if (mutations_ >= COMPACTION_THRESHOLD && mutations_ >= edges_) {
+    Compact();
+  }
+}
+
+const uint32_t* DependencyGraph::NodeIndex::Find(CellKey key) const {
+  if (slots_.empty()) {
+    return nullptr;
+  }
+
+  const Slot& slot = slots_[Probe(key)];
+  return slot.key == key ? &slot.id : nullptr;
+}
+
+uint32_t* DependencyGraph::NodeIndex::Find(CellKey key) {
+  return const_cast<uint32_t*>(std::as_const(*this).Find(key));
+}
+
+std::pair<uint32_t*, bool> DependencyGraph::NodeIndex::Insert(CellKey key) {
+  // Keep the load factor at or below 3/4 so probe sequences stay short.
+  if ((size_ + 1) * 4 > slots_.size() * 3) {
+    Grow();
+  }
+
+  Slot& slot = slots_[Probe(key)];
+  if (slot.key == key) {
+    return {&slot.id, false};
+  }
+
+  slot.key = key;
+  ++size_;
+  return {&slot.id, true};
+}
+
+void DependencyGraph::NodeIndex::Erase(CellKey key) {
+  if (slots_.empty()) {
+    return;
+  }
+
+  size_t hole = Probe(key);
+  if (slots_[hole].key != key) {
+    return;
+  }
+
+  // Backward-shift deletion: pull later entries of the run into the hole
+  // unless that would move them in front of their home slot.
+  const size_t mask = slots_.size() - 1;
+  for (size_t next = (hole + 1) & mask; slots_[next].key != EMPTY;
+       next = (next + 1) & mask) {
+    const size_t home = GetHome(slots_[next].key);
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      slots_[hole] = slots_[next];
+      hole = next;
+    }
+  }
+
+  slots_[hole] = Slot{};
+  --size_;
+}
+
+size_t DependencyGraph::NodeIndex::GetHome(CellKey key) const {
+  // Fibonacci hashing spreads neighbouring cells over the whole table.
+  return size_t((uint64_t(key) * 0x9E3779B97F4A7C15ull) >> shift_);
+}
+
+size_t DependencyGraph::NodeIndex::Probe(CellKey key) const {
+  const size_t mask = slots_.size() - 1;
+  size_t index = GetHome(key);
+  while (slots_[index].key != key && slots_[index].key != EMPTY) {
+    index = (index + 1) & mask;
+  }
+  return index;
+}
+
+void DependencyGraph::NodeIndex::Grow() {
+  std::vector<Slot, TrackingAllocator<Slot>> slots(
+      std::max(slots_.size() * 2, MIN_CAPACITY), Slot{},
+      slots_.get_allocator());
+  slots.swap(slots_);
+  shift_ = 64;
+  for (size_t capacity = slots_.size(); capacity > 1; capacity /= 2) {
+    --shift_;
+  }
+
+  for (const Slot& slot : slots) {
+    if (slot.key != EMPTY) {
+      slots_[Probe(slot.key)] = slot;
+    }
+  }
+}
+
+static_assert(sizeof(CellKey*) <= 2 * sizeof(CellKey),
+              "a spilled edge list stores its pointer in two words");
+
+DependencyGraph::EdgeList::EdgeList(EdgeList&& other) noexcept {
+  *this = std::move(other);
+}
+
+DependencyGraph::EdgeList& DependencyGraph::EdgeList::operator=(
+    EdgeList&& other) noexcept {
+  if (this != &other) {
+    Release();
+    size_ = std::exchange(other.size_, 0);
+    std::copy(other.words_, other.words_ + INLINE_CAPACITY, words_);
+  }
+  return *this;
+}
+
+DependencyGraph::EdgeList::~EdgeList() { Release(); }
+
+DependencyGraph::Edges DependencyGraph::EdgeList::Get() const {
+  const CellKey* data = IsSpilled() ? GetHeap() : words_;
+  return {data, data + size_};
+}
+
+void DependencyGraph::EdgeList::Insert(CellKey key) {
+  const Edges edges = Get();
+  const CellKey* position = std::lower_bound(edges.begin(), edges.end(), key);
+  if (position != edges.end() && *position == key) {
+    return;
+  }
+
+  const size_t index = position - edges.begin();
+
+  if (size_ == INLINE_CAPACITY) {
+    Reserve(INLINE_CAPACITY * 4);
+  } else if (IsSpilled() && size_ == words_[2]) {
+    Reserve(size_ * 2);
+  } else if (IsCompacted()) {
+    Reserve(size_ * 2);
+  }
+
+  CellKey* data = size_ + 1 > INLINE_CAPACITY ? GetHeap() : words_;
+  std::copy_backward(data + index, data + size_, data + size_ + 1);
+  data[index] = key;
+  ++size_;
+}
+
+void DependencyGraph::EdgeList::Erase(CellKey key) {
+  const Edges edges = Get();
+  const CellKey* position = std::lower_bound(edges.begin(), edges.end(), key);
+  if (position == edges.end() || *position != key) {
+    return;
+  }
+
+  const size_t index = position - edges.begin();
+
+  if (!IsSpilled()) {
+    std::copy(words_ + index + 1, words_ + size_, words_ + index);
+    --size_;
+    return;
+  }
+
+  if (IsCompacted()) {
+    Reserve(size_);
+  }
+
+  CellKey* data = GetHeap();
+  std::copy(data + index + 1, data + size_, data + index);
+  --size_;
+
+  if (size_ == INLINE_CAPACITY) {
+    const uint32_t capacity = words_[2];
+    std::copy(data, data + INLINE_CAPACITY, words_);
+    TrackingAllocator<CellKey>().deallocate(data, capacity);
+  }
+}
+
+void DependencyGraph::EdgeList::Clear() {
+  Release();
+  size_ = 0;
+}
+
+void DependencyGraph::EdgeList::MoveTo(CellKey* slice) {
+  const Edges edges = Get();
+  std::copy(edges.begin(), edges.end(), slice);
+  Release();
+  SetHeap(slice, 0);
+}
+
+CellKey* DependencyGraph::EdgeList::GetHeap() const {
+  CellKey* data;
+  std::memcpy(&data, words_, sizeof(data));
+  return data;
+}
+
+void DependencyGraph::EdgeList::SetHeap(CellKey* data, uint32_t capacity) {
+  std::memcpy(words_, &data, sizeof(data));
+  words_[2] = capacity;
+}
+
+void DependencyGraph::EdgeList::Reserve(uint32_t capacity) {
+  CellKey* data = TrackingAllocator<CellKey>().allocate(capacity);
+  const Edges edges = Get();
+  std::copy(edges.begin(), edges.end(), data);
+
+  Release();
+  SetHeap(data, capacity);
+}
+
+void DependencyGraph::EdgeList::Release() {
+  if (IsSpilled() && words_[2] != 0) {
+    TrackingAllocator<CellKey>().deallocate(GetHeap(), words_[2]);
+  }
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "memory.h"
+
+// Cells are identified in the graph by their position packed into 32 bits.
+using CellKey = uint32_t;
+
+inline CellKey ToCellKey(Position position) {
+  return CellKey(position.row) * Position::MAX_COLS + CellKey(position.col);
+}
+
+inline Position FromCellKey(CellKey key) {
+  return {int(key / Position::MAX_COLS), int(key % Position::MAX_COLS)};
+}
+
+struct DependencyStats {
+  size_t nodes = 0;
+  size_t edges = 0;
+  size_t spilled_lists = 0;  // lists that outgrew the inline buffer
+  size_t compacted_edges = 0;
+  size_t compactions = 0;
+  size_t ranges = 0;  // range references, one entry each
+  size_t ordered = 0;    // cells in the topological order
+  size_t reordered = 0;  // moves of cells in it since the start
+};
+
+// Formula references between cells of one sheet. For every cell it keeps
+// the cells it reads (precedents) and the cells that read it (dependents).
+//
+// Edge lists are sorted. Up to three edges are stored inside the node;
+// longer lists spill into their own array. Compact() packs every spilled
+// list into one shared array (CSR layout); it runs on its own once enough
+// edges have been changed since the last pass, e.g. after a bulk load.
+// A range a cell reads is kept as one entry however many cells it covers,
+// in the list of the reading cell. To find what reads a cell through a
+// range, every range is also filed under the square tiles it overlaps, on
+// the smallest of four tile sizes (64 to 32768 cells a side) that is at
+// least as large as the range both ways, so it overlaps at most 2x2 of
+// them. A lookup then scans one tile per size instead of every range.
+//
+// Cells that read others are kept in a topological order, every cell
+// ranked after the cells it reads. A new reference that goes against the
+// order moves only the cells ranked between its ends (Pearce-Kelly), and
+// finds a loop on the way if the reference would close one.
+//
+// Nodes, lists and the index are charged to the counter, if one is given.
+class DependencyGraph {
+ public:
+  class Edges {
+   public:
+    Edges(const CellKey* first, const CellKey* last)
+        : first_(first), last_(last) {}
+
+    const CellKey* begin() const { return first_; }
+    const CellKey* end() const { return last_; }
+    size_t size() const { return last_ - first_; }
+    bool empty() const { return first_ == last_; }
+
+   private:
+    const CellKey* first_;
+    const CellKey* last_;
+  };
+
+  class Ranges {
+   public:
+    Ranges(const CellRange* first, const CellRange* last)
+        : first_(first), last_(last) {}
+
+    const CellRange* begin() const { return first_; }
+    const CellRange* end() const { return last_; }
+    size_t size() const { return last_ - first_; }
+    bool empty() const { return first_ == last_; }
+
+   private:
+    const CellRange* first_;
+    const CellRange* last_;
+  };
+
+  explicit DependencyGraph(MemoryCounter* counter = nullptr);
+  DependencyGraph(const DependencyGraph&) = delete;
+  DependencyGraph& operator=(const DependencyGraph&) = delete;
+  ~DependencyGraph();
+
+  // Replaces the precedents of the cell, single cells and ranges, and
+  // updates the reverse edges and the order. Returns false and changes
+  // nothing if the cell would then depend on itself.
+  bool SetPrecedents(CellKey cell, const std::vector<Position>& precedents,
+                     const std::vector<CellRange>& ranges = {});
+
+  // Single cells only; see GetRangePrecedents and ForEachRangeDependent.
+  Edges GetPrecedents(CellKey cell) const;
+  Edges GetDependents(CellKey cell) const;
+  Ranges GetRangePrecedents(CellKey cell) const;
+  // Calls f with every cell reading the cell through a range.
+  template <typename F>
+  void ForEachRangeDependent(CellKey cell, F f) const;
+  // Whether any cell reads the cell, directly or through a range.
+  bool HasDependents(CellKey cell) const;
+  // Position of the cell in the topological order, if it reads others.
+  // Sorting by rank puts every cell after the cells it reads.
+  std::optional<uint32_t> GetRank(CellKey cell) const;
+
+  // Calls f with every cell in the range that reads other cells, possibly
+  // more than once. Costs the smaller of the range and the graph.
+  template <typename F>
+  void ForEachReaderIn(CellRange range, F f) const;
+
+  void Compact();
+  DependencyStats GetStats() const;
+
+ private:
+  // Sorted list of keys packed into 16 bytes. Short lists live in the words
+  // themselves; a spilled list keeps its array pointer and capacity there
+  // instead. A capacity of zero marks a slice of the shared compacted array.
+  // Spilled arrays are charged to the current MemoryScope, which the graph
+  // sets to its own counter around every change.
+  class EdgeList {
+   public:
+    EdgeList() = default;
+    EdgeList(EdgeList&& other) noexcept;
+    EdgeList& operator=(EdgeList&& other) noexcept;
+    ~EdgeList();
+
+    Edges Get() const;
+    size_t Size() const { return size_; }
+    size_t GetCapacity() const { return IsSpilled() ? words_[2] : 0; }
+    bool IsSpilled() const { return size_ > INLINE_CAPACITY; }
+    bool IsCompacted() const { return IsSpilled() && words_[2] == 0; }
+
+    void Insert(CellKey key);
+    void Erase(CellKey key);
+    void Clear();
+
+    // Copies a spilled list into its slice of the shared array.
+    void MoveTo(CellKey* slice);
+
+   private:
+    static constexpr uint32_t INLINE_CAPACITY = 3;
+
+    CellKey* GetHeap() const;
+    void SetHeap(CellKey* data, uint32_t capacity);
+    void Reserve(uint32_t capacity);
+    void Release();
+
+    uint32_t size_ = 0;
+    CellKey words_[INLINE_CAPACITY] = {};
+  };
+
+  // Open-addressing map from cell key to node id with linear probing, so
+  // looking up a node costs one probe into a flat array instead of a hash
+  // node allocation per cell.
+  class NodeIndex {
+   public:
+    explicit NodeIndex(MemoryCounter* counter)
+        : slots_(TrackingAllocator<Slot>(counter)) {}
+
+    const uint32_t* Find(CellKey key) const;
+    uint32_t* Find(CellKey key);
+
+    // Returns the id slot of the key and whether it was just added. The
+    // pointer is valid until the next insertion.
+    std::pair<uint32_t*, bool> Insert(CellKey key);
+    void Erase(CellKey key);
+
+    size_t Size() const { return size_; }
+
+    template <typename F>
+    void ForEach(F f) const {
+      for (const Slot& slot : slots_) {
+        if (slot.key != EMPTY) {
+          f(slot.key, slot.id);
+        }
+      }
+    }
+
+   private:
+    static constexpr CellKey EMPTY = UINT32_MAX;
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    struct Slot {
+      CellKey key = EMPTY;
+      uint32_t id = 0;
+    };
+
+    size_t GetHome(CellKey key) const;
+    // Index of the key, or of the empty slot ending its probe sequence.
+    size_t Probe(CellKey key) const;
+    void Grow();
+
+    std::vector<Slot, TrackingAllocator<Slot>> slots_;
+    size_t size_ = 0;
+    int shift_ = 64;
+  };
+
+  struct Node {
+    EdgeList precedents;
+    EdgeList dependents;
+  };
+
+  struct RangeEntry {
+    CellRange range;
+    CellKey reader;
+  };
+
+  // A rank in the order. Cells marked while the order is searched have the
+  // top bit set.
+  static constexpr uint32_t VISITED = 1u << 31;
+  static constexpr uint32_t FIRST_RANK = VISITED / 2;
+
+  // Ranks the cell before the cells that read it and after the ones it
+  // is going to read, or returns false if they read it already.
+  bool Order(CellKey cell, const std::vector<Position>& precedents,
+             const std::vector<CellRange>& ranges);
+  // Marks the cells ranked at most bound that the cell leads to, and
+  // returns false if any of them is in backward_.
+  bool SearchForward(CellKey cell, uint32_t bound);
+  // Marks the cells ranked above bound that lead to the pending ones.
+  void SearchBackward(uint32_t bound);
+  // Clears the marks and gives the visited cells their ranks back in
+  // order, the backward ones first.
+  void Reorder();
+  void ClearMarks();
+  // Spaces the ranks out again once new cells have used up one end.
+  void Renumber();
+
+  // Files the ranges of the reader under their tiles, or takes them out.
+  void AddRanges(CellKey reader, const std::vector<CellRange>& ranges);
+  void RemoveRanges(CellKey reader);
+  // Tiles of the given size (1 << shift cells a side) are keyed by size
+  // and place; a tile holds the ranges filed under it.
+  static uint32_t GetTileKey(int shift, int tile_row, int tile_col) {
+    return uint32_t(shift) << 28 | uint32_t(tile_row) << 14 |
+           uint32_t(tile_col);
+  }
+  static int GetTileShift(CellRange range);
+  const std::vector<RangeEntry, TrackingAllocator<RangeEntry>>* FindTile(
+      int shift, Position position) const;
+
+  const Node* FindNode(CellKey cell) const;
+  Node& GetOrCreateNode(CellKey cell);
+  void ReleaseNodeIfUnused(CellKey cell);
+  void CountMutations(size_t count);
+
+  static constexpr size_t COMPACTION_THRESHOLD = 4096;
+
+  template <typename T>
+  using Vector = std::vector<T, TrackingAllocator<T>>;
+
+  MemoryCounter* counter_;
+  NodeIndex index_;
+  Vector<Node> nodes_;
+  Vector<uint32_t> free_nodes_;
+  Vector<CellKey> compacted_;
+  // Ranges of every cell that reads some, by the id found in the index.
+  NodeIndex range_index_;
+  Vector<Vector<CellRange>> range_lists_;
+  Vector<uint32_t> free_range_lists_;
+  std::unordered_map<
+      uint32_t, Vector<RangeEntry>, std::hash<uint32_t>,
+      std::equal_to<uint32_t>,
+      TrackingAllocator<std::pair<const uint32_t, Vector<RangeEntry>>>>
+      range_tiles_;
+  size_t range_count_ = 0;
+  // Rank of every cell that reads others. New cells take the next rank
+  // below or above all others.
+  NodeIndex ranks_;
+  uint32_t lowest_rank_ = FIRST_RANK;
+  uint32_t highest_rank_ = FIRST_RANK;
+  // Scratch lists of the order search, kept to save allocations.
+  Vector<CellKey> pending_;
+  Vector<CellKey> forward_;
+  Vector<CellKey> backward_;
+  Vector<uint32_t> free_ranks_;
+
+  static constexpr int FIRST_TILE_SHIFT = 6;
+  static constexpr int TILE_SHIFT_STEP = 3;
+  static constexpr int LAST_TILE_SHIFT = 15;
+
+  size_t edges_ = 0;
+  size_t mutations_ = 0;
+  size_t compactions_ = 0;
+  size_t reordered_ = 0;
+};
+
+template <typename F>
+void DependencyGraph::ForEachRangeDependent(CellKey cell, F f) const {
+  if (range_tiles_.empty()) {
+    return;
+  }
+
+  // A range is filed under one size only, and the cell lies in one tile of
+  // each size, so every range holding the cell is found once.
+  const Position position = FromCellKey(cell);
+  for (int shift = FIRST_TILE_SHIFT; shift <= LAST_TILE_SHIFT;
+       shift += TILE_SHIFT_STEP) {
+    if (const auto* tile = FindTile(shift, position)) {
+      for (const RangeEntry& entry : *tile) {
+        if (entry.range.Contains(position)) {
+          f(entry.reader);
+        }
+      }
+    }
+  }
+}
+
+template <typename F>
+void DependencyGraph::ForEachReaderIn(CellRange range, F f) const {
+  if (range.GetSize() <= index_.Size() + range_index_.Size()) {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+      for (int col = range.first.col; col <= range.last.col; ++col) {
+        const CellKey cell = ToCellKey({row, col});
+        if (!GetPrecedents(cell).empty() ||
+            !GetRangePrecedents(cell).empty()) {
+          f(cell);
+        }
+      }
+    }
+    return;
+  }
+
+  index_.ForEach([this, range, &f](CellKey cell, uint32_t id) {
+    if (nodes_[id].precedents.Size() > 0 &&
+        range.Contains(FromCellKey(cell))) {
+      f(cell);
+    }
+  });
+  range_index_.ForEach([range, &f](CellKey cell, uint32_t /* id */) {
+    if (range.Contains(FromCellKey(cell))) {
+      f(cell);
+    }
+  });
+}
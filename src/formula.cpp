@@ -3,7 +3,6 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
-#include <regex>
 #include <sstream>
 
 #include "FormulaAST.h"
@@ -15,18 +14,100 @@ std::ostream& operator<<(std::ostream& output, FormulaError formula_error) {
   return output << formula_error.ToString();
 }
 
+struct FormulaTemplates::Template {
+  Template(std::shared_ptr<const FormulaAST> ast, std::string_view key,
+           Position anchor, FormulaTemplates* owner)
+      : ast(std::move(ast)),
+        key(key.begin(), key.end()),
+        anchor(anchor),
+        owner(owner) {}
+
+  std::shared_ptr<const FormulaAST> ast;
+  std::basic_string<char, std::char_traits<char>, TrackingAllocator<char>>
+      key;
+  Position anchor;           // the cell whose formula the tree reads as is
+  FormulaTemplates* owner;   // nullptr for formulas parsed on their own
+  uint32_t references = 0;
+};
+
 namespace {
-class Formula : public FormulaInterface {
- public:
-  explicit Formula(std::string expression) try
-      : formula_ast_(ParseFormulaAST(expression)) {
+using Template = FormulaTemplates::Template;
+
+// Templates of a pool are charged to its counter, others to the current
+// MemoryScope. Trees come from the global cache.
+Template* NewTemplate(TrackingAllocator<Template> allocator,
+                      std::string_view expression, std::string_view key,
+                      Position anchor, FormulaTemplates* owner);
+
+void DeleteTemplate(TrackingAllocator<Template> allocator, Template* shared) {
+  shared->~Template();
+  allocator.deallocate(shared, 1);
+}
+
+FormulaAST ParseAST(std::string_view expression) {
+  try {
+    return ParseFormulaAST(expression);
   } catch (...) {
     throw FormulaException("Failed to parse formula"s);
   }
+}
+
+// Frees a cached tree, which keeps the counter it was parsed with alive.
+class TreeDeleter {
+ public:
+  explicit TreeDeleter(std::shared_ptr<MemoryCounter> counter)
+      : counter_(std::move(counter)) {}
+
+  void operator()(const FormulaAST* ast) const {
+    ast->~FormulaAST();
+    TrackingAllocator<FormulaAST>(counter_.get())
+        .deallocate(const_cast<FormulaAST*>(ast), 1);
+  }
+
+ private:
+  std::shared_ptr<MemoryCounter> counter_;
+};
+
+std::shared_ptr<const FormulaAST> NewTree(
+    std::string_view expression,
+    const std::shared_ptr<MemoryCounter>& counter) {
+  MemoryScope scope(counter.get());
+  TrackingAllocator<FormulaAST> allocator(counter.get());
+  FormulaAST* ast = allocator.allocate(1);
+  try {
+    new (ast) FormulaAST(ParseAST(expression));
+  } catch (...) {
+    allocator.deallocate(ast, 1);
+    throw;
+  }
+  return std::shared_ptr<const FormulaAST>(ast, TreeDeleter(counter),
+                                           allocator);
+}
+
+// A formula is its template moved to its own cell.
+class Formula : public FormulaInterface, public ScopeTracked {
+ public:
+  Formula(FormulaTemplates::Template* shared, Position shift)
+      : template_(shared), shift_(shift) {
+    ++template_->references;
+  }
+  Formula(const Formula&) = delete;
+  Formula& operator=(const Formula&) = delete;
+
+  ~Formula() {
+    if (template_->owner) {
+      template_->owner->Release(template_);
+    } else if (--template_->references == 0) {
+      DeleteTemplate({}, template_);
+    }
+  }
+
+  using FormulaInterface::Evaluate;
 
-  Value Evaluate(const SheetInterface& sheet) const {
+  // This and GetReferencedCells log nothing: snapshots call them on their
+  // reader thread, and the log is not safe to write from two threads.
+  Value Evaluate(const SheetInterface& sheet) const override {
     try {
-      LOG(DEBUG) << "Evaluating formula: " << GetExpression();
       std::function<double(Position)> func =
           [&sheet](const Position position) -> double {
         if (!position.IsValid()) {
@@ -38,29 +119,23 @@ class Formula : public FormulaInterface {
           return 0.0;
         }
 
-        const auto& value = cell->GetValue();
+        const auto value = cell->GetNumericValue();
         if (std::holds_alternative<double>(value)) {
-          LOG(DEBUG) << "Cell " << position.ToString() << " is double";
           return std::get<double>(value);
         }
 
-        if (std::holds_alternative<std::string>(value)) {
-          LOG(DEBUG) << "Cell " << position.ToString() << " is string";
-          const auto& string_value = std::get<std::string>(value);
-          std::regex regex_double(R"(^\s*([-+]?\d+(?:\.\d+)?)\s*$)");
-          std::smatch match;
-          if (std::regex_match(string_value, match, regex_double)) {
-            LOG(DEBUG) << "Cell " << position.ToString() << " is double";
-            return std::stod(match[1]);
-          }
-
-          throw FormulaError(FormulaError::Category::Value);
-        }
-
-        throw FormulaError(std::get<FormulaError>(value));
+        throw std::get<FormulaError>(value);
       };
 
-      return formula_ast_.Execute(func);
+      return template_->ast->Execute(func, shift_);
+    } catch (const FormulaError& formula_error) {
+      return formula_error;
+    }
+  }
+
+  Value Evaluate(const SheetReader& reader) const override {
+    try {
+      return template_->ast->Execute(reader, shift_);
     } catch (const FormulaError& formula_error) {
       return formula_error;
     }
@@ -68,32 +143,254 @@ class Formula : public FormulaInterface {
 
   std::string GetExpression() const override {
     std::ostringstream out;
-    formula_ast_.PrintFormula(out);
+    template_->ast->PrintFormula(out, shift_);
     return out.str();
   }
 
   std::vector<Position> GetReferencedCells() const override {
-    LOG(DEBUG) << "Get referenced cells";
-    std::vector<Position> cell_positions;
-    for (const auto& cell : formula_ast_.GetCells()) {
-      if (cell.IsValid()) {
-        cell_positions.push_back(cell);
+    FormulaReferences references = GetReferences();
+    std::vector<Position>& cell_positions = references.cells;
+    for (const CellRange& range : references.ranges) {
+      for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+          cell_positions.push_back({row, col});
+        }
       }
     }
-    std::sort(cell_positions.begin(), cell_positions.end());
-    cell_positions.erase(
-        std::unique(cell_positions.begin(), cell_positions.end()),
-        cell_positions.end());
-    LOG(DEBUG) << "Referenced cells: " << cell_positions.size();
+    if (!references.ranges.empty()) {
+      std::sort(cell_positions.begin(), cell_positions.end());
+      cell_positions.erase(
+          std::unique(cell_positions.begin(), cell_positions.end()),
+          cell_positions.end());
+    }
     return cell_positions;
   }
 
+  FormulaReferences GetReferences() const override {
+    FormulaReferences references;
+    for (const auto& cell : template_->ast->GetCells()) {
+      const Position position{cell.row + shift_.row, cell.col + shift_.col};
+      if (position.IsValid()) {
+        references.cells.push_back(position);
+      }
+    }
+    // Sorted already, as the shift keeps the order.
+    references.cells.erase(
+        std::unique(references.cells.begin(), references.cells.end()),
+        references.cells.end());
+
+    for (const CellRange& range : template_->ast->GetRanges()) {
+      const CellRange shifted{
+          {range.first.row + shift_.row, range.first.col + shift_.col},
+          {range.last.row + shift_.row, range.last.col + shift_.col}};
+      if (shifted.first.IsValid() && shifted.last.IsValid()) {
+        references.ranges.push_back(shifted);
+      }
+    }
+    return references;
+  }
+
  private:
-  FormulaAST formula_ast_;
+  FormulaTemplates::Template* template_;
+  Position shift_;
 };
 
+Template* NewTemplate(TrackingAllocator<Template> allocator,
+                      std::string_view expression, std::string_view key,
+                      Position anchor, FormulaTemplates* owner) {
+  std::shared_ptr<const FormulaAST> ast =
+      FormulaCache::GetGlobal().Parse(expression);
+  Template* shared = allocator.allocate(1);
+  try {
+    return new (shared) Template(std::move(ast), key, anchor, owner);
+  } catch (...) {
+    allocator.deallocate(shared, 1);
+    throw;
+  }
+}
 }  // end namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-  return std::make_unique<Formula>(std::move(expression));
+  return std::make_unique<Formula>(
+      NewTemplate({}, expression, {}, {0, 0}, nullptr), Position{0, 0});
+}
+
+FormulaCache::FormulaCache(size_t capacity)
+    : counter_(std::make_shared<MemoryCounter>()),
+      entries_(Entries::allocator_type(counter_.get())),
+      index_(Index::allocator_type(counter_.get())),
+      capacity_(capacity) {}
+
+FormulaCache::~FormulaCache() = default;
+
+FormulaCache& FormulaCache::GetGlobal() {
+  static FormulaCache* cache = new FormulaCache();
+  return *cache;
+}
+
+std::shared_ptr<const FormulaAST> FormulaCache::Parse(
+    std::string_view expression) {
+  thread_local std::string key;
+  key.clear();
+  try {
+    AppendRelativeKey(expression, Position{0, 0}, key);
+  } catch (...) {
+    throw FormulaException("Failed to parse formula"s);
+  }
+
+  {
+    std::lock_guard lock(mutex_);
+    if (capacity_ == 0) {
+      // Disabled; parse without keeping the tree.
+    } else if (auto it = index_.find(key); it != index_.end()) {
+      ++hits_;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return it->second->ast;
+    } else {
+      ++misses_;
+    }
+  }
+
+  std::shared_ptr<const FormulaAST> ast = NewTree(expression, counter_);
+
+  std::lock_guard lock(mutex_);
+  if (capacity_ == 0) {
+    return ast;
+  }
+  if (auto it = index_.find(key); it != index_.end()) {
+    // Another thread parsed the same text meanwhile.
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->ast;
+  }
+  entries_.push_front(
+      Entry{Entry::Key(key.begin(), key.end(),
+                       TrackingAllocator<char>(counter_.get())),
+            ast});
+  try {
+    index_.emplace(std::string_view(entries_.front().key.data(),
+                                    entries_.front().key.size()),
+                   entries_.begin());
+  } catch (...) {
+    entries_.pop_front();
+    throw;
+  }
+  EvictTo(capacity_);
+  return ast;
+}
+
+void FormulaCache::SetCapacity(size_t capacity) {
+  std::lock_guard lock(mutex_);
+  capacity_ = capacity;
+  EvictTo(capacity_);
+}
+
+void FormulaCache::Clear() {
+  std::lock_guard lock(mutex_);
+  Index(index_.get_allocator()).swap(index_);  // frees the buckets too
+  entries_.clear();
+}
+
+FormulaCacheStats FormulaCache::GetStats() const {
+  std::lock_guard lock(mutex_);
+  FormulaCacheStats stats;
+  stats.entries = entries_.size();
+  stats.capacity = capacity_;
+  stats.bytes = counter_->Get();
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  return stats;
+}
+
+void FormulaCache::EvictTo(size_t capacity) {
+  while (entries_.size() > capacity) {
+    const Entry& oldest = entries_.back();
+    index_.erase(std::string_view(oldest.key.data(), oldest.key.size()));
+    entries_.pop_back();
+    ++evictions_;
+  }
+}
+
+FormulaTemplates::FormulaTemplates(MemoryCounter* counter,
+                                   MemoryCounter* trees)
+    : index_(Index::allocator_type(counter)),
+      tree_uses_(TreeUses::allocator_type(counter)),
+      trees_(trees) {}
+
+FormulaTemplates::~FormulaTemplates() {
+  assert(index_.empty());
+  assert(tree_uses_.empty());
+}
+
+std::unique_ptr<FormulaInterface> FormulaTemplates::Parse(
+    std::string_view expression, Position position) {
+  thread_local std::string key;
+  key.clear();
+  try {
+    AppendRelativeKey(expression, position, key);
+  } catch (...) {
+    throw FormulaException("Failed to parse formula"s);
+  }
+
+  Template* shared;
+  if (auto it = index_.find(key); it != index_.end()) {
+    ++hits_;
+    shared = it->second;
+  } else {
+    ++misses_;
+    shared = NewTemplate(index_.get_allocator(), expression, key, position,
+                         this);
+    try {
+      index_.emplace(std::string_view(shared->key.data(), shared->key.size()),
+                     shared);
+      UseTree(*shared->ast);
+    } catch (...) {
+      index_.erase(std::string_view(shared->key.data(), shared->key.size()));
+      DeleteTemplate(index_.get_allocator(), shared);
+      throw;
+    }
+  }
+
+  ++references_;
+  return std::make_unique<Formula>(
+      shared, Position{position.row - shared->anchor.row,
+                       position.col - shared->anchor.col});
+}
+
+void FormulaTemplates::Release(Template* shared) {
+  --references_;
+  if (--shared->references == 0) {
+    index_.erase(std::string_view(shared->key.data(), shared->key.size()));
+    UnuseTree(*shared->ast);
+    DeleteTemplate(index_.get_allocator(), shared);
+    if (index_.empty()) {
+      Index(index_.get_allocator()).swap(index_);  // frees the buckets too
+      TreeUses(tree_uses_.get_allocator()).swap(tree_uses_);
+    }
+  }
+}
+
+void FormulaTemplates::UseTree(const FormulaAST& ast) {
+  if (++tree_uses_[&ast] == 1 && trees_) {
+    trees_->Add(ast.GetBytes());
+  }
+}
+
+void FormulaTemplates::UnuseTree(const FormulaAST& ast) {
+  const auto it = tree_uses_.find(&ast);
+  if (--it->second == 0) {
+    tree_uses_.erase(it);
+    if (trees_) {
+      trees_->Subtract(ast.GetBytes());
+    }
+  }
+}
+
+FormulaTemplateStats FormulaTemplates::GetStats() const {
+  FormulaTemplateStats stats;
+  stats.templates = index_.size();
+  stats.formulas = references_;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  return stats;
 }
\ No newline at end of file
@@ -1,10 +1,24 @@
 #pragma once
 
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "FormulaAST.h"
 #include "common.h"
+#include "memory.h"
+
+class Sheet;
+
+// The cells a formula reads, with every range kept as one entry.
+struct FormulaReferences {
+  std::vector<Position> cells;  // sorted, without repeats
+  std::vector<CellRange> ranges;
+};
 
 class FormulaInterface {
  public:
@@ -12,9 +26,151 @@ class FormulaInterface {
 
   virtual ~FormulaInterface() = default;
   virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+  // Same, reading the cells of a sheet directly.
+  virtual Value Evaluate(const SheetReader& reader) const = 0;
+  Value Evaluate(const Sheet& sheet) const {
+    return Evaluate(SheetReader(sheet));
+  }
 
   virtual std::string GetExpression() const = 0;
+  // Every cell read, those of ranges included, sorted and without repeats.
   virtual std::vector<Position> GetReferencedCells() const = 0;
+  // Same without expanding the ranges, so its size does not grow with them.
+  virtual FormulaReferences GetReferences() const = 0;
 };
 
+// Parses a formula through the global FormulaCache.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+struct FormulaCacheStats {
+  size_t entries = 0;   // trees kept by the cache
+  size_t capacity = 0;  // most trees it keeps, 0 when disabled
+  size_t bytes = 0;     // trees it parsed that are still alive, and its index
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+};
+
+// Parsed trees shared by every sheet, keyed by the canonical text of the
+// expression: its tokens without the spacing, so =A1+2 and = A1 + 2 share
+// a tree. Trees are immutable and owned jointly by the cache and the
+// formulas using them, so an evicted tree lives on until its last formula
+// goes away. The least recently used tree is evicted past the capacity.
+// Safe to use from several threads; parsing runs outside the lock.
+class FormulaCache {
+ public:
+  static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+  explicit FormulaCache(size_t capacity = DEFAULT_CAPACITY);
+  FormulaCache(const FormulaCache&) = delete;
+  FormulaCache& operator=(const FormulaCache&) = delete;
+  ~FormulaCache();
+
+  // The cache used by sheets and ParseFormula. It is never destroyed, so
+  // formulas in static sheets may outlive everything else.
+  static FormulaCache& GetGlobal();
+
+  // The tree of the expression, parsed on a miss. Throws FormulaException
+  // like ParseFormula.
+  std::shared_ptr<const FormulaAST> Parse(std::string_view expression);
+
+  // Evicts down to the new capacity. A capacity of 0 disables the cache:
+  // every expression is parsed and nothing is kept.
+  void SetCapacity(size_t capacity);
+  void Clear();
+
+  FormulaCacheStats GetStats() const;
+
+ private:
+  struct Entry {
+    using Key = std::basic_string<char, std::char_traits<char>,
+                                  TrackingAllocator<char>>;
+    Key key;
+    std::shared_ptr<const FormulaAST> ast;
+  };
+  using Entries = std::list<Entry, TrackingAllocator<Entry>>;
+  using Index = std::unordered_map<
+      std::string_view, Entries::iterator, std::hash<std::string_view>,
+      std::equal_to<std::string_view>,
+      TrackingAllocator<
+          std::pair<const std::string_view, Entries::iterator>>>;
+
+  // Called with the mutex held.
+  void EvictTo(size_t capacity);
+
+  // Trees are freed by whichever formula drops them last, possibly after
+  // the cache, so they share the counter.
+  std::shared_ptr<MemoryCounter> counter_;
+
+  mutable std::mutex mutex_;
+  // Most recently used first; keys of the index view the keys of entries.
+  Entries entries_;
+  Index index_;
+  size_t capacity_;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t evictions_ = 0;
+};
+
+struct FormulaTemplateStats {
+  size_t templates = 0;  // distinct parsed trees
+  size_t formulas = 0;   // formulas using them
+  size_t hits = 0;       // formulas that found their template
+  size_t misses = 0;     // formulas that had to be parsed
+};
+
+// Parsed formulas shared by cells whose expressions differ only by where
+// they are, such as =B2*C2 in D2 and =B3*C3 in D3, whose R1C1 form is
+// RC[-2]*RC[-1] in both. The first such cell parses the tree; later ones
+// keep a reference to it and their offset from that first cell, so a
+// filled-down column costs one tree. A template goes away with the last
+// formula using it. A template that is not in the index yet takes its tree
+// from the global FormulaCache, so equal texts share a tree across sheets.
+// Templates and the index are charged to the counter, if one is given,
+// keys to the MemoryScope they are parsed in, trees to the cache. Every
+// tree in use is also counted once, whole, on the trees counter, if one is
+// given, so a sheet sees the trees it keeps alive.
+class FormulaTemplates {
+ public:
+  struct Template;
+
+  explicit FormulaTemplates(MemoryCounter* counter = nullptr,
+                            MemoryCounter* trees = nullptr);
+  FormulaTemplates(const FormulaTemplates&) = delete;
+  FormulaTemplates& operator=(const FormulaTemplates&) = delete;
+  // Every formula must be gone before the templates.
+  ~FormulaTemplates();
+
+  // The formula of the cell at the position. Throws FormulaException like
+  // ParseFormula.
+  std::unique_ptr<FormulaInterface> Parse(std::string_view expression,
+                                          Position position);
+  // Called by formulas as they go away.
+  void Release(Template* shared);
+
+  FormulaTemplateStats GetStats() const;
+
+ private:
+  using Index = std::unordered_map<
+      std::string_view, Template*, std::hash<std::string_view>,
+      std::equal_to<std::string_view>,
+      TrackingAllocator<std::pair<const std::string_view, Template*>>>;
+
+  using TreeUses = std::unordered_map<
+      const FormulaAST*, uint32_t, std::hash<const FormulaAST*>,
+      std::equal_to<const FormulaAST*>,
+      TrackingAllocator<std::pair<const FormulaAST* const, uint32_t>>>;
+
+  // Adds or drops a template of the tree.
+  void UseTree(const FormulaAST& ast);
+  void UnuseTree(const FormulaAST& ast);
+
+  // Keys view the key of their own template.
+  Index index_;
+  // Templates using each tree; templates anchored apart may share one.
+  TreeUses tree_uses_;
+  MemoryCounter* trees_;
+  size_t references_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
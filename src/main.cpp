@@ -1,9 +1,24 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
 
+#include "aggregate.h"
 #include "common.h"
 #include "formula.h"
 #include "log/easylogging++.h"
+#include "numeric_text.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
 
 INITIALIZE_EASYLOGGINGPP
 
@@ -133,6 +148,27 @@ void TestClearCell() {
   sheet->ClearCell("J10"_pos);
 }
 
+void TestChangedCellUnlinksPrecedents() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("B1"_pos, "1");
+  sheet->SetCell("A1"_pos, "=B1");
+  sheet->SetCell("A1"_pos, "Text");
+
+  // A1 no longer reads B1, so nothing keeps B1 once it is cleared.
+  sheet->ClearCell("B1"_pos);
+  ASSERT(sheet->GetCellInterface("B1"_pos) == nullptr);
+  ASSERT_EQUAL(sheet->GetCellInterface("A1"_pos)->GetText(), "Text");
+}
+
+void TestSetCellEmptyText() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "");
+  CellInterface* cell = sheet->GetCellInterface("A1"_pos);
+  ASSERT(cell != nullptr);
+  ASSERT_EQUAL(cell->GetText(), "");
+  ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(""));
+}
+
 void TestFormulaArithmetic() {
   auto sheet = CreateSheet();
   auto evaluate = [&](std::string expr) {
@@ -353,6 +389,1331 @@ void TestCellCircularReferences() {
   ASSERT(caught);
   ASSERT_EQUAL(sheet->GetCellInterface("M6"_pos)->GetText(), "Ready");
 }
+
+void TestFarAwayCells() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("XFD1"_pos, "wide");
+  sheet->SetCell("A16384"_pos, "tall");
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{16384, 16384}));
+  ASSERT_EQUAL(sheet->GetCellInterface("XFD1"_pos)->GetText(), "wide");
+  ASSERT(sheet->GetCellInterface("XFC1"_pos) == nullptr);
+
+  sheet->ClearCell("XFD1"_pos);
+  sheet->ClearCell("A16384"_pos);
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestFilledTile() {
+  auto sheet = CreateSheet();
+  for (int row = 0; row < 100; ++row) {
+    for (int col = 0; col < 100; ++col) {
+      sheet->SetCell(Position{row, col}, std::to_string(row * 100 + col));
+    }
+  }
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{100, 100}));
+  ASSERT_EQUAL(sheet->GetCellInterface("CV100"_pos)->GetText(), "9999");
+
+  for (int row = 0; row < 100; ++row) {
+    for (int col = 1; col < 100; ++col) {
+      sheet->ClearCell(Position{row, col});
+    }
+  }
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{100, 1}));
+  ASSERT_EQUAL(sheet->GetCellInterface("A64"_pos)->GetText(), "6300");
+  ASSERT(sheet->GetCellInterface("B64"_pos) == nullptr);
+}
+
+void TestArenaRecyclesCells() {
+  Sheet sheet;
+  auto fill = [&sheet] {
+    for (int row = 0; row < 50; ++row) {
+      for (int col = 0; col < 50; ++col) {
+        sheet.SetCell(Position{row, col}, "=" + std::to_string(row));
+      }
+    }
+  };
+
+  fill();
+  const ArenaStats filled = sheet.GetArenaStats();
+
+  for (int row = 0; row < 50; ++row) {
+    for (int col = 0; col < 50; ++col) {
+      sheet.ClearCell(Position{row, col});
+    }
+  }
+  ASSERT_EQUAL(sheet.GetArenaStats().live, 0u);
+
+  fill();
+  const ArenaStats refilled = sheet.GetArenaStats();
+  ASSERT_EQUAL(refilled.live, filled.live);
+  ASSERT_EQUAL(refilled.chunk_allocations, filled.chunk_allocations);
+  ASSERT(refilled.recycled >= filled.live);
+}
+
+void TestFormulaChangeInvalidatesDependents() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "=1");
+  sheet->SetCell("B1"_pos, "=A1*10");
+  ASSERT_EQUAL(sheet->GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(10.0));
+
+  sheet->SetCell("A1"_pos, "=2");
+  ASSERT_EQUAL(sheet->GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(20.0));
+
+  sheet->SetCell("A1"_pos, "3");
+  ASSERT_EQUAL(sheet->GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(30.0));
+
+  sheet->ClearCell("A1"_pos);
+  ASSERT_EQUAL(sheet->GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(0.0));
+}
+
+void TestSharedPrecedentFanOut() {
+  constexpr int DEPENDENTS = 5000;
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "2");
+  for (int row = 1; row <= DEPENDENTS; ++row) {
+    sheet.SetCell(Position{row, 1}, "=A1*" + std::to_string(row));
+  }
+
+  const DependencyGraph& graph = sheet.GetGraph();
+  DependencyStats stats = graph.GetStats();
+  ASSERT_EQUAL(stats.nodes, size_t(DEPENDENTS + 1));
+  ASSERT_EQUAL(stats.edges, size_t(DEPENDENTS));
+  ASSERT(stats.compactions >= 1);
+
+  const DependencyGraph::Edges dependents =
+      graph.GetDependents(ToCellKey("A1"_pos));
+  ASSERT_EQUAL(dependents.size(), size_t(DEPENDENTS));
+  ASSERT(std::is_sorted(dependents.begin(), dependents.end()));
+
+  ASSERT_EQUAL(sheet.GetCellInterface(Position{DEPENDENTS, 1})->GetValue(),
+               CellInterface::Value(2.0 * DEPENDENTS));
+  sheet.SetCell("A1"_pos, "3");
+  ASSERT_EQUAL(sheet.GetCellInterface(Position{DEPENDENTS, 1})->GetValue(),
+               CellInterface::Value(3.0 * DEPENDENTS));
+
+  for (int row = 2; row <= DEPENDENTS; row += 2) {
+    sheet.SetCell(Position{row, 1}, "=1");
+  }
+  sheet.GetGraph().Compact();
+  stats = graph.GetStats();
+  ASSERT_EQUAL(stats.edges, size_t(DEPENDENTS / 2));
+  ASSERT_EQUAL(stats.spilled_lists, 0u);
+  ASSERT_EQUAL(graph.GetDependents(ToCellKey("A1"_pos)).size(),
+               size_t(DEPENDENTS / 2));
+
+  sheet.SetCell("A1"_pos, "4");
+  ASSERT_EQUAL(sheet.GetCellInterface(Position{1, 1})->GetValue(),
+               CellInterface::Value(4.0));
+  ASSERT_EQUAL(sheet.GetCellInterface(Position{2, 1})->GetValue(),
+               CellInterface::Value(1.0));
+}
+
+void TestReferenceToUnsetCell() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "=ZZ10000+1");
+  ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+  ASSERT_EQUAL(sheet.GetArenaStats().live, 2u);  // cell and formula slot
+
+  const Sheet& const_sheet = sheet;
+  ASSERT(const_sheet.GetCellInterface("ZZ10000"_pos) == nullptr);
+  ASSERT_EQUAL(sheet.GetCellInterface("ZZ10000"_pos)->GetText(), "");
+  ASSERT_EQUAL(sheet.GetCellInterface("A1"_pos)->GetValue(),
+               CellInterface::Value(1.0));
+
+  sheet.SetCell("ZZ10000"_pos, "=A2*2");
+  sheet.SetCell("A2"_pos, "5");
+  ASSERT_EQUAL(sheet.GetCellInterface("A1"_pos)->GetValue(),
+               CellInterface::Value(11.0));
+
+  bool caught = false;
+  try {
+    sheet.SetCell("A2"_pos, "=A1");
+  } catch (const CircularDependencyException&) {
+    caught = true;
+  }
+  ASSERT(caught);
+
+  sheet.ClearCell("ZZ10000"_pos);
+  ASSERT_EQUAL(sheet.GetCellInterface("A1"_pos)->GetValue(),
+               CellInterface::Value(1.0));
+  ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 1}));
+
+  sheet.SetCell("A1"_pos, "=1");
+  ASSERT(sheet.GetCellInterface("ZZ10000"_pos) == nullptr);
+}
+
+void TestPrintableSizeFollowsClears() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("C5"_pos, "a");
+  sheet->SetCell("E5"_pos, "b");
+  sheet->SetCell("B9"_pos, "=C5");
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{9, 5}));
+
+  sheet->SetCell("B9"_pos, "=E5");
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{9, 5}));
+
+  sheet->ClearCell("B9"_pos);
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 5}));
+
+  sheet->ClearCell("E5"_pos);
+  sheet->ClearCell("E5"_pos);
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+  sheet->SetCell("C5"_pos, "");
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestEqualTextsShareStorage() {
+  Sheet sheet;
+  for (int row = 0; row < 100; ++row) {
+    sheet.SetCell(Position{row, 0}, "Accounts receivable");
+    sheet.SetCell(Position{row, 1}, "'=not a formula");
+  }
+
+  StringPoolStats stats = sheet.GetStringStats();
+  ASSERT_EQUAL(stats.strings, 2u);
+  ASSERT_EQUAL(stats.references, 200u);
+  ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetTextValue(), "=not a formula");
+  ASSERT_EQUAL(sheet.GetCellInterface("B7"_pos)->GetText(),
+               "'=not a formula");
+
+  for (int row = 0; row < 100; ++row) {
+    sheet.SetCell(Position{row, 0}, "=1");
+    sheet.ClearCell(Position{row, 1});
+  }
+  sheet.SetCell("C1"_pos, "USD");
+
+  stats = sheet.GetStringStats();
+  ASSERT_EQUAL(stats.strings, 1u);
+  ASSERT_EQUAL(stats.references, 1u);
+  ASSERT_EQUAL(stats.shared_bytes, 0u);
+  ASSERT_EQUAL(sheet.GetCellInterface("C1"_pos)->GetValue(),
+               CellInterface::Value(std::string("USD")));
+}
+
+void TestSnapshotKeepsOldContents() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("B1"_pos, "=A1+1");
+  sheet.SetCell("C1"_pos, "x");
+  ASSERT_EQUAL(sheet.GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(2.0));
+
+  auto snapshot = sheet.Snapshot();
+  sheet.SetCell("A1"_pos, "10");
+  sheet.SetCell("B1"_pos, "=A1*3");
+  sheet.ClearCell("C1"_pos);
+  sheet.SetCell("D5"_pos, "new");
+
+  ASSERT_EQUAL(sheet.GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(30.0));
+  ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 4}));
+
+  ASSERT_EQUAL(snapshot->GetCellInterface("B1"_pos)->GetText(), "=A1+1");
+  ASSERT_EQUAL(snapshot->GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(2.0));
+  ASSERT(snapshot->GetCellInterface("D5"_pos) == nullptr);
+  ASSERT_EQUAL(snapshot->GetPrintableSize(), (Size{1, 3}));
+
+  std::ostringstream values;
+  snapshot->PrintValues(values);
+  ASSERT_EQUAL(values.str(), "1\t2\tx\n");
+
+  // Cells written after the snapshot change in place.
+  auto later = sheet.Snapshot();
+  sheet.SetCell("A1"_pos, "20");
+  ASSERT_EQUAL(later->GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(30.0));
+  ASSERT_EQUAL(snapshot->GetCellInterface("A1"_pos)->GetText(), "1");
+  ASSERT_EQUAL(sheet.GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(60.0));
+
+  const size_t live = sheet.GetArenaStats().live;
+  snapshot.reset();
+  later.reset();
+  sheet.SetCell("A1"_pos, "30");
+  ASSERT(sheet.GetArenaStats().live < live);
+}
+
+void TestSnapshotLongChain() {
+  // Far more links than evaluation could recurse through on the stack.
+  constexpr int LENGTH = 100000;
+  auto position = [](int index) {
+    return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+  };
+  Sheet sheet;
+  // Filled from the end, so the loop check never walks the chain. Every
+  // tenth link goes through a range.
+  for (int index = LENGTH - 1; index > 0; --index) {
+    const std::string previous = position(index - 1).ToString();
+    sheet.SetCell(position(index), index % 10 == 0
+                                       ? "=SUM(" + previous + ":" + previous +
+                                             ")+1"
+                                       : "=" + previous + "+1");
+  }
+  sheet.SetCell(position(0), "1");
+
+  const auto snapshot = sheet.Snapshot();
+  sheet.SetCell(position(0), "2");
+  ASSERT_EQUAL(snapshot->GetCellInterface(position(LENGTH - 1))->GetValue(),
+               CellInterface::Value(double(LENGTH)));
+  ASSERT_EQUAL(snapshot->GetCellInterface(position(LENGTH / 2))->GetValue(),
+               CellInterface::Value(LENGTH / 2 + 1.0));
+}
+
+void TestSnapshotReadOnAnotherThread() {
+  // The writer logs every edit while the reader evaluates the snapshot.
+  Sheet sheet;
+  for (int row = 0; row < 1000; ++row) {
+    sheet.SetCell(Position{row, 0}, std::to_string(row));
+    sheet.SetCell(Position{row, 1},
+                  row == 0 ? "=A1" : "=B" + std::to_string(row) + "+A" +
+                                         std::to_string(row + 1));
+  }
+  const auto snapshot = sheet.Snapshot();
+
+  std::string values;
+  size_t referenced = 0;
+  std::thread reader([&snapshot, &values, &referenced] {
+    std::ostringstream output;
+    snapshot->PrintValues(output);
+    values = output.str();
+    for (int row = 0; row < 1000; ++row) {
+      referenced += snapshot->GetCellInterface(Position{row, 1})
+                        ->GetReferencedCells()
+                        .size();
+    }
+  });
+  for (int row = 0; row < 1000; ++row) {
+    sheet.SetCell(Position{row, 0}, std::to_string(2 * row));
+  }
+  reader.join();
+
+  ASSERT_EQUAL(referenced, 1999u);
+  ASSERT(values.find("999\t499500\n") != std::string::npos);
+  ASSERT_EQUAL(sheet.GetCellInterface("B1000"_pos)->GetValue(),
+               CellInterface::Value(999000.0));
+}
+
+void TestMemoryStatsFollowContents() {
+  Sheet sheet;
+  const MemoryStats empty = sheet.GetMemoryStats();
+  ASSERT_EQUAL(empty.formulas, 0u);
+  ASSERT_EQUAL(empty.dependencies, 0u);
+
+  const std::string label(100, 'x');
+  for (int row = 0; row < 100; ++row) {
+    sheet.SetCell(Position{row, 0}, label + std::to_string(row));
+    sheet.SetCell(Position{row, 1}, "=C1+C2+C3+C4");
+  }
+
+  const MemoryStats filled = sheet.GetMemoryStats();
+  ASSERT(filled.grid > empty.grid);
+  ASSERT(filled.cells > 0);
+  ASSERT(filled.text >= 100 * label.size());
+  ASSERT(filled.formulas > 0);
+  ASSERT(filled.dependencies > 0);
+  ASSERT(filled.values > 0);
+  ASSERT(filled.formula_trees > 0);
+  ASSERT_EQUAL(filled.GetTotal(),
+               filled.grid + filled.cells + filled.text + filled.formulas +
+                   filled.formula_trees + filled.dependencies + filled.values);
+
+  // A rejected formula is freed under the counter it was charged to.
+  try {
+    sheet.SetCell("B1"_pos, "=B1");
+  } catch (const CircularDependencyException&) {
+  }
+  ASSERT_EQUAL(sheet.GetMemoryStats().formulas, filled.formulas);
+
+  for (int row = 0; row < 100; ++row) {
+    sheet.ClearCell(Position{row, 0});
+    sheet.ClearCell(Position{row, 1});
+  }
+
+  const MemoryStats cleared = sheet.GetMemoryStats();
+  ASSERT_EQUAL(cleared.formulas, 0u);
+  ASSERT_EQUAL(cleared.formula_trees, 0u);
+  ASSERT(cleared.text + 100 * label.size() <= filled.text);
+  ASSERT(cleared.grid < filled.grid);
+}
+
+void TestValueCacheStaysWithinBudget() {
+  Sheet sheet;
+  sheet.SetValueCacheBudget(10 * ValueCache::GetEntryBytes());
+
+  // C1 = A1 + 1, C2 = C1 + 1, ...
+  sheet.SetCell("A1"_pos, "=1");
+  sheet.SetCell("C1"_pos, "=A1+1");
+  for (int row = 1; row < 100; ++row) {
+    sheet.SetCell(Position{row, 2}, "=C" + std::to_string(row) + "+1");
+  }
+
+  ASSERT_EQUAL(sheet.GetCellInterface("C100"_pos)->GetValue(),
+               CellInterface::Value(101.0));
+  ValueCacheStats stats = sheet.GetValueCacheStats();
+  ASSERT(stats.evictions > 0);
+  ASSERT(stats.entries <= 10u);
+  ASSERT(stats.bytes <= stats.budget);
+
+  // Evicted results in the middle of the chain must not stop invalidation.
+  sheet.SetCell("A1"_pos, "=2");
+  ASSERT_EQUAL(sheet.GetCellInterface("C100"_pos)->GetValue(),
+               CellInterface::Value(102.0));
+  ASSERT_EQUAL(sheet.GetCellInterface("C50"_pos)->GetValue(),
+               CellInterface::Value(52.0));
+
+  // C50 was evaluated last, so its result is still there.
+  const size_t hits = sheet.GetValueCacheStats().hits;
+  ASSERT_EQUAL(sheet.GetCellInterface("C50"_pos)->GetValue(),
+               CellInterface::Value(52.0));
+  ASSERT_EQUAL(sheet.GetValueCacheStats().hits, hits + 1);
+
+  sheet.SetValueCacheBudget(0);
+  ASSERT_EQUAL(sheet.GetValueCacheStats().entries, 0u);
+  sheet.SetCell("A1"_pos, "=3");
+  ASSERT_EQUAL(sheet.GetCellInterface("C100"_pos)->GetValue(),
+               CellInterface::Value(103.0));
+}
+
+void TestCompiledFormulaMatchesTree() {
+  const std::function<double(Position)> args = [](Position position) {
+    if (position == "C3"_pos) {
+      throw FormulaError(FormulaError::Category::Value);
+    }
+    return double(position.row * 10 + position.col);
+  };
+  auto run = [](auto execute) -> CellInterface::Value {
+    try {
+      return execute();
+    } catch (const FormulaError& error) {
+      return error;
+    }
+  };
+
+  // Right-nested sums need a deeper stack than fits locally.
+  std::string deep = "A1";
+  for (int i = 0; i < 50; ++i) {
+    deep = "B" + std::to_string(i + 1) + "-(" + deep + ")";
+  }
+
+  for (const std::string& expression : std::vector<std::string>{
+           "1+2*3", "-(A2-B1)/C2", "+A2*-2", "(1+2)*(3+4)/(5-6)", "A1/0",
+           "B2/(B1-B1)", "C3+1", "1-C3/0", "A1+B1+C1+D1*E1*F1/G1-H1",
+           "SUM(A1:B2)*2", "SUM(B3:C3,1)", "SUM()", "-SUM(1,2,A1)",
+           "SUM(B2:A1,SUM(C1),D2:D1)", "MIN(A1:C2)-MAX(B1,A2:A3)",
+           "AVERAGE(A1:B300)", "AVERAGE()", "COUNT(A1:B2,C3)", "MAX(B3:C4)",
+           "MIN()+MAX()", deep}) {
+    const FormulaAST ast = ParseFormulaAST(expression);
+    ASSERT_EQUAL(run([&] { return ast.Execute(args); }),
+                 run([&] { return ast.ExecuteTree(args); }));
+  }
+}
+
+// Both parsers accept the same inputs and build the same trees.
+void TestParserMatchesAntlr() {
+  auto describe = [](auto parse) -> std::string {
+    try {
+      const FormulaAST ast = parse();
+      std::ostringstream out;
+      out.precision(17);
+      ast.Print(out);
+      out << " | ";
+      ast.PrintCells(out);
+      return out.str();
+    } catch (...) {
+      return "error";
+    }
+  };
+  auto check = [&describe](const std::string& expression) {
+    ASSERT_EQUAL(
+        describe([&] { return ParseFormulaAST(expression); }),
+        describe([&] { return ParseFormulaASTWithAntlr(expression); }));
+  };
+
+  for (const std::string& expression : std::vector<std::string>{
+           "1", " 1 + 2 ", "1+2*3-4/5", "-1*2", "--+-A1", "(((B2)))",
+           "1-2-3", "1/2/3", "A1*(B2+C3)/-D4", ".5e3+1.25E-2", "1e+0*7E1",
+           "ZZZ1", "XFD16384", "XFE1", "AAAA1", "A0", "A99999999999", "",
+           "()", "1 2", "1+", "(1", "1)", "A", "1.", "1.e5", "1e", "1ee2",
+           "a1", "A1B2", "1A1", "1..2", "2^3", "1\t*\n2\r", "SUM(A1:B2)",
+           "SUM()", "SUM( 1 , B2:A1 , -C3 )", "SUM(A1:B2)*-SUM(A1)",
+           "SUM(SUM(A1),B1:A2)", "SUM(A1+B1,C1)", "A1:B2", "SUM(A1:)",
+           "SUM(A1:1)", "SUM(1:2)", "SUM(A1,)", "SUM(,A1)", "SUM A1",
+           "FOO(1)", "SUM((A1):B2)", "SUM(A1:B2+1)", "SUM(A0:B2)", "SUM",
+           "AVERAGE(A1:B2,1)", "COUNT()", "MIN(MAX(A1),B1:A2)", "Max(1)"}) {
+    check(expression);
+  }
+
+  // Random strings over the alphabet of the grammar, mostly invalid.
+  const std::string alphabet = "AZ019.eE+-*/() ";
+  std::mt19937 random(12345);
+  for (int i = 0; i < 20000; ++i) {
+    std::string expression(random() % 12 + 1, ' ');
+    for (char& c : expression) {
+      c = alphabet[random() % alphabet.size()];
+    }
+    check(expression);
+  }
+}
+
+// Text is read as a number exactly where the regex it replaced matched.
+void TestTextNumbersInFormulas() {
+  const std::regex regex_double(R"(^\s*([-+]?\d+(?:\.\d+)?)\s*$)");
+  auto check = [&regex_double](const std::string& text) {
+    std::smatch match;
+    const bool expected = std::regex_match(text, match, regex_double);
+    const std::optional<double> number = ParseNumericText(text);
+    ASSERT_EQUAL(number.has_value(), expected);
+    if (expected) {
+      ASSERT_EQUAL(*number, std::stod(match[1]));
+    }
+  };
+
+  for (const std::string& text : std::vector<std::string>{
+           "", " ", "0", "-0", "+7", "007", " \t12.50\n", "1.", ".5", "1e5",
+           "+-1", "--1", "1 2", "0x10", "12a", "3,5", "1.2.3", " -3.25 "}) {
+    check(text);
+  }
+
+  const std::string alphabet = "01239.+-e \t";
+  std::mt19937 random(54321);
+  for (int i = 0; i < 20000; ++i) {
+    std::string text(random() % 8, ' ');
+    for (char& c : text) {
+      c = alphabet[random() % alphabet.size()];
+    }
+    check(text);
+  }
+
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, " 2.5 ");
+  sheet->SetCell("A2"_pos, "'4");
+  sheet->SetCell("A3"_pos, "=A1*A2");
+  ASSERT_EQUAL(sheet->GetCellInterface("A3"_pos)->GetValue(),
+               CellInterface::Value(10.0));
+
+  sheet->SetCell("A2"_pos, "4e0");
+  ASSERT_EQUAL(sheet->GetCellInterface("A3"_pos)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestDefaultNumericValue() {
+  // Outside implementations need only the three original methods.
+  class ValueCell final : public CellInterface {
+   public:
+    explicit ValueCell(Value value) : value_(std::move(value)) {}
+    Value GetValue() const override { return value_; }
+    std::string GetText() const override { return {}; }
+    std::vector<Position> GetReferencedCells() const override { return {}; }
+
+   private:
+    Value value_;
+  };
+
+  using Numeric = std::variant<double, FormulaError>;
+  ASSERT(ValueCell(2.5).GetNumericValue() == Numeric(2.5));
+  ASSERT(ValueCell(std::string(" -3 ")).GetNumericValue() == Numeric(-3.0));
+  ASSERT(ValueCell(std::string("x")).GetNumericValue() ==
+         Numeric(FormulaError::Category::Value));
+  ASSERT(ValueCell(std::string()).GetNumericValue() ==
+         Numeric(FormulaError::Category::Value));
+  ASSERT(ValueCell(FormulaError::Category::Div0).GetNumericValue() ==
+         Numeric(FormulaError::Category::Div0));
+}
+
+void TestConstantFolding() {
+  const std::function<double(Position)> args = [](Position position) {
+    return double(position.row + 2);
+  };
+  auto run = [](auto execute) -> CellInterface::Value {
+    try {
+      return execute();
+    } catch (const FormulaError& error) {
+      return error;
+    }
+  };
+
+  // Folds to one constant times A1: Number, its value and MultiplyCell.
+  const std::string expression = "(12+13)*(14+(13-24/(1+1))*55-46)*A1";
+  const FormulaAST folded = ParseFormulaAST(expression);
+  ASSERT_EQUAL(folded.GetProgram().GetSize(), 3u);
+  ASSERT_EQUAL(folded.Execute(args), folded.ExecuteTree(args));
+  ASSERT_EQUAL(ParseFormula(expression)->GetExpression(), expression);
+
+  // Errors of constant subtrees are still raised when evaluating.
+  for (const std::string& expression : std::vector<std::string>{
+           "1/0", "A1+1/(2-2)", "1e200*1e200", "(1e308+1e308)-A1", "A1*1",
+           "1*A1", "A1/1", "A1-0", "A1+0", "0-A1", "--A1", "-(-(1))", "+A1",
+           "-0", "2*(3*A1)", "(1+2)/(3-3)*A1"}) {
+    const FormulaAST ast = ParseFormulaAST(expression);
+    ASSERT_EQUAL(run([&] { return ast.Execute(args); }),
+                 run([&] { return ast.ExecuteTree(args); }));
+  }
+  ASSERT_EQUAL(ParseFormulaAST("--A1*1").GetProgram().GetSize(), 1u);
+}
+
+void TestFilledDownFormulasShareTemplate() {
+  Sheet sheet;
+  for (int row = 1; row <= 100; ++row) {
+    const std::string r = std::to_string(row);
+    sheet.SetCell(Position::FromString("B" + r), r);
+    sheet.SetCell(Position::FromString("C" + r), "2");
+    sheet.SetCell(Position::FromString("D" + r), "=B" + r + " * C" + r);
+  }
+
+  FormulaTemplateStats stats = sheet.GetFormulaTemplateStats();
+  ASSERT_EQUAL(stats.templates, 1u);
+  ASSERT_EQUAL(stats.formulas, 100u);
+  ASSERT_EQUAL(stats.hits, 99u);
+
+  const CellInterface* d50 = sheet.GetCellInterface("D50"_pos);
+  ASSERT_EQUAL(d50->GetText(), "=B50*C50");
+  ASSERT_EQUAL(d50->GetValue(), CellInterface::Value(100.0));
+  ASSERT_EQUAL(d50->GetReferencedCells(),
+               (std::vector<Position>{"B50"_pos, "C50"_pos}));
+
+  // The same text elsewhere refers to other relative cells.
+  sheet.SetCell("E1"_pos, "=B2*C2");
+  ASSERT_EQUAL(sheet.GetFormulaTemplateStats().templates, 2u);
+  ASSERT_EQUAL(sheet.GetCellInterface("E1"_pos)->GetValue(),
+               CellInterface::Value(4.0));
+
+  // Keys keep tokens apart, so this does not find the template of =12.
+  sheet.SetCell("E2"_pos, "=12");
+  try {
+    sheet.SetCell("E3"_pos, "=1 2");
+    ASSERT(false);
+  } catch (const FormulaException&) {
+  }
+
+  for (int row = 1; row <= 100; ++row) {
+    sheet.ClearCell(Position{row - 1, 3});
+  }
+  sheet.ClearCell("E1"_pos);
+  sheet.ClearCell("E2"_pos);
+  stats = sheet.GetFormulaTemplateStats();
+  ASSERT_EQUAL(stats.templates, 0u);
+  ASSERT_EQUAL(stats.formulas, 0u);
+}
+
+void TestFormulaCacheSharesTrees() {
+  FormulaCache& cache = FormulaCache::GetGlobal();
+  const size_t capacity = cache.GetStats().capacity;
+  cache.Clear();
+  const FormulaCacheStats before = cache.GetStats();
+
+  {
+    // Equal texts share a tree across sheets, rows and spacing.
+    Sheet first;
+    Sheet second;
+    first.SetCell("X1"_pos, "40");
+    second.SetCell("X1"_pos, "1");
+    first.SetCell("A1"_pos, "=X1+2");
+    second.SetCell("B5"_pos, "= X1 + 2");
+    second.SetCell("B6"_pos, "=X1+2");
+    FormulaCacheStats stats = cache.GetStats();
+    ASSERT_EQUAL(stats.entries, 1u);
+    ASSERT_EQUAL(stats.misses - before.misses, 1u);
+    ASSERT_EQUAL(stats.hits - before.hits, 2u);
+    ASSERT_EQUAL(first.GetCellInterface("A1"_pos)->GetValue(),
+                 CellInterface::Value(42.0));
+    ASSERT_EQUAL(second.GetCellInterface("B6"_pos)->GetValue(),
+                 CellInterface::Value(3.0));
+    ASSERT_EQUAL(second.GetCellInterface("B5"_pos)->GetText(), "=X1+2");
+
+    // An evicted tree stays with the formulas using it.
+    cache.SetCapacity(1);
+    auto sum = ParseFormula("1+1");
+    ASSERT_EQUAL(cache.GetStats().entries, 1u);
+    ASSERT_EQUAL(cache.GetStats().evictions - before.evictions, 1u);
+    ASSERT_EQUAL(first.GetCellInterface("A1"_pos)->GetText(), "=X1+2");
+    ASSERT_EQUAL(second.GetCellInterface("B6"_pos)->GetValue(),
+                 CellInterface::Value(3.0));
+
+    // Disabled, nothing is kept or counted.
+    cache.SetCapacity(0);
+    stats = cache.GetStats();
+    ASSERT_EQUAL(stats.entries, 0u);
+    ASSERT_EQUAL(ParseFormula("1+1")->GetExpression(), "1+1");
+    ASSERT_EQUAL(cache.GetStats().hits, stats.hits);
+    ASSERT_EQUAL(cache.GetStats().misses, stats.misses);
+  }
+
+  cache.SetCapacity(capacity);
+  try {
+    ParseFormula("1 2");
+    ASSERT(false);
+  } catch (const FormulaException&) {
+  }
+  ASSERT_EQUAL(cache.GetStats().entries, 0u);
+
+  {
+    // Each sheet counts the trees it uses once, shared or not.
+    Sheet first;
+    Sheet second;
+    for (int row = 0; row < 10000; ++row) {
+      const std::string text = "=X1*" + std::to_string(row) + "+Y2";
+      first.SetCell(Position{row, 0}, text);
+      second.SetCell(Position{row, 0}, text);
+      // Anchored elsewhere, the same text is another template, same tree.
+      second.SetCell(Position{row, 1}, text);
+    }
+    const size_t trees = first.GetMemoryStats().formula_trees;
+    ASSERT(trees >= 10000 * sizeof(FormulaAST));
+    ASSERT_EQUAL(second.GetMemoryStats().formula_trees, trees);
+
+    for (int row = 0; row < 10000; ++row) {
+      second.ClearCell(Position{row, 0});
+    }
+    ASSERT_EQUAL(second.GetMemoryStats().formula_trees, trees);
+    for (int row = 0; row < 10000; ++row) {
+      second.ClearCell(Position{row, 1});
+    }
+    ASSERT_EQUAL(second.GetMemoryStats().formula_trees, 0u);
+  }
+
+  // With every formula gone, clearing frees all the cache holds.
+  cache.Clear();
+  ASSERT_EQUAL(cache.GetStats().bytes, 0u);
+}
+
+void TestDirectLookupMatchesInterface() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "3");
+  sheet.SetCell("A2"_pos, " 4.5 ");
+  sheet.SetCell("A3"_pos, "text");
+  sheet.SetCell("A4"_pos, "=1/0");
+  sheet.SetCell("A5"_pos, "=A1*2");
+  sheet.SetCell("A6"_pos, "'7");
+  sheet.SetCell("B1"_pos, "=Z99+1");  // leaves a referenced placeholder
+
+  const SheetInterface& interface = sheet;
+  auto as_value = [](const FormulaInterface::Value& value) {
+    return std::visit([](auto helper) { return CellInterface::Value(helper); },
+                      value);
+  };
+  for (const std::string expression :
+       {"A1+A2", "A3+1", "A4*2", "A5/A1", "A6", "Z99", "Z98+A1", "A2-A5"}) {
+    const auto formula = ParseFormula(expression);
+    ASSERT_EQUAL(as_value(formula->Evaluate(sheet)),
+                 as_value(formula->Evaluate(interface)));
+  }
+
+  const FormulaError value_error(FormulaError::Category::Value);
+  const FormulaError div0_error(FormulaError::Category::Div0);
+  ASSERT_EQUAL(as_value(ParseFormula("A1+A2")->Evaluate(sheet)),
+               CellInterface::Value(7.5));
+  ASSERT_EQUAL(as_value(ParseFormula("A3+1")->Evaluate(sheet)),
+               CellInterface::Value(value_error));
+  ASSERT_EQUAL(as_value(ParseFormula("A4*2")->Evaluate(sheet)),
+               CellInterface::Value(div0_error));
+}
+
+void TestRangeReferences() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("A2"_pos, "2");
+  sheet.SetCell("A3"_pos, "=A1*4");
+  sheet.SetCell("C1"_pos, "=SUM(A3:A1)+SUM(B1:B2,A1)");
+
+  const CellInterface* c1 = sheet.GetCellInterface("C1"_pos);
+  ASSERT_EQUAL(c1->GetText(), "=SUM(A1:A3)+SUM(B1:B2,A1)");
+  ASSERT_EQUAL(c1->GetValue(), CellInterface::Value(8.0));
+  ASSERT_EQUAL(c1->GetReferencedCells(),
+               (std::vector<Position>{"A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos,
+                                      "A3"_pos}));
+
+  // Unset cells of a range read as 0 and count as referenced; changes
+  // anywhere in it reach the formula.
+  ASSERT_EQUAL(sheet.GetCellInterface("B2"_pos)->GetText(), "");
+  sheet.SetCell("B2"_pos, "10");
+  ASSERT_EQUAL(c1->GetValue(), CellInterface::Value(18.0));
+  sheet.SetCell("A1"_pos, "2");
+  ASSERT_EQUAL(c1->GetValue(), CellInterface::Value(24.0));
+  sheet.SetCell("B1"_pos, "text");
+  ASSERT_EQUAL(c1->GetValue(),
+               CellInterface::Value(FormulaError::Category::Value));
+  sheet.SetCell("B1"_pos, "=1/0");
+  ASSERT_EQUAL(c1->GetValue(),
+               CellInterface::Value(FormulaError::Category::Div0));
+
+  auto is_circular = [&sheet](Position position, const std::string& text) {
+    try {
+      sheet.SetCell(position, text);
+    } catch (const CircularDependencyException&) {
+      return true;
+    }
+    return false;
+  };
+  ASSERT(is_circular("A2"_pos, "=SUM(A1:A3)"));
+  ASSERT(is_circular("A2"_pos, "=C1"));
+  // Through cells that read others only through ranges.
+  sheet.SetCell("D1"_pos, "=SUM(C1:C2)");
+  sheet.SetCell("E1"_pos, "=SUM(D1:D5)");
+  ASSERT(is_circular("B2"_pos, "=E1"));
+  ASSERT(!is_circular("F1"_pos, "=SUM(A1:E1)"));
+  ASSERT_EQUAL(sheet.GetCellInterface("B2"_pos)->GetText(), "10");
+
+  // Filled down, the ranges move with the formula.
+  sheet.SetCell("G2"_pos, "=SUM(A1:A2)");
+  sheet.SetCell("G3"_pos, "=SUM(A2:A3)");
+  ASSERT_EQUAL(sheet.GetCellInterface("G3"_pos)->GetText(), "=SUM(A2:A3)");
+  ASSERT_EQUAL(sheet.GetCellInterface("G3"_pos)->GetValue(),
+               CellInterface::Value(10.0));
+
+  // A whole column is one entry in the graph.
+  Sheet tall;
+  const DependencyStats before = tall.GetGraph().GetStats();
+  tall.SetCell("B1"_pos, "=SUM(A1:A16384)");
+  ASSERT_EQUAL(tall.GetGraph().GetStats().edges, before.edges);
+  ASSERT_EQUAL(tall.GetGraph().GetStats().ranges, 1u);
+  // The rest is the fixed cost of the rank and range indexes.
+  ASSERT(tall.GetMemoryStats().dependencies < 512);
+  tall.SetCell("A16384"_pos, "3");
+  ASSERT_EQUAL(tall.GetCellInterface("B1"_pos)->GetValue(),
+               CellInterface::Value(3.0));
+  ASSERT_EQUAL(tall.GetCellInterface("B1"_pos)->GetReferencedCells().size(),
+               size_t(Position::MAX_ROWS));
+  tall.SetCell("B1"_pos, "1");
+  ASSERT_EQUAL(tall.GetGraph().GetStats().ranges, 0u);
+}
+
+void TestRangeDependentIndex() {
+  // Ranges of every extent, many crossing tile edges, are found from each
+  // cell they hold, and only from those.
+  DependencyGraph graph;
+  std::mt19937 random(777);
+  auto random_range = [&random] {
+    const int extent = 1 << random() % 15;
+    const Position first{int(random() % Position::MAX_ROWS),
+                         int(random() % Position::MAX_COLS)};
+    const Position last{
+        std::min(first.row + int(random() % extent), Position::MAX_ROWS - 1),
+        std::min(first.col + int(random() % extent), Position::MAX_COLS - 1)};
+    return CellRange{first, last};
+  };
+
+  std::map<CellKey, std::vector<CellRange>> readers;
+  for (int step = 0; step < 2000; ++step) {
+    const CellKey reader = ToCellKey({int(random() % 64), 0});
+    std::vector<CellRange> ranges(random() % 3);
+    for (CellRange& range : ranges) {
+      range = random_range();
+    }
+    if (graph.SetPrecedents(reader, {}, ranges)) {
+      readers[reader] = ranges;
+    }
+  }
+
+  size_t count = 0;
+  for (const auto& [reader, ranges] : readers) {
+    count += ranges.size();
+    const DependencyGraph::Ranges stored = graph.GetRangePrecedents(reader);
+    ASSERT(std::equal(stored.begin(), stored.end(), ranges.begin(),
+                      ranges.end()));
+  }
+  ASSERT_EQUAL(graph.GetStats().ranges, count);
+
+  // Corners of the stored ranges, the cells just past them and others.
+  std::vector<Position> probes;
+  for (const auto& [reader, ranges] : readers) {
+    for (const CellRange& range : ranges) {
+      probes.push_back(range.first);
+      probes.push_back(range.last);
+      probes.push_back({range.last.row + 1, range.last.col});
+      probes.push_back({range.first.row, range.first.col - 1});
+    }
+  }
+  for (int i = 0; i < 1000; ++i) {
+    probes.push_back(random_range().first);
+  }
+
+  for (const Position position : probes) {
+    if (position.IsValid()) {
+      std::multiset<CellKey> expected;
+      for (const auto& [reader, ranges] : readers) {
+        for (const CellRange& range : ranges) {
+          if (range.Contains(position)) {
+            expected.insert(reader);
+          }
+        }
+      }
+
+      std::multiset<CellKey> found;
+      graph.ForEachRangeDependent(
+          ToCellKey(position), [&found](CellKey cell) { found.insert(cell); });
+      ASSERT(found == expected);
+      ASSERT_EQUAL(graph.HasDependents(ToCellKey(position)),
+                   !expected.empty());
+    }
+  }
+}
+
+void TestAggregateFunctions() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "4");
+  sheet.SetCell("A2"_pos, "-2");
+  sheet.SetCell("A4"_pos, " 6 ");
+  sheet.SetCell("B1"_pos, "=A1*3");
+  auto value = [&sheet](const std::string& formula) {
+    sheet.SetCell("Z1"_pos, "=" + formula);
+    return sheet.GetCellInterface("Z1"_pos)->GetValue();
+  };
+
+  // A3 is empty and counts as 0.
+  ASSERT_EQUAL(value("SUM(A1:A4)"), CellInterface::Value(8.0));
+  ASSERT_EQUAL(value("MIN(A1:A4)"), CellInterface::Value(-2.0));
+  ASSERT_EQUAL(value("MAX(A1:B4)"), CellInterface::Value(12.0));
+  ASSERT_EQUAL(value("AVERAGE(A1:A4)"), CellInterface::Value(2.0));
+  ASSERT_EQUAL(value("COUNT(A1:B4,7)"), CellInterface::Value(9.0));
+  ASSERT_EQUAL(value("MIN(A3:A3)"), CellInterface::Value(0.0));
+  ASSERT_EQUAL(value("MAX(1,A1:A2)*2"), CellInterface::Value(8.0));
+  ASSERT_EQUAL(value("MIN()"), CellInterface::Value(0.0));
+  ASSERT_EQUAL(value("AVERAGE()"),
+               CellInterface::Value(FormulaError::Category::Div0));
+  ASSERT_EQUAL(sheet.GetCellInterface("Z1"_pos)->GetText(), "=AVERAGE()");
+
+  // Errors in the range propagate, even to COUNT.
+  sheet.SetCell("A3"_pos, "x");
+  ASSERT_EQUAL(value("COUNT(A1:A4)"),
+               CellInterface::Value(FormulaError::Category::Value));
+  sheet.SetCell("A3"_pos, "=1/0");
+  ASSERT_EQUAL(value("MAX(A1:A4)"),
+               CellInterface::Value(FormulaError::Category::Div0));
+  sheet.SetCell("A3"_pos, "1");
+  ASSERT_EQUAL(value("MAX(A1:A4)"), CellInterface::Value(6.0));
+
+  // Every kernel set folds into the same lanes, bit for bit.
+  std::mt19937 random(777);
+  std::uniform_real_distribution<double> distribution(-1e6, 1e6);
+  std::vector<double> values(1003);
+  for (double& number : values) {
+    number = distribution(random);
+  }
+  values[5] = -0.0;
+  values[6] = 0.0;
+
+  const aggregate::Kernels& scalar =
+      aggregate::GetKernels(aggregate::KernelSet::Scalar);
+  for (auto set : {aggregate::KernelSet::Sse2, aggregate::KernelSet::Avx2}) {
+    if (set > aggregate::GetBestKernelSet()) {
+      continue;
+    }
+    const aggregate::Kernels& kernels = aggregate::GetKernels(set);
+    for (size_t count : {size_t(0), size_t(3), size_t(8), size_t(13),
+                         values.size()}) {
+      for (auto kernel : {&aggregate::Kernels::sum, &aggregate::Kernels::min,
+                          &aggregate::Kernels::max}) {
+        double expected[aggregate::LANES] = {1, 2, 3, 4, 5, 6, 7, 8};
+        double actual[aggregate::LANES] = {1, 2, 3, 4, 5, 6, 7, 8};
+        (scalar.*kernel)(values.data(), count, expected);
+        (kernels.*kernel)(values.data(), count, actual);
+        ASSERT(std::memcmp(expected, actual, sizeof(expected)) == 0);
+      }
+    }
+  }
+
+  const aggregate::KernelSet active = aggregate::GetActiveKernelSet();
+  for (int row = 0; row < 1000; ++row) {
+    sheet.SetCell(Position{row, 2}, std::to_string(values[row]));
+  }
+  const CellInterface::Value vector_sum = value("SUM(C1:C1000)");
+  aggregate::SetActiveKernelSet(aggregate::KernelSet::Scalar);
+  const CellInterface::Value scalar_sum = value("SUM(C1:C1000)");
+  aggregate::SetActiveKernelSet(active);
+  ASSERT_EQUAL(vector_sum, scalar_sum);
+}
+
+void TestFormulaStorageIsFlat() {
+  MemoryCounter counter;
+  {
+    MemoryScope scope(&counter);
+    const FormulaAST ast = ParseFormulaAST("-(B2+A1)*2");
+    // 6 nodes of 16 bytes, 2 cells and 5 code words of 8 bytes, together.
+    ASSERT_EQUAL(counter.Get(), 6 * 16 + 2 * 8 + 5 * 8u);
+    ASSERT_EQUAL(std::vector<Position>(ast.GetCells().begin(),
+                                       ast.GetCells().end()),
+                 (std::vector<Position>{"A1"_pos, "B2"_pos}));
+
+    std::ostringstream out;
+    ast.PrintFormula(out);
+    ASSERT_EQUAL(out.str(), "-(B2+A1)*2");
+  }
+  ASSERT_EQUAL(counter.Get(), 0u);
+}
+
+void TestIncrementalCycleDetection() {
+  constexpr int ROWS = 1000;
+  Sheet sheet;
+  for (int row = 1; row < ROWS; ++row) {
+    sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+  }
+  const DependencyGraph& graph = sheet.GetGraph();
+  ASSERT_EQUAL(graph.GetStats().ordered, size_t(ROWS - 1));
+  ASSERT_EQUAL(graph.GetStats().reordered, 0u);
+
+  // B1 is ranked above the chain, so reading it moves the whole chain.
+  sheet.SetCell("B1"_pos, "=C1");
+  sheet.SetCell("A1"_pos, "=B1");
+  ASSERT_EQUAL(graph.GetStats().reordered, size_t(ROWS + 1));
+  bool caught = false;
+  try {
+    sheet.SetCell("C1"_pos, "=SUM(A900:A910)");
+  } catch (const CircularDependencyException&) {
+    caught = true;
+  }
+  ASSERT(caught);
+  ASSERT_EQUAL(sheet.GetCellInterface("C1"_pos)->GetText(), "");
+  sheet.SetCell("C1"_pos, "5");
+  ASSERT_EQUAL(sheet.GetCellInterface(Position{ROWS - 1, 0})->GetValue(),
+               CellInterface::Value(4.0 + ROWS));
+
+  // Random edits on a small grid agree with a walk over every reference.
+  constexpr int SIZE = 5;
+  std::mt19937 random(4242);
+  std::uniform_int_distribution<int> coordinate(0, SIZE - 1);
+  auto random_cell = [&] {
+    return Position{coordinate(random), coordinate(random)};
+  };
+  Sheet grid;
+  for (int step = 0; step < 3000; ++step) {
+    const Position target = random_cell();
+    std::string text;
+    std::vector<Position> references;
+    const int kind = coordinate(random);
+    if (kind == 0) {
+      text = "1";
+    } else if (kind == 1) {
+      const CellRange range = CellRange::FromCorners(random_cell(),
+                                                     random_cell());
+      text = "=SUM(" + range.ToString() + ")";
+      for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+          references.push_back({row, col});
+        }
+      }
+    } else {
+      for (int i = 0; i < kind - 1; ++i) {
+        references.push_back(random_cell());
+        text += (text.empty() ? "=" : "+") + references.back().ToString();
+      }
+    }
+
+    bool expected = false;
+    std::vector<Position> pending = references;
+    std::set<Position> visited;
+    while (!pending.empty() && !expected) {
+      const Position cell = pending.back();
+      pending.pop_back();
+      expected = cell == target;
+      const CellInterface* interface = grid.GetCellInterface(cell);
+      if (visited.insert(cell).second && interface) {
+        for (Position precedent : interface->GetReferencedCells()) {
+          pending.push_back(precedent);
+        }
+      }
+    }
+
+    bool loop = false;
+    try {
+      grid.SetCell(target, text);
+    } catch (const CircularDependencyException&) {
+      loop = true;
+    }
+    ASSERT_EQUAL(loop, expected);
+  }
+  ASSERT(grid.GetGraph().GetStats().reordered > 0);
+}
+
+void TestLongChains() {
+  // Far more links than evaluation could recurse through on the stack.
+  constexpr int LENGTH = 300000;
+  auto position = [](int index) {
+    return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+  };
+  Sheet sheet;
+  sheet.SetCell(position(0), "1");
+  for (int index = 1; index < LENGTH; ++index) {
+    sheet.SetCell(position(index),
+                  "=" + position(index - 1).ToString() + "+1");
+  }
+
+  const Position last = position(LENGTH - 1);
+  ASSERT_EQUAL(sheet.GetCellInterface(last)->GetValue(),
+               CellInterface::Value(double(LENGTH)));
+  sheet.SetCell(position(0), "2");
+  ASSERT_EQUAL(sheet.GetCellInterface(last)->GetValue(),
+               CellInterface::Value(LENGTH + 1.0));
+  sheet.SetCell(position(LENGTH / 2), "=1/0");
+  ASSERT_EQUAL(sheet.GetCellInterface(last)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Div0));
+
+  bool caught = false;
+  try {
+    sheet.SetCell(position(LENGTH / 2), "=" + last.ToString());
+  } catch (const CircularDependencyException&) {
+    caught = true;
+  }
+  ASSERT(caught);
+  sheet.SetCell(position(LENGTH / 2), "0");
+  ASSERT_EQUAL(sheet.GetCellInterface(last)->GetValue(),
+               CellInterface::Value(double(LENGTH - LENGTH / 2 - 1)));
+}
+
+void TestLongChainsWithoutCache() {
+  // Nothing or little is cached, so the walk has to keep its results; a
+  // read per link walking the rest again would take hours at this length.
+  constexpr int LENGTH = 100000;
+  auto position = [](int index) {
+    return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+  };
+  for (size_t entries : {0, 10}) {
+    Sheet sheet;
+    sheet.SetValueCacheBudget(entries * ValueCache::GetEntryBytes());
+    sheet.SetCell(position(0), "1");
+    for (int index = 1; index < LENGTH; ++index) {
+      // Every tenth link goes through a range.
+      const std::string previous = position(index - 1).ToString();
+      sheet.SetCell(position(index), index % 10 == 0
+                                         ? "=SUM(" + previous + ":" +
+                                               previous + ")+1"
+                                         : "=" + previous + "+1");
+    }
+
+    const Position last = position(LENGTH - 1);
+    ASSERT_EQUAL(sheet.GetCellInterface(last)->GetValue(),
+                 CellInterface::Value(double(LENGTH)));
+    sheet.SetCell(position(0), "2");
+    ASSERT_EQUAL(sheet.GetCellInterface(last)->GetValue(),
+                 CellInterface::Value(LENGTH + 1.0));
+    ASSERT(sheet.GetValueCacheStats().entries <= entries);
+  }
+}
+
+void TestRecalculate() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("B1"_pos, "=A1+1");
+  sheet.SetCell("B2"_pos, "=A1*2");
+  sheet.SetCell("C1"_pos, "=B1+B2");
+  sheet.SetCell("D1"_pos, "=2*5");
+  sheet.SetCell("E1"_pos, "=SUM(B1:B2)");
+  sheet.SetCell("F1"_pos, "=C1+1");
+  sheet.SetCell("G1"_pos, "=F1+1");
+
+  RecalculationStats stats = sheet.Recalculate();
+  ASSERT_EQUAL(stats.evaluated, 7u);
+  ASSERT_EQUAL(stats.depth, 4u);
+  const ValueCacheStats before = sheet.GetValueCacheStats();
+  ASSERT_EQUAL(sheet.GetCellInterface("G1"_pos)->GetValue(),
+               CellInterface::Value(6.0));
+  ASSERT_EQUAL(sheet.GetCellInterface("E1"_pos)->GetValue(),
+               CellInterface::Value(4.0));
+  ASSERT_EQUAL(sheet.GetValueCacheStats().misses, before.misses);
+  ASSERT_EQUAL(sheet.Recalculate().evaluated, 0u);
+
+  // A batch of edits costs one pass over what they reach.
+  for (int value = 2; value <= 5; ++value) {
+    sheet.SetCell("A1"_pos, std::to_string(value));
+  }
+  stats = sheet.Recalculate();
+  ASSERT_EQUAL(stats.evaluated, 6u);
+  ASSERT_EQUAL(stats.depth, 4u);
+  ASSERT_EQUAL(sheet.GetCellInterface("G1"_pos)->GetValue(),
+               CellInterface::Value(18.0));
+
+  // What reads evaluated in between is not evaluated again.
+  sheet.SetCell("A1"_pos, "1");
+  ASSERT_EQUAL(sheet.GetCellInterface("C1"_pos)->GetValue(),
+               CellInterface::Value(4.0));
+  stats = sheet.Recalculate();
+  ASSERT_EQUAL(stats.evaluated, 3u);
+  ASSERT_EQUAL(stats.depth, 2u);
+
+  // Repeated edits of one formula leave one entry to evaluate.
+  for (int i = 0; i < 5000; ++i) {
+    sheet.SetCell("H1"_pos, "=A1+" + std::to_string(i));
+  }
+  ASSERT(sheet.GetMemoryStats().values < 5000 * sizeof(CellKey));
+  ASSERT_EQUAL(sheet.Recalculate().evaluated, 1u);
+  ASSERT_EQUAL(sheet.GetCellInterface("H1"_pos)->GetValue(),
+               CellInterface::Value(5000.0));
+
+  // Enough new formulas to prune the list on the way lose none.
+  for (int row = 0; row < 5000; ++row) {
+    sheet.SetCell(Position{row, 9}, "=A1+" + std::to_string(row));
+  }
+  ASSERT_EQUAL(sheet.Recalculate().evaluated, 5000u);
+}
+
+void TestThreadPool() {
+  ThreadPool pool(4);
+  ASSERT_EQUAL(pool.GetThreadCount(), 4u);
+  std::vector<std::atomic<int>> visits(10000);
+  std::atomic<size_t> bad_threads = 0;
+  pool.ParallelFor(visits.size(), 7,
+                   [&visits, &bad_threads](size_t begin, size_t end,
+                                           size_t thread) {
+                     bad_threads += thread >= 4;
+                     for (size_t i = begin; i < end; ++i) {
+                       ++visits[i];
+                     }
+                   });
+  ASSERT_EQUAL(bad_threads.load(), 0u);
+  ASSERT(std::all_of(visits.begin(), visits.end(),
+                     [](const std::atomic<int>& count) { return count == 1; }));
+
+  bool thrown = false;
+  try {
+    pool.ParallelFor(1000, 10, [](size_t begin, size_t, size_t) {
+      if (begin == 500) {
+        throw std::runtime_error("batch failed");
+      }
+    });
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  ASSERT(thrown);
+  // The pool takes the next loop after a failed one.
+  std::atomic<size_t> total = 0;
+  pool.ParallelFor(1000, 10, [&total](size_t begin, size_t end, size_t) {
+    total += end - begin;
+  });
+  ASSERT_EQUAL(total.load(), 1000u);
+}
+
+void TestParallelRecalculate() {
+  // Each cell adds two of the row above, and a column sums a block, so the
+  // levels are wider than one batch and read ranges.
+  constexpr int ROWS = 60;
+  constexpr int COLS = 200;
+  auto fill = [](Sheet& sheet, int input) {
+    for (int col = 0; col < COLS; ++col) {
+      sheet.SetCell(Position{0, col}, std::to_string(input + col % 7));
+    }
+    for (int row = 1; row < ROWS; ++row) {
+      for (int col = 0; col < COLS; ++col) {
+        const Position left{row - 1, col};
+        const Position right{row - 1, (col + 1) % COLS};
+        sheet.SetCell(Position{row, col}, "=" + left.ToString() + "+" +
+                                              right.ToString() + "/2");
+      }
+    }
+    sheet.SetCell(Position{ROWS, 0}, "=SUM(A30:CV40)");
+  };
+
+  Sheet serial;
+  fill(serial, 1);
+  const RecalculationStats expected = serial.Recalculate();
+  ASSERT_EQUAL(expected.threads, 1u);
+
+  for (size_t threads : {2u, 4u, 7u}) {
+    Sheet sheet;
+    sheet.SetRecalculationThreads(threads);
+    fill(sheet, 1);
+    const RecalculationStats stats = sheet.Recalculate();
+    ASSERT_EQUAL(stats.threads, threads);
+    ASSERT_EQUAL(stats.evaluated, expected.evaluated);
+    ASSERT_EQUAL(stats.depth, expected.depth);
+    ASSERT_EQUAL(stats.deferred, 0u);
+    ASSERT_EQUAL(sheet.Recalculate().evaluated, 0u);
+
+    // Every result is cached, so reads evaluate nothing.
+    const ValueCacheStats before = sheet.GetValueCacheStats();
+    for (int row = 1; row <= ROWS; ++row) {
+      for (int col = 0; col < (row == ROWS ? 1 : COLS); ++col) {
+        ASSERT_EQUAL(sheet.GetCellInterface(Position{row, col})->GetValue(),
+                     serial.GetCellInterface(Position{row, col})->GetValue());
+      }
+    }
+    ASSERT_EQUAL(sheet.GetValueCacheStats().misses, before.misses);
+  }
+
+  // Results evicted by a small budget are evaluated again by the cells
+  // that read them, after their level.
+  Sheet sheet;
+  sheet.SetRecalculationThreads(4);
+  sheet.SetValueCacheBudget(300 * ValueCache::GetEntryBytes());
+  fill(sheet, 1);
+  const RecalculationStats stats = sheet.Recalculate();
+  ASSERT(stats.deferred > 0);
+  ASSERT_EQUAL(sheet.GetCellInterface(Position{ROWS, 0})->GetValue(),
+               serial.GetCellInterface(Position{ROWS, 0})->GetValue());
+  const Position last{ROWS - 1, COLS - 1};
+  ASSERT_EQUAL(sheet.GetCellInterface(last)->GetValue(),
+               serial.GetCellInterface(last)->GetValue());
+
+  // Edits between passes go to the pool too; errors are results like any.
+  Sheet edited;
+  edited.SetRecalculationThreads(0);
+  fill(edited, 1);
+  edited.Recalculate();
+  edited.SetCell("A1"_pos, "text");
+  serial.SetCell("A1"_pos, "text");
+  edited.Recalculate();
+  serial.Recalculate();
+  ASSERT_EQUAL(edited.GetCellInterface(Position{ROWS, 0})->GetValue(),
+               serial.GetCellInterface(Position{ROWS, 0})->GetValue());
+  ASSERT_EQUAL(edited.GetCellInterface(Position{ROWS - 1, 0})->GetValue(),
+               serial.GetCellInterface(Position{ROWS - 1, 0})->GetValue());
+}
+
+void TestDeferredInvalidation() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  for (int row = 0; row < 1000; ++row) {
+    sheet.SetCell(Position{row, 1}, "=A1+" + std::to_string(row));
+  }
+  sheet.SetCell("C1"_pos, "=SUM(B1:B1000)");
+  sheet.SetCell("D1"_pos, "=C1*2");
+  ASSERT_EQUAL(sheet.GetCellInterface("D1"_pos)->GetValue(),
+               CellInterface::Value(1001000.0));
+
+  // Repeated edits of the hub drop nothing and keep one entry.
+  const size_t entries = sheet.GetValueCacheStats().entries;
+  const size_t values = sheet.GetMemoryStats().values;
+  for (int value = 2; value <= 1000; ++value) {
+    sheet.SetCell("A1"_pos, std::to_string(value));
+  }
+  ASSERT_EQUAL(sheet.GetValueCacheStats().entries, entries);
+  ASSERT(sheet.GetMemoryStats().values < values + 64);
+
+  // The first read drops the dependents and sees the last edit.
+  ASSERT_EQUAL(sheet.GetCellInterface("D1"_pos)->GetValue(),
+               CellInterface::Value(2999000.0));
+  ASSERT_EQUAL(sheet.GetCellInterface("B1000"_pos)->GetValue(),
+               CellInterface::Value(1999.0));
+
+  // Dependents changed in between are walked from as well.
+  sheet.SetCell("A1"_pos, "0");
+  sheet.SetCell("B5"_pos, "=A1+1000");
+  sheet.SetCell("E1"_pos, "=D1+B5");
+  ASSERT_EQUAL(sheet.GetCellInterface("E1"_pos)->GetValue(),
+               CellInterface::Value(1001992.0));
+
+  // More edits than the list keeps drop on the way.
+  sheet.SetCell("G1"_pos, "=SUM(F1:F2000)");
+  ASSERT_EQUAL(sheet.GetCellInterface("G1"_pos)->GetValue(),
+               CellInterface::Value(0.0));
+  for (int row = 0; row < 2000; ++row) {
+    sheet.SetCell(Position{row, 5}, std::to_string(row));
+  }
+  ASSERT_EQUAL(sheet.GetCellInterface("G1"_pos)->GetValue(),
+               CellInterface::Value(1999000.0));
+
+  // Recalculate drops them first.
+  sheet.SetCell("A1"_pos, "5");
+  ASSERT_EQUAL(sheet.Recalculate().evaluated, 1003u);
+  const size_t misses = sheet.GetValueCacheStats().misses;
+  ASSERT_EQUAL(sheet.GetCellInterface("E1"_pos)->GetValue(),
+               CellInterface::Value(1011997.0));
+  ASSERT_EQUAL(sheet.GetValueCacheStats().misses, misses);
+}
 }  // namespace
 
 int main() {
@@ -365,6 +1726,8 @@ int main() {
   RUN_TEST(tr, TestInvalidPosition);
   RUN_TEST(tr, TestSetCellPlainText);
   RUN_TEST(tr, TestClearCell);
+  RUN_TEST(tr, TestChangedCellUnlinksPrecedents);
+  RUN_TEST(tr, TestSetCellEmptyText);
   RUN_TEST(tr, TestFormulaArithmetic);
   RUN_TEST(tr, TestFormulaReferences);
   RUN_TEST(tr, TestFormulaExpressionFormatting);
@@ -377,6 +1740,38 @@ int main() {
   RUN_TEST(tr, TestCellReferences);
   RUN_TEST(tr, TestFormulaIncorrect);
   RUN_TEST(tr, TestCellCircularReferences);
+  RUN_TEST(tr, TestFarAwayCells);
+  RUN_TEST(tr, TestFilledTile);
+  RUN_TEST(tr, TestArenaRecyclesCells);
+  RUN_TEST(tr, TestFormulaChangeInvalidatesDependents);
+  RUN_TEST(tr, TestSharedPrecedentFanOut);
+  RUN_TEST(tr, TestReferenceToUnsetCell);
+  RUN_TEST(tr, TestPrintableSizeFollowsClears);
+  RUN_TEST(tr, TestEqualTextsShareStorage);
+  RUN_TEST(tr, TestSnapshotKeepsOldContents);
+  RUN_TEST(tr, TestSnapshotLongChain);
+  RUN_TEST(tr, TestSnapshotReadOnAnotherThread);
+  RUN_TEST(tr, TestMemoryStatsFollowContents);
+  RUN_TEST(tr, TestValueCacheStaysWithinBudget);
+  RUN_TEST(tr, TestCompiledFormulaMatchesTree);
+  RUN_TEST(tr, TestParserMatchesAntlr);
+  RUN_TEST(tr, TestTextNumbersInFormulas);
+  RUN_TEST(tr, TestDefaultNumericValue);
+  RUN_TEST(tr, TestConstantFolding);
+  RUN_TEST(tr, TestFilledDownFormulasShareTemplate);
+  RUN_TEST(tr, TestFormulaCacheSharesTrees);
+  RUN_TEST(tr, TestDirectLookupMatchesInterface);
+  RUN_TEST(tr, TestFormulaStorageIsFlat);
+  RUN_TEST(tr, TestRangeReferences);
+  RUN_TEST(tr, TestRangeDependentIndex);
+  RUN_TEST(tr, TestAggregateFunctions);
+  RUN_TEST(tr, TestIncrementalCycleDetection);
+  RUN_TEST(tr, TestLongChains);
+  RUN_TEST(tr, TestLongChainsWithoutCache);
+  RUN_TEST(tr, TestRecalculate);
+  RUN_TEST(tr, TestThreadPool);
+  RUN_TEST(tr, TestParallelRecalculate);
+  RUN_TEST(tr, TestDeferredInvalidation);
   LOG(INFO) << "Finish testing";
   return 0;
 }
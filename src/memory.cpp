@@ -0,0 +1,3 @@
+#include "memory.h"
+
+thread_local MemoryCounter* MemoryCounter::current_ = nullptr;
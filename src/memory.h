@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+// Bytes held by one sheet, split by what they are used for. The numbers
+// come from the allocation paths themselves, not from size estimates.
+// Parsed trees live in the global FormulaCache and may be shared with other
+// sheets; each sheet counts the trees it uses in full, so the totals of
+// sheets sharing trees add up to more than they hold together.
+struct MemoryStats {
+  size_t grid = 0;           // tile directory, tiles and occupancy indexes
+  size_t cells = 0;          // cell records
+  size_t text = 0;           // interned strings and their index
+  size_t formulas = 0;       // formula templates and their index
+  size_t formula_trees = 0;  // parsed trees the formulas use
+  size_t dependencies = 0;   // dependency graph nodes and edge lists
+  size_t values = 0;         // formula slots and the value cache
+
+  size_t GetTotal() const {
+    return grid + cells + text + formulas + formula_trees + dependencies +
+           values;
+  }
+};
+
+// Running total of the bytes charged to one category. Snapshots may free
+// shared tiles from the reading thread, so the total is atomic.
+class MemoryCounter {
+ public:
+  void Add(size_t bytes) { bytes_.fetch_add(bytes, std::memory_order_relaxed); }
+  void Subtract(size_t bytes) {
+    bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+  size_t Get() const { return bytes_.load(std::memory_order_relaxed); }
+
+  // Counter of the innermost MemoryScope on this thread, or nullptr.
+  static MemoryCounter* GetCurrent() { return current_; }
+
+ private:
+  friend class MemoryScope;
+
+  static thread_local MemoryCounter* current_;
+
+  std::atomic<size_t> bytes_ = 0;
+};
+
+// Charges allocations that do not name a counter themselves to the given
+// one while the scope is alive. Such memory must be freed under the same
+// counter it was allocated with.
+class MemoryScope {
+ public:
+  explicit MemoryScope(MemoryCounter* counter)
+      : previous_(MemoryCounter::current_) {
+    MemoryCounter::current_ = counter;
+  }
+  MemoryScope(const MemoryScope&) = delete;
+  MemoryScope& operator=(const MemoryScope&) = delete;
+  ~MemoryScope() { MemoryCounter::current_ = previous_; }
+
+ private:
+  MemoryCounter* previous_;
+};
+
+// The counters of one sheet.
+struct MemoryCounters {
+  MemoryCounter grid;
+  MemoryCounter cells;
+  MemoryCounter text;
+  MemoryCounter formulas;
+  MemoryCounter formula_trees;
+  MemoryCounter dependencies;
+  MemoryCounter values;
+
+  MemoryStats GetStats() const {
+    return {grid.Get(),     cells.Get(),         text.Get(),
+            formulas.Get(), formula_trees.Get(), dependencies.Get(),
+            values.Get()};
+  }
+};
+
+// Standard allocator that charges what it hands out to a counter. A default
+// constructed allocator uses the counter of the current MemoryScope, so
+// containers built inside a scope are charged without naming the counter.
+template <typename T>
+class TrackingAllocator {
+ public:
+  using value_type = T;
+
+  TrackingAllocator() noexcept : counter_(MemoryCounter::GetCurrent()) {}
+  explicit TrackingAllocator(MemoryCounter* counter) noexcept
+      : counter_(counter) {}
+  template <typename U>
+  TrackingAllocator(const TrackingAllocator<U>& other) noexcept
+      : counter_(other.GetCounter()) {}
+
+  T* allocate(size_t n) {
+    T* data = std::allocator<T>().allocate(n);
+    if (counter_) {
+      counter_->Add(n * sizeof(T));
+    }
+    return data;
+  }
+
+  void deallocate(T* data, size_t n) {
+    if (counter_) {
+      counter_->Subtract(n * sizeof(T));
+    }
+    std::allocator<T>().deallocate(data, n);
+  }
+
+  MemoryCounter* GetCounter() const { return counter_; }
+
+  template <typename U>
+  bool operator==(const TrackingAllocator<U>& other) const {
+    return counter_ == other.GetCounter();
+  }
+  template <typename U>
+  bool operator!=(const TrackingAllocator<U>& other) const {
+    return counter_ != other.GetCounter();
+  }
+
+ private:
+  MemoryCounter* counter_;
+};
+
+// Base for polymorphic objects that are charged to the current MemoryScope
+// when created with new. Deleting goes through the virtual destructor,
+// which passes the size of the complete object.
+class ScopeTracked {
+ public:
+  static void* operator new(size_t size) {
+    void* object = ::operator new(size);
+    if (MemoryCounter* counter = MemoryCounter::GetCurrent()) {
+      counter->Add(size);
+    }
+    return object;
+  }
+
+  static void operator delete(void* object, size_t size) {
+    if (MemoryCounter* counter = MemoryCounter::GetCurrent()) {
+      counter->Subtract(size);
+    }
+    ::operator delete(object);
+  }
+};
@@ -0,0 +1,64 @@
+#include "numeric_text.h"
+
+#include <charconv>
+
+namespace {
+// The whitespace of the "C" locale.
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+size_t SkipDigits(std::string_view text, size_t pos) {
+  while (pos < text.size() && IsDigit(text[pos])) {
+    ++pos;
+  }
+  return pos;
+}
+}  // namespace
+
+std::optional<double> ParseNumericText(std::string_view text) {
+  size_t begin = 0;
+  while (begin < text.size() && IsSpace(text[begin])) {
+    ++begin;
+  }
+  size_t end = text.size();
+  while (end > begin && IsSpace(text[end - 1])) {
+    --end;
+  }
+  text = text.substr(begin, end - begin);
+
+  // from_chars takes a minus sign but no plus sign.
+  size_t pos = 0;
+  if (!text.empty() && text[0] == '+') {
+    text.remove_prefix(1);
+  } else if (!text.empty() && text[0] == '-') {
+    pos = 1;
+  }
+
+  const size_t integer_end = SkipDigits(text, pos);
+  if (integer_end == pos) {
+    return std::nullopt;
+  }
+  pos = integer_end;
+  if (pos < text.size() && text[pos] == '.') {
+    const size_t fraction_end = SkipDigits(text, pos + 1);
+    if (fraction_end == pos + 1) {
+      return std::nullopt;
+    }
+    pos = fraction_end;
+  }
+  if (pos != text.size()) {
+    return std::nullopt;
+  }
+
+  double number = 0;
+  const auto [ptr, error] =
+      std::from_chars(text.data(), text.data() + text.size(), number);
+  if (error != std::errc() || ptr != text.data() + text.size()) {
+    return std::nullopt;
+  }
+  return number;
+}
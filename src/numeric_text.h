@@ -0,0 +1,10 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+// The number a text stands for when a formula reads it: an optional sign,
+// digits and an optional fraction of digits, with whitespace around, as in
+// "  -12.5 ". Exponents, bare fractions like ".5" and anything else are not
+// numbers. So are the few digit strings too long for a double.
+std::optional<double> ParseNumericText(std::string_view text);
@@ -1,9 +1,11 @@
 #include "sheet.h"
 
 #include <algorithm>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <thread>
 
 #include "cell.h"
 #include "common.h"
@@ -11,7 +13,88 @@
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+namespace {
+// Stands in for cells that are referenced or were set to empty text but
+// hold nothing, so they need no Cell record or grid slot.
+class PlaceholderCell final : public CellInterface {
+ public:
+  Value GetValue() const override { return ""s; }
+  std::string GetText() const override { return {}; }
+  std::vector<Position> GetReferencedCells() const override { return {}; }
+  std::variant<double, FormulaError> GetNumericValue() const override {
+    return FormulaError(FormulaError::Category::Value);
+  }
+};
+
+PlaceholderCell placeholder_cell;
+
+// Finds the cells of one recalculation by key. Open addressing with linear
+// probing over a table at most half full, so a lookup is mostly one probe.
+class KeyIndex {
+ public:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  template <typename Keys>
+  explicit KeyIndex(const Keys& keys) {
+    size_t capacity = 2;
+    while (capacity < keys.size() * 2) {
+      capacity *= 2;
+      --shift_;
+    }
+    slots_.assign(capacity, Slot{});
+    for (uint32_t index = 0; index < keys.size(); ++index) {
+      slots_[Probe(keys[index])] = {keys[index], index};
+    }
+  }
+
+  // Index of the key in the keys, or NONE.
+  uint32_t Find(CellKey key) const {
+    const Slot& slot = slots_[Probe(key)];
+    return slot.key == key ? slot.index : NONE;
+  }
+
+ private:
+  static constexpr CellKey EMPTY = UINT32_MAX;
+
+  struct Slot {
+    CellKey key = EMPTY;
+    uint32_t index = NONE;
+  };
+
+  size_t Probe(CellKey key) const {
+    const size_t mask = slots_.size() - 1;
+    size_t slot = size_t((uint64_t(key) * 0x9E3779B97F4A7C15ull) >> shift_);
+    while (slots_[slot].key != key && slots_[slot].key != EMPTY) {
+      slot = (slot + 1) & mask;
+    }
+    return slot;
+  }
+
+  std::vector<Slot> slots_;
+  int shift_ = 63;
+};
+}  // namespace
+
+Sheet::Sheet()
+    : values_(&memory_.values),
+      arena_(memory_),
+      graph_(&memory_.dependencies),
+      cells_(&memory_.grid),
+      empty_cells_(TrackingAllocator<CellKey>(&memory_.grid)),
+      stale_(TrackingAllocator<CellKey>(&memory_.values)),
+      invalidated_(TrackingAllocator<CellKey>(&memory_.values)) {}
+
+Sheet::~Sheet() {
+  cells_.ForEach([this](Position /* position */, Cell& cell) {
+    arena_.DeleteCell(&cell);
+  });
+
+  for (const Retired& retired : retired_) {
+    for (Cell* cell : retired.cells) {
+      arena_.DeleteCell(cell);
+    }
+  }
+}
 
 void Sheet::SetCell(Position position, std::string text) {
   LOG(DEBUG) << "Set cell " << position.ToString() << " to " << text;
@@ -20,49 +103,53 @@ void Sheet::SetCell(Position position, std::string text) {
     throw InvalidPositionException("Position is not valid.");
   }
 
-  if (position.row >= int(std::size(spreadsheet_))) {
-    LOG(DEBUG) << "Resizing rows to " << position.row + 1;
-    spreadsheet_.resize(position.row + 1);
+  CollectRetired();
+  PruneStale();
+
+  if (text.empty()) {
+    ClearCell(position);
+    empty_cells_.insert(ToCellKey(position));
+    return;
+  }
+
+  Cell* cell = cells_.Get(position);
+  if (cell && !IsShared(*cell)) {
+    cell->Set(std::move(text));
+    return;
   }
 
-  if (position.col >= int(std::size(spreadsheet_[position.row]))) {
-    LOG(DEBUG) << "Resizing cols to " << position.col + 1;
-    spreadsheet_[position.row].resize(position.col + 1);
+  // A shared record stays as it is for the snapshots; the new content goes
+  // into a fresh one.
+  LOG(DEBUG) << "Creating new cell";
+  Cell* fresh = arena_.NewCell(*this, position);
+  try {
+    fresh->Set(std::move(text));
+  } catch (...) {
+    arena_.DeleteCell(fresh);
+    throw;
   }
 
-  if (!spreadsheet_[position.row][position.col]) {
-    LOG(DEBUG) << "Creating new cell";
-    spreadsheet_[position.row][position.col] = std::make_unique<Cell>(*this);
+  cells_.Set(position, fresh);
+  if (cell) {
+    retired_.back().cells.push_back(cell);
   }
 
-  spreadsheet_[position.row][position.col]->Set(std::move(text), position,
-                                                this);
+  empty_cells_.erase(ToCellKey(position));
 }
 
 CellInterface* Sheet::GetCellInterface(Position position) {
-  if (!position.IsValid()) {
-    throw InvalidPositionException("Position is not valid.");
+  if (Cell* cell = GetCell(position)) {
+    return cell;
   }
 
-  return position.row < int(std::size(spreadsheet_)) &&
-                 position.col < int(std::size(spreadsheet_[position.row]))
-             ? spreadsheet_[position.row][position.col].get()
+  const CellKey key = ToCellKey(position);
+  return graph_.HasDependents(key) || empty_cells_.count(key)
+             ? &placeholder_cell
              : nullptr;
 }
 
 const CellInterface* Sheet::GetCellInterface(Position position) const {
-  if (!position.IsValid()) {
-    throw InvalidPositionException("Position is not valid.");
-  }
-
-  if (position.row < int(std::size(spreadsheet_)) &&
-      position.col < int(std::size(spreadsheet_[position.row]))) {
-    return spreadsheet_[position.row][position.col].get()->GetText() == ""
-               ? nullptr
-               : spreadsheet_[position.row][position.col].get();
-  } else {
-    return nullptr;
-  }
+  return GetCell(position);
 }
 
 Cell* Sheet::GetCell(Position position) {
@@ -70,15 +157,15 @@ Cell* Sheet::GetCell(Position position) {
     throw InvalidPositionException("Position is not valid.");
   }
 
-  return position.row < int(std::size(spreadsheet_)) &&
-                 position.col < int(std::size(spreadsheet_[position.row]))
-             ? spreadsheet_[position.row][position.col].get()
-             : nullptr;
+  return cells_.Get(position);
 }
 
 const Cell* Sheet::GetCell(Position position) const {
-  const Cell* result = GetCell(position);
-  return result;
+  if (!position.IsValid()) {
+    throw InvalidPositionException("Position is not valid.");
+  }
+
+  return cells_.Get(position);
 }
 
 void Sheet::ClearCell(Position position) {
@@ -86,72 +173,341 @@ void Sheet::ClearCell(Position position) {
     throw InvalidPositionException("Position is not valid.");
   }
 
-  if (position.row < int(std::size(spreadsheet_)) &&
-      position.col < int(std::size(spreadsheet_[position.row]))) {
-    if (spreadsheet_[position.row][position.col]) {
-      spreadsheet_[position.row][position.col]->Clear();
+  CollectRetired();
+  PruneStale();
 
-      if (!spreadsheet_[position.row][position.col]->IsReferenced()) {
-        spreadsheet_[position.row][position.col].reset();
-      }
+  // Dependents keep their edges to the position in the graph, so the cell
+  // record itself can always go.
+  if (Cell* cell = cells_.Erase(position)) {
+    if (IsShared(*cell)) {
+      // Unlink the position through a stand-in and leave the record to the
+      // snapshots.
+      retired_.back().cells.push_back(cell);
+      cell = arena_.NewCell(*this, position);
     }
+
+    cell->Clear();
+    arena_.DeleteCell(cell);
   }
+
+  empty_cells_.erase(ToCellKey(position));
 }
 
-Size Sheet::GetPrintableSize() const {
-  Size size;
+RecalculationStats Sheet::Recalculate() {
+  const auto start = std::chrono::steady_clock::now();
+  FlushInvalidations();
+
+  // Repeats are off the list by the time they come up again.
+  std::vector<Cell*> cells;
+  cells.reserve(stale_.size());
+  for (CellKey key : stale_) {
+    Cell* cell = cells_.Get(FromCellKey(key));
+    if (cell && cell->Unlist() && cell->IsStale()) {
+      stale_[cells.size()] = key;
+      cells.push_back(cell);
+    }
+  }
+  stale_.resize(cells.size());
+
+  // Ranks order the cells after what they read; cells reading nothing have
+  // none and go first.
+  std::vector<std::pair<uint64_t, uint32_t>> order;
+  order.reserve(cells.size());
+  for (uint32_t index = 0; index < cells.size(); ++index) {
+    const std::optional<uint32_t> rank = graph_.GetRank(stale_[index]);
+    order.emplace_back(rank ? uint64_t(*rank) + 1 : 0, index);
+  }
+  std::sort(order.begin(), order.end());
 
-  for (int row = 0; row < int(std::size(spreadsheet_)); ++row) {
-    for (int col = 0; col < int(std::size(spreadsheet_[row])); ++col) {
-      if (spreadsheet_[row][col]) {
-        if (!spreadsheet_[row][col]->GetText().empty()) {
-          size.rows = std::max(size.rows, row + 1);
-          size.cols = std::max(size.cols, col + 1);
+  // The level of a cell is one more than the highest of the stale cells it
+  // reads, all of which come before it.
+  const KeyIndex index_of(stale_);
+  std::vector<uint32_t> levels(cells.size());
+  RecalculationStats stats;
+  for (const auto& [rank, index] : order) {
+    uint32_t level = 1;
+    auto raise = [&index_of, &levels, &level](CellKey precedent) {
+      const uint32_t found = index_of.Find(precedent);
+      if (found != KeyIndex::NONE) {
+        level = std::max(level, levels[found] + 1);
+      }
+    };
+    const CellKey key = stale_[index];
+    for (CellKey precedent : graph_.GetPrecedents(key)) {
+      raise(precedent);
+    }
+    for (const CellRange& range : graph_.GetRangePrecedents(key)) {
+      graph_.ForEachReaderIn(range, raise);
+    }
+    levels[index] = level;
+    stats.depth = std::max<size_t>(stats.depth, level);
+  }
+
+  // The cells grouped by level, in rank order within each.
+  std::vector<uint32_t> starts(stats.depth + 2);
+  for (uint32_t level : levels) {
+    ++starts[level + 1];
+  }
+  for (size_t level = 1; level < starts.size(); ++level) {
+    starts[level] += starts[level - 1];
+  }
+  std::vector<uint32_t> by_level(cells.size());
+  std::vector<uint32_t> next(starts);
+  for (const auto& [rank, index] : order) {
+    by_level[next[levels[index]]++] = index;
+  }
+
+  if (recalculation_threads_ > 1 && !pool_) {
+    pool_ = std::make_unique<ThreadPool>(recalculation_threads_);
+  }
+  ThreadPool* pool = recalculation_threads_ > 1 ? pool_.get() : nullptr;
+  stats.threads = recalculation_threads_;
+
+  enum class Outcome : uint8_t { Fresh, Evaluated, Missing };
+  std::vector<FormulaInterface::Value> results;
+  std::vector<Outcome> outcomes;
+  for (size_t level = 1; level <= stats.depth; ++level) {
+    const uint32_t* level_cells = by_level.data() + starts[level];
+    const size_t size = starts[level + 1] - starts[level];
+    if (!pool || size <= RECALCULATION_BATCH) {
+      for (size_t i = 0; i < size; ++i) {
+        if (cells[level_cells[i]]->IsStale()) {
+          cells[level_cells[i]]->EvaluateFormula();
+          ++stats.evaluated;
         }
       }
+      continue;
+    }
+
+    results.resize(size);
+    outcomes.assign(size, Outcome::Fresh);
+    pool->ParallelFor(
+        size, RECALCULATION_BATCH,
+        [&cells, level_cells, &results, &outcomes](size_t begin, size_t end,
+                                                    size_t /* thread */) {
+          for (size_t i = begin; i < end; ++i) {
+            const Cell* cell = cells[level_cells[i]];
+            if (!cell->IsStale()) {
+              continue;
+            }
+            try {
+              results[i] = cell->EvaluateConcurrently();
+              outcomes[i] = Outcome::Evaluated;
+            } catch (const SheetReader::MissingValue&) {
+              outcomes[i] = Outcome::Missing;
+            }
+          }
+        });
+
+    // The value cache is not shared between threads, so the results go in
+    // here. Cells that read an evicted result evaluate it on the way now.
+    for (size_t i = 0; i < size; ++i) {
+      if (outcomes[i] == Outcome::Evaluated) {
+        cells[level_cells[i]]->Publish(results[i]);
+        ++stats.evaluated;
+      }
+    }
+    for (size_t i = 0; i < size; ++i) {
+      if (outcomes[i] == Outcome::Missing &&
+          cells[level_cells[i]]->IsStale()) {
+        cells[level_cells[i]]->EvaluateFormula();
+        ++stats.evaluated;
+        ++stats.deferred;
+      }
     }
   }
+  stale_.clear();
+  stale_limit_ = MIN_STALE_LIMIT;
+
+  stats.seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  LOG(DEBUG) << "Recalculated " << stats.evaluated << " formulas in "
+             << stats.depth << " levels on " << stats.threads << " threads";
+  return stats;
+}
 
-  return size;
+void Sheet::SetRecalculationThreads(size_t threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (pool_ && pool_->GetThreadCount() != threads) {
+    pool_.reset();
+  }
+  recalculation_threads_ = threads;
 }
 
+void Sheet::InvalidateDependents(CellKey cell) {
+  if (!invalidated_.empty() && invalidated_.back() == cell) {
+    return;
+  }
+  if (invalidated_.size() == MAX_INVALIDATED) {
+    DropInvalidated();
+  }
+  invalidated_.push_back(cell);
+}
+
+void Sheet::DropInvalidated() {
+  // Dependents never evaluated since they changed cannot have evaluated
+  // dependents either; evicted ones can, so the walk goes on through them.
+  // It keeps its own stack, as chains can be longer than the native one
+  // allows. Cells changed in the meantime are walked once.
+  std::vector<CellKey> pending(invalidated_.begin(), invalidated_.end());
+  invalidated_.clear();
+  std::sort(pending.begin(), pending.end());
+  pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+
+  auto drop = [this, &pending](CellKey dependent) {
+    Cell* cell = cells_.Get(FromCellKey(dependent));
+    if (cell && cell->DropResult()) {
+      pending.push_back(dependent);
+    }
+  };
+  while (!pending.empty()) {
+    const CellKey cell = pending.back();
+    pending.pop_back();
+    for (CellKey dependent : graph_.GetDependents(cell)) {
+      drop(dependent);
+    }
+    graph_.ForEachRangeDependent(cell, drop);
+  }
+}
+
+void Sheet::MarkStale(CellKey cell) { stale_.push_back(cell); }
+
+void Sheet::PruneStale() {
+  if (stale_.size() < stale_limit_) {
+    return;
+  }
+
+  std::sort(stale_.begin(), stale_.end());
+  stale_.erase(std::unique(stale_.begin(), stale_.end()), stale_.end());
+  stale_.erase(std::remove_if(stale_.begin(), stale_.end(),
+                              [this](CellKey key) {
+                                const Cell* cell =
+                                    cells_.Get(FromCellKey(key));
+                                return !cell || !cell->IsListed();
+                              }),
+               stale_.end());
+  stale_limit_ = std::max(MIN_STALE_LIMIT, stale_.size() * 2);
+}
+
+Size Sheet::GetPrintableSize() const { return cells_.GetBounds(); }
+
 void Sheet::PrintValues(std::ostream& output) const {
-  for (int row = 0; row < GetPrintableSize().rows; ++row) {
-    for (int col = 0; col < GetPrintableSize().cols; ++col) {
+  const Size size = GetPrintableSize();
+
+  for (int row = 0; row < size.rows; ++row) {
+    cells_.ForEachInRow(row, size.cols, [&output](int col, const Cell* cell) {
       if (col > 0) {
         output << '\t';
       }
 
-      if (col < int(std::size(spreadsheet_[row]))) {
-        if (spreadsheet_[row][col]) {
-          std::visit([&output](const auto& value) { output << value; },
-                     spreadsheet_[row][col]->GetValue());
-        }
+      if (cell && cell->GetKind() == Cell::Kind::Text) {
+        output << cell->GetTextValue();
+      } else if (cell) {
+        std::visit([&output](const auto& value) { output << value; },
+                   cell->GetValue());
       }
-    }
+    });
 
     output << '\n';
   }
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-  for (int row = 0; row < GetPrintableSize().rows; ++row) {
-    for (int col = 0; col < GetPrintableSize().cols; ++col) {
-      if (col) {
+  const Size size = GetPrintableSize();
+
+  for (int row = 0; row < size.rows; ++row) {
+    cells_.ForEachInRow(row, size.cols, [&output](int col, const Cell* cell) {
+      if (col > 0) {
         output << '\t';
       }
 
-      if (col < int(std::size(spreadsheet_[row]))) {
-        if (spreadsheet_[row][col]) {
-          output << spreadsheet_[row][col]->GetText();
-        }
+      if (cell) {
+        output << cell->GetText();
       }
-    }
+    });
 
     output << '\n';
   }
 }
 
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot() {
+  CollectRetired();
+
+  std::shared_ptr<const SheetSnapshot> snapshot(
+      new SheetSnapshot(cells_.TakeSnapshot()));
+  if (++generation_ == 0) {
+    // Cells keep 16 bits of generation. On wrap-around every cell is marked
+    // as possibly shared, which costs one pass per 65535 snapshots.
+    cells_.ForEach(
+        [](Position /* position */, Cell& cell) { cell.ResetGeneration(); });
+    generation_ = 1;
+  }
+  retired_.push_back({snapshot, {}});
+
+  LOG(DEBUG) << "Snapshot " << generation_ << " taken";
+  return snapshot;
+}
+
+bool Sheet::IsShared(const Cell& cell) const {
+  return cell.GetGeneration() != generation_ && !retired_.empty();
+}
+
+void Sheet::CollectRetired() {
+  while (!retired_.empty() && retired_.front().snapshot.expired()) {
+    for (Cell* cell : retired_.front().cells) {
+      arena_.DeleteCell(cell);
+    }
+    retired_.pop_front();
+  }
+}
+
+double SheetReader::operator()(Position position) const {
+  if (!position.IsValid()) {
+    throw FormulaError(FormulaError::Category::Ref);
+  }
+
+  return Read(sheet_.cells_.Get(position));
+}
+
+void SheetReader::ReadColumn(Position first, int count, double* out) const {
+  if (!first.IsValid()) {
+    throw FormulaError(FormulaError::Category::Ref);
+  }
+
+  // Rows past the end of the sheet are read last, as they come last.
+  const int rows = std::min(count, Position::MAX_ROWS - first.row);
+  sheet_.cells_.ForEachInColumn(
+      first.col, first.row, rows,
+      [this, out, first](int row, const Cell* cell) {
+        out[row - first.row] = Read(cell);
+      });
+  if (rows < count) {
+    throw FormulaError(FormulaError::Category::Ref);
+  }
+}
+
+double SheetReader::Read(const Cell* cell) const {
+  // Unset cells read as 0, including referenced placeholders.
+  if (!cell) {
+    return 0.0;
+  }
+  if (concurrent_) {
+    return cell->GetCachedNumber();
+  }
+  if (results_ && cell->GetKind() == Cell::Kind::Formula) {
+    if (const auto it = results_->find(cell); it != results_->end()) {
+      if (const double* number = std::get_if<double>(&it->second)) {
+        return *number;
+      }
+      throw std::get<FormulaError>(it->second);
+    }
+  }
+  return cell->GetNumber();
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
   return std::make_unique<Sheet>();
 }
\ No newline at end of file
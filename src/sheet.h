@@ -1,13 +1,33 @@
 #pragma once
 
+#include <deque>
 #include <functional>
+#include <memory>
+#include <unordered_set>
 #include <vector>
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "memory.h"
+#include "sheet_snapshot.h"
+#include "storage.h"
+#include "thread_pool.h"
+#include "value_cache.h"
+
+struct RecalculationStats {
+  size_t evaluated = 0;  // formulas evaluated, each once
+  size_t depth = 0;      // longest chain of them reading each other
+  size_t threads = 1;    // that evaluated them
+  // Evaluated again on the calling thread after their level, as a result
+  // they read had been evicted from the value cache.
+  size_t deferred = 0;
+  double seconds = 0;
+};
 
 class Sheet : public SheetInterface {
  public:
+  Sheet();
   ~Sheet();
 
   void SetCell(Position position, std::string text) override;
@@ -20,6 +40,113 @@ class Sheet : public SheetInterface {
   void PrintValues(std::ostream& output) const override;
   void PrintTexts(std::ostream& output) const override;
 
+  // Read-only view of the current contents in O(1); see SheetSnapshot.
+  // Must be called from the thread that writes the sheet.
+  std::shared_ptr<const SheetSnapshot> Snapshot();
+  // Bumped by every snapshot. Zero is never current, see Snapshot.
+  uint16_t GetGeneration() const { return generation_; }
+
+  Cell::Arena& GetArena() { return arena_; }
+  ArenaStats GetArenaStats() const { return arena_.GetStats(); }
+  StringPoolStats GetStringStats() const { return arena_.GetStringStats(); }
+  FormulaTemplateStats GetFormulaTemplateStats() const {
+    return arena_.GetTemplateStats();
+  }
+
+  DependencyGraph& GetGraph() { return graph_; }
+  const DependencyGraph& GetGraph() const { return graph_; }
+
+  // Evaluates every formula left stale by the edits since the last pass,
+  // each once, in dependency order, and caches the results. Reads in
+  // between still evaluate what they need on their own.
+  //
+  // With several threads the cells are grouped into levels, each reading
+  // only cells of lower ones. The cells of a level are evaluated at once
+  // on the pool, and their results are published into the value cache on
+  // the calling thread before the next level starts.
+  RecalculationStats Recalculate();
+  // Threads Recalculate uses, the calling one included; 0 means one per
+  // hardware thread. 1 by default.
+  void SetRecalculationThreads(size_t threads);
+  // Records that the content of the cell changed. Its dependents keep
+  // their results until the next read of a formula or Recalculate, which
+  // drops them in one walk, so repeated edits between reads cost O(1).
+  void InvalidateDependents(CellKey cell);
+  // Drops the results depending on cells changed since the last call; a
+  // check of an empty list if there are none.
+  void FlushInvalidations() {
+    if (!invalidated_.empty()) {
+      DropInvalidated();
+    }
+  }
+  // Records a formula cell whose result was dropped or never computed.
+  // Cells call it once until the next pass, see Cell::IsListed.
+  void MarkStale(CellKey cell);
+
+  // Bounds the bytes spent on evaluated formula results; evicted results
+  // are recomputed on the next read. Unlimited by default.
+  void SetValueCacheBudget(size_t bytes) { values_.SetBudget(bytes); }
+  ValueCacheStats GetValueCacheStats() const { return values_.GetStats(); }
+  ValueCache& GetValueCache() { return values_; }
+
+  // Bytes held by the sheet by category, as counted by its allocators.
+  // Memory of snapshots that is no longer shared with the sheet is not
+  // included.
+  MemoryStats GetMemoryStats() const { return memory_.GetStats(); }
+  MemoryCounters& GetMemory() { return memory_; }
+
  private:
-  std::vector<std::vector<std::unique_ptr<Cell>>> spreadsheet_;
+  friend class SheetReader;
+
+  // Records replaced or cleared while a snapshot may still show them. Each
+  // entry collects what was retired after its snapshot was taken and is
+  // freed once that snapshot and every earlier one are gone.
+  struct Retired {
+    std::weak_ptr<const SheetSnapshot> snapshot;
+    std::vector<Cell*> cells;
+  };
+
+  // Whether a live snapshot may show the cell, so it must not change.
+  bool IsShared(const Cell& cell) const;
+  void CollectRetired();
+  // Drops entries of stale_ left by cells that are gone or repeated, once
+  // it has doubled since the last time. Runs before edits, while every
+  // listed cell is in the storage.
+  void PruneStale();
+  void DropInvalidated();
+
+  static constexpr size_t MIN_STALE_LIMIT = 1024;
+  // Changed cells kept before their dependents are dropped right away.
+  static constexpr size_t MAX_INVALIDATED = 1024;
+  // Cells a thread takes from a level at a time. Levels no larger are
+  // evaluated on the calling thread.
+  static constexpr size_t RECALCULATION_BATCH = 64;
+
+  // Declared first so that it outlives everything charged to it.
+  MemoryCounters memory_;
+  ValueCache values_;
+  Cell::Arena arena_;
+  DependencyGraph graph_;
+  // Only cells with content are stored. Referenced but unset positions
+  // exist solely as keys in graph_, and positions explicitly set to empty
+  // text are remembered here, so neither costs a Cell or a grid slot.
+  CellStorage cells_;
+  std::unordered_set<CellKey, std::hash<CellKey>, std::equal_to<CellKey>,
+                     TrackingAllocator<CellKey>>
+      empty_cells_;
+
+  // Formula cells gone stale since the last Recalculate, some evaluated
+  // since. Cells that were replaced or cleared can leave entries behind;
+  // PruneStale keeps those fewer than the live ones.
+  std::vector<CellKey, TrackingAllocator<CellKey>> stale_;
+  size_t stale_limit_ = MIN_STALE_LIMIT;
+  // Cells changed since the last FlushInvalidations, a repeat of the last
+  // one left out.
+  std::vector<CellKey, TrackingAllocator<CellKey>> invalidated_;
+  size_t recalculation_threads_ = 1;
+  // Started by the first Recalculate on more than one thread.
+  std::unique_ptr<ThreadPool> pool_;
+
+  uint16_t generation_ = 1;
+  std::deque<Retired> retired_;
 };
\ No newline at end of file
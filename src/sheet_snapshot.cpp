@@ -0,0 +1,165 @@
+#include "sheet_snapshot.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <variant>
+
+#include "cell.h"
+
+void SheetSnapshot::SetCell(Position /* position */, std::string /* text */) {
+  throw std::logic_error("Sheet snapshots are read-only");
+}
+
+CellInterface* SheetSnapshot::GetCellInterface(Position position) {
+  return const_cast<CellView*>(GetView(position));
+}
+
+const CellInterface* SheetSnapshot::GetCellInterface(Position position) const {
+  return GetView(position);
+}
+
+void SheetSnapshot::ClearCell(Position /* position */) {
+  throw std::logic_error("Sheet snapshots are read-only");
+}
+
+Size SheetSnapshot::GetPrintableSize() const { return cells_.GetBounds(); }
+
+void SheetSnapshot::PrintValues(std::ostream& output) const {
+  const Size size = GetPrintableSize();
+
+  for (int row = 0; row < size.rows; ++row) {
+    cells_.ForEachInRow(row, size.cols, [&](int col, const Cell* cell) {
+      if (col > 0) {
+        output << '\t';
+      }
+
+      if (cell && cell->GetKind() == Cell::Kind::Text) {
+        output << cell->GetTextValue();
+      } else if (cell) {
+        std::visit([&output](const auto& value) { output << value; },
+                   GetView({row, col})->GetValue());
+      }
+    });
+
+    output << '\n';
+  }
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& output) const {
+  const Size size = GetPrintableSize();
+
+  for (int row = 0; row < size.rows; ++row) {
+    cells_.ForEachInRow(row, size.cols, [&output](int col, const Cell* cell) {
+      if (col > 0) {
+        output << '\t';
+      }
+
+      if (cell) {
+        output << cell->GetText();
+      }
+    });
+
+    output << '\n';
+  }
+}
+
+const SheetSnapshot::CellView* SheetSnapshot::GetView(
+    Position position) const {
+  if (!position.IsValid()) {
+    throw InvalidPositionException("Position is not valid.");
+  }
+
+  const Cell* cell = cells_.Get(position);
+  if (!cell) {
+    return nullptr;
+  }
+
+  return &views_.try_emplace(ToCellKey(position), *this, *cell).first->second;
+}
+
+CellInterface::Value SheetSnapshot::CellView::GetValue() const {
+  // Text needs no evaluation, and the formula cache of the cell belongs to
+  // the live sheet.
+  const FormulaInterface* formula = cell_.GetFormula();
+  if (!formula) {
+    return cell_.GetValue();
+  }
+
+  return std::visit([](const auto& value) { return Value(value); },
+                    Evaluate(*formula));
+}
+
+std::variant<double, FormulaError>
+SheetSnapshot::CellView::GetNumericValue() const {
+  const FormulaInterface* formula = cell_.GetFormula();
+  return formula ? Evaluate(*formula) : cell_.GetNumericValue();
+}
+
+const FormulaInterface::Value& SheetSnapshot::CellView::Evaluate(
+    const FormulaInterface& formula) const {
+  if (!value_) {
+    EvaluatePrecedents();
+    value_ = formula.Evaluate(snapshot_);
+  }
+  return *value_;
+}
+
+void SheetSnapshot::CellView::EvaluatePrecedents() const {
+  // Reading a precedent without a value from inside Evaluate would recurse
+  // once per link of a chain, so the walk keeps its own stack. A view is
+  // evaluated when it comes up the second time, after its precedents. The
+  // snapshot has no graph of its own, so the precedents come from the
+  // formulas.
+  struct Entry {
+    const CellView* view;
+    bool expanded;
+  };
+  std::vector<Entry> pending;
+  auto push = [this, &pending](Position position) {
+    const CellView* view = snapshot_.GetView(position);
+    if (view && view->cell_.GetFormula() && !view->value_) {
+      pending.push_back({view, false});
+    }
+  };
+  const Size bounds = snapshot_.GetPrintableSize();
+  auto push_precedents = [&push, bounds](const CellView& view) {
+    const FormulaReferences references =
+        view.cell_.GetFormula()->GetReferences();
+    for (Position cell : references.cells) {
+      push(cell);
+    }
+    // Cells past the bounds are unset.
+    for (const CellRange& range : references.ranges) {
+      const int last_row = std::min(range.last.row, bounds.rows - 1);
+      const int last_col = std::min(range.last.col, bounds.cols - 1);
+      for (int row = range.first.row; row <= last_row; ++row) {
+        for (int col = range.first.col; col <= last_col; ++col) {
+          push({row, col});
+        }
+      }
+    }
+  };
+
+  push_precedents(*this);
+  while (!pending.empty()) {
+    const Entry top = pending.back();
+    if (top.view->value_) {
+      pending.pop_back();
+    } else if (!top.expanded) {
+      pending.back().expanded = true;
+      push_precedents(*top.view);
+    } else {
+      pending.pop_back();
+      top.view->value_ = top.view->cell_.GetFormula()->Evaluate(snapshot_);
+    }
+  }
+}
+
+std::string SheetSnapshot::CellView::GetText() const {
+  return cell_.GetText();
+}
+
+std::vector<Position> SheetSnapshot::CellView::GetReferencedCells() const {
+  return cell_.GetReferencedCells();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "dependency_graph.h"
+#include "formula.h"
+#include "storage.h"
+
+class Cell;
+
+// Read-only view of a sheet at the moment Sheet::Snapshot was called. It
+// shares tiles and cell records with the sheet instead of copying them and
+// evaluates formulas against itself into its own memo, so the caches of the
+// live sheet are never touched. One thread at a time may read a snapshot
+// while another keeps writing the sheet; reads log nothing, as the log is
+// not thread-safe. A snapshot must not outlive its sheet, and writing
+// through the SheetInterface throws.
+class SheetSnapshot : public SheetInterface {
+ public:
+  void SetCell(Position position, std::string text) override;
+  CellInterface* GetCellInterface(Position position) override;
+  const CellInterface* GetCellInterface(Position position) const override;
+  void ClearCell(Position position) override;
+  Size GetPrintableSize() const override;
+  void PrintValues(std::ostream& output) const override;
+  void PrintTexts(std::ostream& output) const override;
+
+ private:
+  friend class Sheet;
+
+  class CellView final : public CellInterface {
+   public:
+    CellView(const SheetSnapshot& snapshot, const Cell& cell)
+        : snapshot_(snapshot), cell_(cell) {}
+
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+    std::variant<double, FormulaError> GetNumericValue() const override;
+
+   private:
+    const FormulaInterface::Value& Evaluate(
+        const FormulaInterface& formula) const;
+    // Memoizes the formulas the cell reads that have no value yet,
+    // precedents first, so its own evaluation finds them all.
+    void EvaluatePrecedents() const;
+
+    const SheetSnapshot& snapshot_;
+    const Cell& cell_;
+    mutable std::optional<FormulaInterface::Value> value_;
+  };
+
+  explicit SheetSnapshot(CellStorage::Snapshot cells)
+      : cells_(std::move(cells)) {}
+
+  const CellView* GetView(Position position) const;
+
+  CellStorage::Snapshot cells_;
+  mutable std::unordered_map<CellKey, CellView> views_;
+};
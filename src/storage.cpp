@@ -0,0 +1,213 @@
+#include "storage.h"
+
+#include "log/easylogging++.h"
+
+CellStorage::CellStorage(MemoryCounter* counter)
+    : counter_(counter),
+      tiles_(std::allocate_shared<Directory>(
+          TrackingAllocator<Directory>(counter),
+          Directory::allocator_type(counter))),
+      row_occupancy_(Occupancy::allocator_type(counter)),
+      col_occupancy_(Occupancy::allocator_type(counter)) {}
+
+CellStorage::~CellStorage() = default;
+
+CellStorage::Snapshot CellStorage::TakeSnapshot() const {
+  return {tiles_, GetBounds()};
+}
+
+Cell* CellStorage::Get(Position position) const {
+  return Get(*tiles_, position);
+}
+
+Cell* CellStorage::Snapshot::Get(Position position) const {
+  return CellStorage::Get(*tiles_, position);
+}
+
+void CellStorage::Set(Position position, Cell* cell) {
+  auto& tile = GetMutableTiles()[GetTileKey(position.row / TILE_SIZE,
+                                            position.col / TILE_SIZE)];
+  if (!tile) {
+    LOG(DEBUG) << "Allocating tile for " << position.ToString();
+    tile = std::allocate_shared<Tile>(TrackingAllocator<Tile>(counter_),
+                                      counter_);
+  }
+
+  Tile& mutable_tile = GetMutableTile(tile);
+  if (!mutable_tile.Get(GetOffset(position))) {
+    ++cell_count_;
+    Occupy(row_occupancy_, position.row);
+    Occupy(col_occupancy_, position.col);
+  }
+
+  mutable_tile.Set(GetOffset(position), cell);
+}
+
+Cell* CellStorage::Erase(Position position) {
+  if (!Get(position)) {
+    return nullptr;
+  }
+
+  Directory& tiles = GetMutableTiles();
+  auto it = tiles.find(
+      GetTileKey(position.row / TILE_SIZE, position.col / TILE_SIZE));
+
+  Tile& tile = GetMutableTile(it->second);
+  Cell* cell = tile.Erase(GetOffset(position));
+  --cell_count_;
+  Vacate(row_occupancy_, position.row);
+  Vacate(col_occupancy_, position.col);
+
+  if (tile.IsEmpty()) {
+    LOG(DEBUG) << "Releasing tile for " << position.ToString();
+    tiles.erase(it);
+  }
+
+  return cell;
+}
+
+Size CellStorage::GetBounds() const {
+  if (cell_count_ == 0) {
+    return {};
+  }
+
+  return {row_occupancy_.rbegin()->first + 1,
+          col_occupancy_.rbegin()->first + 1};
+}
+
+const CellStorage::Tile* CellStorage::FindTile(const Directory& tiles,
+                                               int tile_row, int tile_col) {
+  auto it = tiles.find(GetTileKey(tile_row, tile_col));
+  return it == tiles.end() ? nullptr : it->second.get();
+}
+
+Cell* CellStorage::Get(const Directory& tiles, Position position) {
+  const Tile* tile =
+      FindTile(tiles, position.row / TILE_SIZE, position.col / TILE_SIZE);
+  return tile ? tile->Get(GetOffset(position)) : nullptr;
+}
+
+CellStorage::Directory& CellStorage::GetMutableTiles() {
+  if (tiles_.use_count() > 1) {
+    LOG(DEBUG) << "Copying tile directory shared with a snapshot";
+    tiles_ = std::allocate_shared<Directory>(
+        TrackingAllocator<Directory>(counter_), *tiles_);
+  }
+  return *tiles_;
+}
+
+CellStorage::Tile& CellStorage::GetMutableTile(std::shared_ptr<Tile>& tile) {
+  if (tile.use_count() > 1) {
+    LOG(DEBUG) << "Copying tile shared with a snapshot";
+    tile = std::allocate_shared<Tile>(
+        TrackingAllocator<Tile>(counter_), *tile);
+  }
+  return *tile;
+}
+
+void CellStorage::Occupy(Occupancy& occupancy, int index) {
+  ++occupancy[index];
+}
+
+void CellStorage::Vacate(Occupancy& occupancy, int index) {
+  auto it = occupancy.find(index);
+  if (--it->second == 0) {
+    occupancy.erase(it);
+  }
+}
+
+CellStorage::Tile::Tile(MemoryCounter* counter)
+    : sparse_(TrackingAllocator<Entry>(counter)),
+      dense_(TrackingAllocator<Cell*>(counter)) {}
+
+CellStorage::Tile::Tile(const Tile& other)
+    : sparse_(other.sparse_), dense_(other.dense_), count_(other.count_) {}
+
+Cell* CellStorage::Tile::Get(int offset) const {
+  if (IsDense()) {
+    return dense_[offset];
+  }
+
+  auto it = std::lower_bound(
+      sparse_.begin(), sparse_.end(), offset,
+      [](const Entry& entry, int value) { return entry.first < value; });
+  return it != sparse_.end() && it->first == offset ? it->second : nullptr;
+}
+
+void CellStorage::Tile::Set(int offset, Cell* cell) {
+  if (IsDense()) {
+    if (!dense_[offset]) {
+      ++count_;
+    }
+    dense_[offset] = cell;
+    return;
+  }
+
+  auto it = std::lower_bound(
+      sparse_.begin(), sparse_.end(), offset,
+      [](const Entry& entry, int value) { return entry.first < value; });
+  if (it != sparse_.end() && it->first == offset) {
+    it->second = cell;
+    return;
+  }
+
+  sparse_.emplace(it, uint16_t(offset), cell);
+  ++count_;
+
+  if (count_ > SPARSE_LIMIT) {
+    MakeDense();
+  }
+}
+
+Cell* CellStorage::Tile::Erase(int offset) {
+  if (IsDense()) {
+    Cell* cell = std::exchange(dense_[offset], nullptr);
+    if (!cell) {
+      return nullptr;
+    }
+
+    --count_;
+    if (count_ < SPARSE_LIMIT / 2) {
+      MakeSparse();
+    }
+    return cell;
+  }
+
+  auto it = std::lower_bound(
+      sparse_.begin(), sparse_.end(), offset,
+      [](const Entry& entry, int value) { return entry.first < value; });
+  if (it == sparse_.end() || it->first != offset) {
+    return nullptr;
+  }
+
+  Cell* cell = it->second;
+  sparse_.erase(it);
+  --count_;
+  return cell;
+}
+
+void CellStorage::Tile::MakeDense() {
+  LOG(DEBUG) << "Tile becomes dense";
+  dense_.assign(CELLS, nullptr);
+
+  for (const auto& [offset, cell] : sparse_) {
+    dense_[offset] = cell;
+  }
+
+  sparse_.clear();
+  sparse_.shrink_to_fit();
+}
+
+void CellStorage::Tile::MakeSparse() {
+  LOG(DEBUG) << "Tile becomes sparse";
+  sparse_.reserve(count_);
+
+  for (int offset = 0; offset < CELLS; ++offset) {
+    if (dense_[offset]) {
+      sparse_.emplace_back(uint16_t(offset), dense_[offset]);
+    }
+  }
+
+  dense_.clear();
+  dense_.shrink_to_fit();
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "memory.h"
+
+class Cell;
+
+// Sparse grid of cells split into TILE_SIZE x TILE_SIZE tiles. Only tiles that
+// hold at least one cell are allocated, so memory follows the number of
+// occupied tiles instead of the bounding box of the sheet. A tile starts as a
+// short sorted list and switches to a dense array once it fills up.
+// The storage indexes cells but does not own them.
+//
+// Tiles and the tile directory are shared with snapshots and copied on the
+// first write after a snapshot, so taking one is O(1) and later writes pay
+// only for the tiles they touch. The directory, tiles and occupancy counts
+// are charged to the counter, if one is given.
+class CellStorage {
+ private:
+  class Tile;
+  using Directory = std::unordered_map<
+      uint32_t, std::shared_ptr<Tile>, std::hash<uint32_t>,
+      std::equal_to<uint32_t>,
+      TrackingAllocator<std::pair<const uint32_t, std::shared_ptr<Tile>>>>;
+  using Occupancy =
+      std::map<int, uint32_t, std::less<int>,
+               TrackingAllocator<std::pair<const int, uint32_t>>>;
+
+ public:
+  static constexpr int TILE_SIZE = 64;
+
+  // Read-only view of the storage as it was when the snapshot was taken.
+  class Snapshot {
+   public:
+    Cell* Get(Position position) const;
+
+    template <typename Function>
+    void ForEachInRow(int row, int cols, Function function) const;
+
+    Size GetBounds() const { return bounds_; }
+
+   private:
+    friend class CellStorage;
+
+    Snapshot(std::shared_ptr<const Directory> tiles, Size bounds)
+        : tiles_(std::move(tiles)), bounds_(bounds) {}
+
+    std::shared_ptr<const Directory> tiles_;
+    Size bounds_;
+  };
+
+  explicit CellStorage(MemoryCounter* counter = nullptr);
+  ~CellStorage();
+
+  Snapshot TakeSnapshot() const;
+
+  Cell* Get(Position position) const;
+  void Set(Position position, Cell* cell);
+  Cell* Erase(Position position);
+
+  // Calls function(col, cell) for every col in [0, cols) of the row, passing
+  // nullptr for missing cells. Walks the row one tile band at a time.
+  template <typename Function>
+  void ForEachInRow(int row, int cols, Function function) const;
+
+  // Calls function(row, cell) for every row in [row, row + rows) of the
+  // column, passing nullptr for missing cells. Finds each tile once.
+  template <typename Function>
+  void ForEachInColumn(int col, int row, int rows, Function function) const;
+
+  template <typename Function>
+  void ForEach(Function function) const;
+
+  // Smallest size covering every stored cell, kept up to date by Set and
+  // Erase through per-row and per-column occupancy counts.
+  Size GetBounds() const;
+
+  size_t GetCellCount() const { return cell_count_; }
+  size_t GetTileCount() const { return tiles_->size(); }
+
+ private:
+  class Tile {
+   public:
+    explicit Tile(MemoryCounter* counter);
+    Tile(const Tile& other);
+    Tile& operator=(const Tile&) = delete;
+
+    Cell* Get(int offset) const;
+    void Set(int offset, Cell* cell);
+    Cell* Erase(int offset);
+
+    bool IsEmpty() const { return count_ == 0; }
+    bool IsDense() const { return !dense_.empty(); }
+
+    template <typename Function>
+    void ForEach(Function function) const;
+
+   private:
+    static constexpr size_t SPARSE_LIMIT = 64;
+    static constexpr int CELLS = TILE_SIZE * TILE_SIZE;
+
+    using Entry = std::pair<uint16_t, Cell*>;
+
+    void MakeDense();
+    void MakeSparse();
+
+    std::vector<Entry, TrackingAllocator<Entry>> sparse_;
+    // All CELLS slots once the tile is dense, empty before.
+    std::vector<Cell*, TrackingAllocator<Cell*>> dense_;
+    size_t count_ = 0;
+  };
+
+  static uint32_t GetTileKey(int tile_row, int tile_col) {
+    return uint32_t(tile_row) << 16 | uint32_t(tile_col);
+  }
+
+  static int GetOffset(Position position) {
+    return position.row % TILE_SIZE * TILE_SIZE + position.col % TILE_SIZE;
+  }
+
+  static const Tile* FindTile(const Directory& tiles, int tile_row,
+                              int tile_col);
+  static Cell* Get(const Directory& tiles, Position position);
+  template <typename Function>
+  static void ForEachInRow(const Directory& tiles, int row, int cols,
+                           Function function);
+
+  // Copy the directory or a tile first if a snapshot still shares it.
+  Directory& GetMutableTiles();
+  Tile& GetMutableTile(std::shared_ptr<Tile>& tile);
+
+  static void Occupy(Occupancy& occupancy, int index);
+  static void Vacate(Occupancy& occupancy, int index);
+
+  MemoryCounter* counter_;
+  std::shared_ptr<Directory> tiles_;
+  Occupancy row_occupancy_;
+  Occupancy col_occupancy_;
+  size_t cell_count_ = 0;
+};
+
+template <typename Function>
+void CellStorage::ForEachInRow(int row, int cols, Function function) const {
+  ForEachInRow(*tiles_, row, cols, function);
+}
+
+template <typename Function>
+void CellStorage::Snapshot::ForEachInRow(int row, int cols,
+                                         Function function) const {
+  CellStorage::ForEachInRow(*tiles_, row, cols, function);
+}
+
+template <typename Function>
+void CellStorage::ForEachInRow(const Directory& tiles, int row, int cols,
+                               Function function) {
+  for (int first = 0; first < cols; first += TILE_SIZE) {
+    const Tile* tile = FindTile(tiles, row / TILE_SIZE, first / TILE_SIZE);
+    const int last = std::min(cols, first + TILE_SIZE);
+
+    for (int col = first; col < last; ++col) {
+      function(col, tile ? tile->Get(GetOffset({row, col})) : nullptr);
+    }
+  }
+}
+
+template <typename Function>
+void CellStorage::ForEachInColumn(int col, int row, int rows,
+                                  Function function) const {
+  const int end = row + rows;
+  while (row < end) {
+    const Tile* tile = FindTile(*tiles_, row / TILE_SIZE, col / TILE_SIZE);
+    const int last = std::min(end, (row / TILE_SIZE + 1) * TILE_SIZE);
+
+    for (; row < last; ++row) {
+      function(row, tile ? tile->Get(GetOffset({row, col})) : nullptr);
+    }
+  }
+}
+
+template <typename Function>
+void CellStorage::ForEach(Function function) const {
+  for (const auto& [key, tile] : *tiles_) {
+    const int row = int(key >> 16) * TILE_SIZE;
+    const int col = int(key & 0xFFFF) * TILE_SIZE;
+
+    tile->ForEach([&](int offset, Cell& cell) {
+      function(Position{row + offset / TILE_SIZE, col + offset % TILE_SIZE},
+               cell);
+    });
+  }
+}
+
+template <typename Function>
+void CellStorage::Tile::ForEach(Function function) const {
+  if (IsDense()) {
+    for (int offset = 0; offset < CELLS; ++offset) {
+      if (Cell* cell = dense_[offset]) {
+        function(offset, *cell);
+      }
+    }
+  } else {
+    for (const auto& [offset, cell] : sparse_) {
+      function(int(offset), *cell);
+    }
+  }
+}
@@ -0,0 +1,70 @@
+#include "string_pool.h"
+
+#include <utility>
+
+#include "common.h"
+#include "numeric_text.h"
+
+StringPool::Entry::Entry(std::string_view content, MemoryCounter* counter)
+    : text(content.begin(), content.end(), TrackingAllocator<char>(counter)) {
+  std::string_view value = content;
+  if (!value.empty() && value.front() == ESCAPE_SIGN) {
+    value.remove_prefix(1);
+  }
+  if (const std::optional<double> parsed = ParseNumericText(value)) {
+    number = *parsed;
+    is_number = true;
+  }
+}
+
+StringPool::StringPool(MemoryCounter* counter)
+    : counter_(counter),
+      entries_(counter),
+      index_(Index::allocator_type(counter)) {}
+
+StringPool::~StringPool() {
+  for (auto& [text, entry] : index_) {
+    entries_.Delete(entry);
+  }
+}
+
+const StringPool::Entry* StringPool::Intern(std::string_view text) {
+  auto it = index_.find(text);
+  if (it == index_.end()) {
+    Entry* entry = entries_.New(text, counter_);
+    it = index_.emplace(std::string_view(entry->text), entry).first;
+    bytes_ += entry->text.size();
+  }
+
+  Entry* entry = it->second;
+  ++entry->references;
+  ++references_;
+  referenced_bytes_ += entry->text.size();
+  return entry;
+}
+
+void StringPool::Release(const Entry* entry) {
+  if (!entry) {
+    return;
+  }
+
+  // Every entry handed out is owned by this pool.
+  Entry* owned = const_cast<Entry*>(entry);
+  --references_;
+  referenced_bytes_ -= owned->text.size();
+
+  if (--owned->references == 0) {
+    bytes_ -= owned->text.size();
+    index_.erase(std::string_view(owned->text));
+    entries_.Delete(owned);
+  }
+}
+
+StringPoolStats StringPool::GetStats() const {
+  StringPoolStats stats;
+  stats.strings = index_.size();
+  stats.references = references_;
+  stats.bytes = bytes_;
+  stats.shared_bytes = referenced_bytes_ - bytes_;
+  return stats;
+}
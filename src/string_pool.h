@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "arena.h"
+#include "memory.h"
+
+struct StringPoolStats {
+  size_t strings = 0;      // distinct strings held
+  size_t references = 0;   // handles given out and not yet released
+  size_t bytes = 0;        // characters stored, once per distinct string
+  size_t shared_bytes = 0; // characters that duplicates did not store again
+};
+
+// Reference-counted set of distinct strings. Equal texts share one entry,
+// which keeps its address until the last reference is released, so holders
+// can keep a plain pointer and read the text without copying. Entries, their
+// texts and the index are charged to the counter, if one is given.
+class StringPool {
+ public:
+  using Text =
+      std::basic_string<char, std::char_traits<char>, TrackingAllocator<char>>;
+
+  struct Entry {
+    Entry(std::string_view content, MemoryCounter* counter);
+
+    // What a formula reading the text gets, worked out once per distinct
+    // text. Texts are cell contents, so a leading escape sign is skipped.
+    std::optional<double> GetNumber() const {
+      return is_number ? std::optional<double>(number) : std::nullopt;
+    }
+
+    Text text;
+    double number = 0;
+    uint32_t references = 0;
+    bool is_number = false;
+  };
+
+  explicit StringPool(MemoryCounter* counter = nullptr);
+  StringPool(const StringPool&) = delete;
+  StringPool& operator=(const StringPool&) = delete;
+  ~StringPool();
+
+  const Entry* Intern(std::string_view text);
+  void Release(const Entry* entry);
+
+  StringPoolStats GetStats() const;
+  const ArenaStats& GetArenaStats() const { return entries_.GetStats(); }
+
+ private:
+  using Index = std::unordered_map<
+      std::string_view, Entry*, std::hash<std::string_view>,
+      std::equal_to<std::string_view>,
+      TrackingAllocator<std::pair<const std::string_view, Entry*>>>;
+
+  MemoryCounter* counter_;
+  SlabAllocator<Entry> entries_;
+  // Keys view the text of their own entry.
+  Index index_;
+  size_t references_ = 0;
+  size_t bytes_ = 0;
+  size_t referenced_bytes_ = 0;
+};
@@ -1,8 +1,9 @@
 #include <algorithm>
 #include <cctype>
-#include <sstream>
+#include <charconv>
 
 #include "common.h"
+#include "numeric_text.h"
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -26,16 +27,20 @@ std::string Position::ToString() const {
     return "";
   }
 
-  std::string result;
-  result.reserve(MAX_POSITION_LENGTH);
-  int c = col;
+  // Built back to front in a local buffer: at most 3 letters and 5 digits, so
+  // the result fits the small string buffer and costs no allocation.
+  char buffer[MAX_POSITION_LENGTH];
+  char* begin = buffer + MAX_POSITION_LENGTH;
 
-  while (c >= 0) {
-    result.insert(result.begin(), 'A' + c % LETTERS);
-    c = c / LETTERS - 1;
+  for (int r = row + 1; r > 0; r /= 10) {
+    *--begin = char('0' + r % 10);
   }
 
-  return result + std::to_string(row + 1);
+  for (int c = col; c >= 0; c = c / LETTERS - 1) {
+    *--begin = char('A' + c % LETTERS);
+  }
+
+  return std::string(begin, buffer + MAX_POSITION_LENGTH);
 }
 
 Position Position::FromString(std::string_view str) {
@@ -52,8 +57,9 @@ Position Position::FromString(std::string_view str) {
   }
 
   int row;
-  std::istringstream row_in{std::string{digits}};
-  if (!(row_in >> row) || !row_in.eof()) {
+  const char* digits_end = digits.data() + digits.size();
+  const auto [end, error] = std::from_chars(digits.data(), digits_end, row);
+  if (error != std::errc() || end != digits_end) {
     return Position::NONE;
   }
 
@@ -69,3 +75,43 @@ Position Position::FromString(std::string_view str) {
 bool Size::operator==(Size rhs) const {
   return cols == rhs.cols && rows == rhs.rows;
 }
+
+bool CellRange::operator==(CellRange rhs) const {
+  return first == rhs.first && last == rhs.last;
+}
+
+bool CellRange::operator<(CellRange rhs) const {
+  return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool CellRange::Contains(Position position) const {
+  return position.row >= first.row && position.row <= last.row &&
+         position.col >= first.col && position.col <= last.col;
+}
+
+size_t CellRange::GetSize() const {
+  return size_t(last.row - first.row + 1) * size_t(last.col - first.col + 1);
+}
+
+std::string CellRange::ToString() const {
+  return first.ToString() + ':' + last.ToString();
+}
+
+CellRange CellRange::FromCorners(Position a, Position b) {
+  return {{std::min(a.row, b.row), std::min(a.col, b.col)},
+          {std::max(a.row, b.row), std::max(a.col, b.col)}};
+}
+
+std::variant<double, FormulaError> CellInterface::GetNumericValue() const {
+  const Value value = GetValue();
+  if (const auto* text = std::get_if<std::string>(&value)) {
+    if (const std::optional<double> number = ParseNumericText(*text)) {
+      return *number;
+    }
+    return FormulaError(FormulaError::Category::Value);
+  }
+  if (const auto* error = std::get_if<FormulaError>(&value)) {
+    return *error;
+  }
+  return std::get<double>(value);
+}
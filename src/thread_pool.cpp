@@ -0,0 +1,144 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t threads) : slices_(std::max<size_t>(threads, 1)) {
+  workers_.reserve(slices_.size() - 1);
+  for (size_t thread = 1; thread < slices_.size(); ++thread) {
+    workers_.emplace_back([this, thread] { Work(thread); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  started_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t batch,
+                             const Function& function) {
+  assert(count <= UINT32_MAX);
+  batch = std::max<size_t>(batch, 1);
+  if (count <= batch || workers_.empty()) {
+    function(0, count, 0);
+    return;
+  }
+
+  const size_t threads = slices_.size();
+  for (size_t thread = 0; thread < threads; ++thread) {
+    const uint64_t front = count * thread / threads;
+    const uint64_t back = count * (thread + 1) / threads;
+    slices_[thread].range.store(back << 32 | front, std::memory_order_relaxed);
+  }
+  function_ = &function;
+  batch_ = batch;
+  error_ = nullptr;
+  {
+    std::lock_guard lock(mutex_);
+    running_ = workers_.size();
+    ++generation_;
+  }
+  started_.notify_all();
+
+  RunLoop(0);
+
+  std::unique_lock lock(mutex_);
+  finished_.wait(lock, [this] { return running_ == 0; });
+  function_ = nullptr;
+  if (error_) {
+    std::rethrow_exception(std::exchange(error_, nullptr));
+  }
+}
+
+void ThreadPool::Work(size_t thread) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock lock(mutex_);
+      started_.wait(lock,
+                    [this, seen] { return stopping_ || generation_ != seen; });
+      if (stopping_) {
+        return;
+      }
+      seen = generation_;
+    }
+
+    RunLoop(thread);
+
+    std::lock_guard lock(mutex_);
+    if (--running_ == 0) {
+      finished_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::RunLoop(size_t thread) {
+  size_t begin;
+  size_t end;
+  auto run = [this, thread, &begin, &end] {
+    try {
+      (*function_)(begin, end, thread);
+    } catch (...) {
+      std::lock_guard lock(mutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+    }
+  };
+
+  while (TakeFront(slices_[thread], begin, end)) {
+    run();
+  }
+  for (size_t offset = 1; offset < slices_.size(); ++offset) {
+    Slice& victim = slices_[(thread + offset) % slices_.size()];
+    while (TakeBack(victim, begin, end)) {
+      steals_.fetch_add(1, std::memory_order_relaxed);
+      run();
+    }
+  }
+}
+
+bool ThreadPool::TakeFront(Slice& slice, size_t& begin, size_t& end) const {
+  uint64_t range = slice.range.load(std::memory_order_relaxed);
+  while (true) {
+    const uint32_t front = uint32_t(range);
+    const uint32_t back = uint32_t(range >> 32);
+    if (front >= back) {
+      return false;
+    }
+    const uint32_t count = uint32_t(std::min<size_t>(batch_, back - front));
+    const uint32_t next = front + count;
+    if (slice.range.compare_exchange_weak(range, uint64_t(back) << 32 | next,
+                                          std::memory_order_relaxed)) {
+      begin = front;
+      end = next;
+      return true;
+    }
+  }
+}
+
+bool ThreadPool::TakeBack(Slice& slice, size_t& begin, size_t& end) const {
+  uint64_t range = slice.range.load(std::memory_order_relaxed);
+  while (true) {
+    const uint32_t front = uint32_t(range);
+    const uint32_t back = uint32_t(range >> 32);
+    if (front >= back) {
+      return false;
+    }
+    const uint32_t count = uint32_t(std::min<size_t>(batch_, back - front));
+    const uint32_t next = back - count;
+    if (slice.range.compare_exchange_weak(range, uint64_t(next) << 32 | front,
+                                          std::memory_order_relaxed)) {
+      begin = next;
+      end = back;
+      return true;
+    }
+  }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that run parallel loops together with the calling thread.
+// A loop is cut into one slice per thread. Each thread takes batches from
+// the front of its own slice and, once that is empty, steals batches from
+// the back of the others, so uneven work evens out without a shared queue.
+// One loop runs at a time.
+class ThreadPool {
+ public:
+  // Called with a batch [begin, end) and the index of the thread running
+  // it, below GetThreadCount(), for per-thread state.
+  using Function = std::function<void(size_t begin, size_t end, size_t thread)>;
+
+  // The count includes the calling thread, so 1 starts no workers.
+  explicit ThreadPool(size_t threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t GetThreadCount() const { return slices_.size(); }
+  // Batches taken from the slice of another thread so far.
+  size_t GetSteals() const { return steals_; }
+
+  // Calls the function on batches of at most batch items covering
+  // [0, count) once each and returns when all are done. Loops of one batch
+  // run on the calling thread alone. The first exception thrown by the
+  // function is rethrown here, after the other batches ran.
+  void ParallelFor(size_t count, size_t batch, const Function& function);
+
+ private:
+  // The unclaimed part of a slice: its front in the low 32 bits and its
+  // back in the high ones, so both ends move with one compare-and-swap.
+  struct alignas(64) Slice {
+    std::atomic<uint64_t> range{0};
+  };
+
+  void Work(size_t thread);
+  // Runs batches until every slice is empty.
+  void RunLoop(size_t thread);
+  bool TakeFront(Slice& slice, size_t& begin, size_t& end) const;
+  bool TakeBack(Slice& slice, size_t& begin, size_t& end) const;
+
+  std::vector<Slice> slices_;
+  std::vector<std::thread> workers_;
+
+  // The current loop; set before the generation is bumped.
+  const Function* function_ = nullptr;
+  size_t batch_ = 0;
+  std::exception_ptr error_;
+
+  std::mutex mutex_;
+  std::condition_variable started_;
+  std::condition_variable finished_;
+  uint64_t generation_ = 0;  // loops started, guarded by mutex_
+  size_t running_ = 0;       // workers still in the loop, guarded by mutex_
+  bool stopping_ = false;
+  std::atomic<size_t> steals_{0};
+};
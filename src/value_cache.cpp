@@ -0,0 +1,121 @@
+#include "value_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "log/easylogging++.h"
+
+ValueCache::ValueCache(MemoryCounter* counter)
+    : entries_(TrackingAllocator<Entry>(counter)),
+      referenced_(TrackingAllocator<bool>(counter)),
+      free_(TrackingAllocator<Handle>(counter)) {}
+
+const ValueCache::Value* ValueCache::Find(Handle handle) {
+  if (!IsEntry(handle)) {
+    ++misses_;
+    return nullptr;
+  }
+
+  ++hits_;
+  referenced_[handle] = true;
+  return &entries_[handle].value;
+}
+
+void ValueCache::Insert(Value value, Handle* owner) {
+  assert(!IsEntry(*owner));
+
+  if (capacity_ == 0) {
+    *owner = EVICTED;
+    return;
+  }
+
+  Handle handle;
+  if (!free_.empty()) {
+    handle = free_.back();
+    free_.pop_back();
+  } else if (entries_.size() < capacity_) {
+    // Grow no further than the budget allows.
+    if (entries_.size() == entries_.capacity()) {
+      const size_t capacity =
+          std::min(capacity_, std::max<size_t>(16, entries_.size() * 2));
+      entries_.reserve(capacity);
+      referenced_.reserve(capacity);
+    }
+
+    handle = Handle(entries_.size());
+    entries_.push_back({value, nullptr});
+    referenced_.push_back(false);
+  } else {
+    handle = Evict();
+  }
+
+  entries_[handle] = {value, owner};
+  referenced_[handle] = true;
+  *owner = handle;
+}
+
+void ValueCache::Erase(Handle* owner) {
+  if (IsEntry(*owner)) {
+    entries_[*owner].owner = nullptr;
+    free_.push_back(*owner);
+  }
+  *owner = EMPTY;
+}
+
+void ValueCache::SetBudget(size_t bytes) {
+  budget_ = bytes;
+  capacity_ = bytes == UNLIMITED ? UNLIMITED : bytes / sizeof(Entry);
+  if (entries_.size() <= capacity_) {
+    return;
+  }
+
+  LOG(DEBUG) << "Shrinking value cache to " << capacity_ << " entries";
+  for (size_t handle = capacity_; handle < entries_.size(); ++handle) {
+    if (Handle* owner = entries_[handle].owner) {
+      *owner = EVICTED;
+      ++evictions_;
+    }
+  }
+
+  entries_.erase(entries_.begin() + capacity_, entries_.end());
+  entries_.shrink_to_fit();
+  referenced_.resize(capacity_);
+  referenced_.shrink_to_fit();
+  free_.erase(std::remove_if(free_.begin(), free_.end(),
+                             [this](Handle handle) {
+                               return handle >= capacity_;
+                             }),
+              free_.end());
+  hand_ = 0;
+}
+
+ValueCacheStats ValueCache::GetStats() const {
+  ValueCacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  stats.entries = entries_.size() - free_.size();
+  stats.bytes = entries_.size() * sizeof(Entry);
+  stats.budget = budget_;
+  return stats;
+}
+
+ValueCache::Handle ValueCache::Evict() {
+  // Only called while every entry is owned. The first pass clears the
+  // reference bits it meets, so the sweep stops within two passes.
+  for (;;) {
+    if (hand_ >= entries_.size()) {
+      hand_ = 0;
+    }
+
+    const Handle handle = Handle(hand_++);
+    if (referenced_[handle]) {
+      referenced_[handle] = false;
+      continue;
+    }
+
+    *entries_[handle].owner = EVICTED;
+    ++evictions_;
+    return handle;
+  }
+}
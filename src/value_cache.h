@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "formula.h"
+#include "memory.h"
+
+struct ValueCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;     // lookups that had to evaluate the formula
+  size_t evictions = 0;  // results dropped to stay within the budget
+  size_t entries = 0;
+  size_t bytes = 0;      // allocated entries times GetEntryBytes()
+  size_t budget = 0;
+};
+
+// Evaluated formula results of one sheet, kept outside the cells so their
+// total size can be bounded. Every entry belongs to the handle that holds
+// its index. When the byte budget is reached, a CLOCK sweep evicts an entry
+// that has not been read since the hand last passed it and sets its
+// owner's handle to EVICTED; the owner recomputes on the next read.
+//
+// EVICTED differs from EMPTY for invalidation: a cell whose result was
+// evicted may still have cached dependents, so invalidation has to go on
+// past it, while nothing downstream of an EMPTY cell can be cached.
+class ValueCache {
+ public:
+  using Value = FormulaInterface::Value;
+  using Handle = uint32_t;
+
+  static constexpr Handle EMPTY = UINT32_MAX;
+  static constexpr Handle EVICTED = UINT32_MAX - 1;
+  static constexpr size_t UNLIMITED = SIZE_MAX;
+
+  explicit ValueCache(MemoryCounter* counter = nullptr);
+
+  // The cached result, or nullptr if the handle holds none. Counts a hit
+  // or a miss.
+  const Value* Find(Handle handle);
+
+  // Counts a miss for a result evaluated ahead of the read that would
+  // have missed it.
+  void CountMiss() { ++misses_; }
+
+  // The cached result without counting or marking it, so several threads
+  // may look up at once while nothing is inserted or erased.
+  const Value* Peek(Handle handle) const {
+    return IsEntry(handle) ? &entries_[handle].value : nullptr;
+  }
+
+  // Whether the handle holds a result. Unlike Find, counts nothing.
+  static bool IsEntry(Handle handle) { return handle < EVICTED; }
+
+  // Stores a result for the owner and sets *owner to its handle. Evicts
+  // another entry if the budget is full.
+  void Insert(Value value, Handle* owner);
+
+  // Drops the entry of the owner, if any, and sets *owner to EMPTY.
+  void Erase(Handle* owner);
+
+  // Evicts entries right away if the cache holds more than the new budget.
+  void SetBudget(size_t bytes);
+  // Whether a budget is set, so results may be evicted.
+  bool IsBounded() const { return budget_ != UNLIMITED; }
+
+  ValueCacheStats GetStats() const;
+
+  static constexpr size_t GetEntryBytes() { return sizeof(Entry); }
+
+ private:
+  struct Entry {
+    Value value;
+    Handle* owner;  // nullptr while the entry is free
+  };
+
+  template <typename T>
+  using Vector = std::vector<T, TrackingAllocator<T>>;
+
+  Handle Evict();
+
+  Vector<Entry> entries_;
+  // CLOCK reference bits, set by Find.
+  std::vector<bool, TrackingAllocator<bool>> referenced_;
+  Vector<Handle> free_;
+  size_t capacity_ = UNLIMITED;  // entries that fit into the budget
+  size_t budget_ = UNLIMITED;
+  size_t hand_ = 0;
+
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t evictions_ = 0;
+};